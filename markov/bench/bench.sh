@@ -0,0 +1,216 @@
+#!/bin/bash
+#
+# bench.sh --
+#
+# Benchmark the markov engine on synthetic corpora, writing the results to
+# work/results.csv and comparing them against baseline.csv if there is one.
+# Any result more than BENCH_TOLERANCE percent worse than its baseline is a
+# regression, and makes the script exit with status 1.
+#
+# Usage:
+#
+#       bench.sh [--save-baseline] [SIZE ...]
+#
+#           --save-baseline     Save the results as the new baseline.
+#           SIZE                Corpus sizes to run, such as 1M, 100M or 1G.
+#                               Default is 1M 100M 1G.
+#
+# The environment can override BENCH_KINDS (random english repetitive),
+# BENCH_ORDERS (2 4 8), BENCH_LOOKUPS (1000000), BENCH_SAMPLES (16),
+# BENCH_BATCH (16), BENCH_OUTPUTSIZE (100000), BENCH_TOLERANCE (20) and
+# BENCH_WORK (./work).
+#
+# Lookups are timed comparing prefixes with strncmp and with each set of
+# compare kernels: lookup_METHOD_per_s is the fastest kernel's rate, and
+# its gain over strncmp is printed alongside.  Generation is timed one
+# sample at a time and with --batch=BENCH_BATCH, and the gain from batching
+# is printed alongside.  Batching hides cache misses, so expect no gain at
+# 1M, where the model fits in cache, and the gain to show from 100M up.
+#
+# Each row of results.csv is corpus,size,order,metric,value.  Metrics
+# ending in _s are times, where lower is better; metrics ending in _per_s
+# are rates, where higher is better.
+
+here=$(cd "$(dirname "$0")" && pwd)
+markov=$here/../markov
+gencorpus=$here/gencorpus
+work=${BENCH_WORK:-$here/work}
+kinds=${BENCH_KINDS:-"random english repetitive"}
+orders=${BENCH_ORDERS:-"2 4 8"}
+lookups=${BENCH_LOOKUPS:-1000000}
+samples=${BENCH_SAMPLES:-16}
+batch=${BENCH_BATCH:-16}
+outputsize=${BENCH_OUTPUTSIZE:-100000}
+tolerance=${BENCH_TOLERANCE:-20}
+baseline=$here/baseline.csv
+results=$work/results.csv
+
+save=0
+if [ "$1" = "--save-baseline" ]; then
+    save=1
+    shift
+fi
+sizes=${*:-"1M 100M 1G"}
+
+for tool in "$markov" "$gencorpus"; do
+    if [ ! -x "$tool" ]; then
+        echo "bench.sh: $tool is missing; run make bench." >&2
+        exit 1
+    fi
+done
+
+mkdir -p "$work/out" || exit 1
+echo "corpus,size,order,metric,value" > "$results"
+
+# jsonValue FILE KEY -- print the number following "KEY": in FILE.
+
+jsonValue() {
+    sed -n "s/.*\"$2\": \([0-9.e+-]*\).*/\1/p" "$1"
+}
+
+# record CORPUS SIZE ORDER METRIC VALUE
+
+record() {
+    echo "$1,$2,$3,$4,$5" >> "$results"
+    printf "%-11s %5s %5s %-34s %s\n" "$1" "$2" "$3" "$4" "$5"
+}
+
+for size in $sizes; do
+    for kind in $kinds; do
+        corpus=$work/$kind-$size.txt
+        model=$work/$kind-$size.mdl
+        if [ ! -f "$corpus" ]; then
+            "$gencorpus" "$kind" "$size" > "$corpus.tmp" \
+                && mv "$corpus.tmp" "$corpus" || exit 1
+        fi
+
+        # Suffix construction, with the LCP array, from a mapped file.
+
+        "$markov" --input="$corpus" --engine=suffix --setsize=0 \
+            --save-model="$model" --stats-json="$work/build.json" \
+            2> "$work/build.log" || { cat "$work/build.log" >&2; exit 1; }
+        index=$(sed -n 's/.*"index": {"wall": \([0-9.]*\).*/\1/p' \
+            "$work/build.json")
+        record "$kind" "$size" - build_s "$index"
+
+        for order in $orders; do
+            # Lookup throughput for each search method, comparing prefixes
+            # with strncmp and with the fastest of the compare kernels.
+
+            "$markov" --load-model="$model" --order="$order" --seed=1 \
+                --search-bench="$lookups" 2> "$work/lookup.log" \
+                || { cat "$work/lookup.log" >&2; exit 1; }
+            for method in binary bucket eytzinger; do
+                strncmp_rate=$(awk -v method="$method" '
+                    $1 == "markov:" && $2 == method && $3 == "strncmp" {
+                        print $4
+                    }' "$work/lookup.log")
+                best=$(awk -v method="$method" '
+                    $1 == "markov:" && $2 == method && $3 != "strncmp" \
+                            && $4 + 0 > rate + 0 {
+                        rate = $4
+                        kernel = $3
+                    }
+                    END {
+                        print rate, kernel
+                    }' "$work/lookup.log")
+                rate=${best% *}
+                record "$kind" "$size" "$order" \
+                    "lookup_${method}_strncmp_per_s" "$strncmp_rate"
+                record "$kind" "$size" "$order" \
+                    "lookup_${method}_per_s" "$rate"
+                awk -v strncmp="$strncmp_rate" -v best="$rate" \
+                    -v kernel="${best#* }" \
+                    -v name="lookup_${method}_kernel_gain" 'BEGIN {
+                        if (strncmp > 0) {
+                            printf "%-23s %-34s %.2fx (%s)\n", "", name, \
+                                best / strncmp, kernel
+                        }
+                    }'
+            done
+
+            # Generation throughput for each engine, one sample at a time
+            # and batched.
+
+            for engine in suffix table; do
+                for run in single batch; do
+                    if [ $run = single ]; then
+                        n=1
+                        metric=generate_${engine}_chars_per_s
+                    else
+                        n=$batch
+                        metric=generate_${engine}_batch_chars_per_s
+                    fi
+                    (cd "$work/out" && "$markov" --load-model="$model" \
+                        --engine="$engine" --order="$order" --seed=1 \
+                        --setsize="$samples" --outputsize="$outputsize" \
+                        --batch="$n" --stats-json="$work/generate.json" \
+                        2> "$work/generate.log") \
+                        || { cat "$work/generate.log" >&2; exit 1; }
+                    rate=$(jsonValue "$work/generate.json" \
+                        chars_per_second_per_sample)
+                    record "$kind" "$size" "$order" "$metric" "$rate"
+                    eval "${run}_rate=\$rate"
+                done
+                awk -v single="$single_rate" -v batch="$batch_rate" \
+                    -v name="generate_${engine}_batch_gain" 'BEGIN {
+                        if (single > 0) {
+                            printf "%-23s %-34s %.2fx\n", "", name, \
+                                batch / single
+                        }
+                    }'
+            done
+        done
+    done
+done
+
+if [ $save -eq 1 ]; then
+    cp "$results" "$baseline"
+    echo "bench.sh: saved baseline to $baseline."
+    exit 0
+fi
+
+if [ ! -f "$baseline" ]; then
+    echo "bench.sh: no baseline to compare against; run make bench-baseline."
+    exit 0
+fi
+
+# Compare every result that has a baseline.  Times under 10ms are too noisy
+# to judge.
+
+awk -F, -v tolerance="$tolerance" '
+    NR == FNR {
+        base[$1 "," $2 "," $3 "," $4] = $5
+        next
+    }
+    FNR == 1 {
+        next
+    }
+    {
+        key = $1 "," $2 "," $3 "," $4
+        if (!(key in base) || base[key] <= 0) {
+            next
+        }
+        old = base[key]
+        if ($4 ~ /_per_s$/) {
+            change = (old - $5) / old * 100
+        } else if (old >= 0.01) {
+            change = ($5 - old) / old * 100
+        } else {
+            next
+        }
+        if (change > tolerance) {
+            printf "REGRESSION: %s is %.1f%% worse (%s, baseline %s)\n", \
+                key, change, $5, old
+            failed = 1
+        }
+    }
+    END {
+        exit failed
+    }' "$baseline" "$results"
+status=$?
+if [ $status -ne 0 ]; then
+    echo "bench.sh: PERFORMANCE REGRESSIONS FOUND, see above." >&2
+    exit 1
+fi
+echo "bench.sh: no regressions against $baseline."
@@ -0,0 +1,268 @@
+// gencorpus.cpp --
+//
+// This file generates synthetic sample text for the markov benchmarks.  The
+// same kind, size and seed always produce the same bytes, so results from
+// different runs and different hosts are comparable.
+//
+//
+// Usage:
+//
+//      gencorpus KIND SIZE [SEED] > sample_text
+//
+//          KIND                "random" for uniformly random printable
+//                              characters, "english" for English-like text
+//                              drawn from a Zipf distribution over common
+//                              words, or "repetitive" for one short passage
+//                              repeated with rare single-character changes.
+//          SIZE                Number of bytes to generate.  A suffix of K,
+//                              M or G multiplies by 2^10, 2^20 or 2^30.
+//          SEED                Random seed.  Default is 1.
+//
+// Copyright (c) 2004-2009 Electric Cloud, Inc.
+// All rights reserved.
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Electric Cloud nor the names of its employees may
+//       be used to endorse or promote products derived from this software
+//       without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// The words English-like text is drawn from, most common first.
+
+static const char *WORDS[] = {
+    "the", "of", "and", "to", "a", "in", "is", "it", "you", "that", "he",
+    "was", "for", "on", "are", "with", "as", "I", "his", "they", "be", "at",
+    "one", "have", "this", "from", "or", "had", "by", "not", "word", "but",
+    "what", "some", "we", "can", "out", "other", "were", "all", "there",
+    "when", "up", "use", "your", "how", "said", "an", "each", "she", "which",
+    "do", "their", "time", "if", "will", "way", "about", "many", "then",
+    "them", "write", "would", "like", "so", "these", "her", "long", "make",
+    "thing", "see", "him", "two", "has", "look", "more", "day", "could", "go",
+    "come", "did", "number", "sound", "no", "most", "people", "my", "over",
+    "know", "water", "than", "call", "first", "who", "may", "down", "side",
+    "been", "now", "find", "any", "new", "work", "part", "take", "get",
+    "place", "made", "live", "where", "after", "back", "little", "only",
+    "round", "man", "year", "came", "show", "every", "good", "me", "give",
+    "our", "under", "name", "very", "through", "just", "form", "sentence",
+    "great", "think", "say", "help", "low", "line", "differ", "turn", "cause",
+    "much", "mean", "before", "move", "right", "boy", "old", "too", "same",
+    "tell", "does", "set", "three", "want", "air", "well", "also", "play",
+    "small", "end", "put", "home", "read", "hand", "port", "large", "spell",
+    "add", "even", "land", "here", "must", "big", "high", "such", "follow",
+    "act", "why", "ask", "men", "change", "went", "light", "kind", "off",
+    "need", "house", "picture", "try", "us", "again", "animal", "point",
+    "mother", "world", "near", "build", "self", "earth", "father", "head",
+    "stand", "own", "page", "should", "country", "found", "answer", "school",
+    "grow", "study", "still", "learn", "plant", "cover", "food", "sun",
+    "four", "between", "state", "keep", "eye", "never", "last", "let",
+    "thought", "city", "tree", "cross", "farm", "hard", "start", "might",
+    "story", "saw", "far", "sea", "draw", "left", "late", "run", "while",
+    "press", "close", "night", "real", "life", "few", "north"
+};
+
+static const int WORD_COUNT = sizeof(WORDS) / sizeof(WORDS[0]);
+
+//----------------------------------------------------------------------------
+// Random
+//
+//      A small xorshift64* generator, so that the output does not depend on
+//      the C library's rand().
+//----------------------------------------------------------------------------
+
+struct Random {
+    uint64_t        state;
+
+    Random(uint64_t seed) : state(seed * 0x9e3779b97f4a7c15ull + 1) { }
+
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545f4914f6cdd1dull;
+    }
+
+    // A uniform draw from [0, n).
+
+    uint64_t below(uint64_t n)
+    {
+        return (uint64_t) ((next() >> 11) * (1.0 / 9007199254740992.0) * n);
+    }
+};
+
+//----------------------------------------------------------------------------
+// Writer
+//
+//      Buffered output that stops once the requested size is reached.  With
+//      no file, everything is kept in the buffer.
+//----------------------------------------------------------------------------
+
+struct Writer {
+    FILE           *file;
+    uint64_t        remaining;
+    string          buffer;
+
+    Writer(FILE *f, uint64_t size) : file(f), remaining(size) { }
+
+    bool full() const
+    {
+        return remaining == 0;
+    }
+
+    void put(const char *text, size_t length)
+    {
+        if (length > remaining) {
+            length = remaining;
+        }
+        buffer.append(text, length);
+        remaining -= length;
+        if (file != NULL && (buffer.size() >= (1 << 20) || remaining == 0)) {
+            fwrite(buffer.data(), 1, buffer.size(), stdout);
+            buffer.clear();
+        }
+    }
+
+    void put(char c)
+    {
+        put(&c, 1);
+    }
+};
+
+//----------------------------------------------------------------------------
+// englishText
+//
+//      Generate sentences of Zipf-distributed words, wrapped to lines of
+//      about 72 characters, with a blank line between paragraphs.
+//----------------------------------------------------------------------------
+
+static void englishText(Writer *out, Random *random)
+{
+    vector<double> cumulative(WORD_COUNT);
+    double total = 0;
+    for (int i = 0; i < WORD_COUNT; ++i) {
+        total += 1.0 / (i + 1);
+        cumulative[i] = total;
+    }
+
+    int column = 0;
+    while (!out->full()) {
+        int words = 5 + (int) random->below(16);
+        for (int w = 0; w < words && !out->full(); ++w) {
+            double draw = random->below(1ull << 53) / 9007199254740992.0
+                    * total;
+            int pick = lower_bound(cumulative.begin(), cumulative.end(), draw)
+                    - cumulative.begin();
+            if (pick >= WORD_COUNT) {
+                pick = WORD_COUNT - 1;
+            }
+
+            string word = WORDS[pick];
+            if (w == 0) {
+                word[0] = toupper(word[0]);
+            }
+            if (w == words - 1) {
+                word += '.';
+            } else if (random->below(12) == 0) {
+                word += ',';
+            }
+
+            if (column > 0 && column + 1 + word.size() > 72) {
+                out->put('\n');
+                column = 0;
+            } else if (column > 0) {
+                out->put(' ');
+                ++column;
+            }
+            out->put(word.data(), word.size());
+            column += word.size();
+        }
+        if (random->below(6) == 0) {
+            out->put("\n\n", 2);
+            column = 0;
+        }
+    }
+}
+
+static uint64_t parseSize(const char *text)
+{
+    char *end;
+    uint64_t size = strtoull(text, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': size <<= 10; break;
+        case 'm': case 'M': size <<= 20; break;
+        case 'g': case 'G': size <<= 30; break;
+    }
+    return size;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s random|english|repetitive SIZE [SEED]\n",
+                argv[0]);
+        return 1;
+    }
+    Random random(argc > 3 ? strtoull(argv[3], 0, 10) : 1);
+    Writer out(stdout, parseSize(argv[2]));
+
+    if (strcmp(argv[1], "random") == 0) {
+        // Printable characters, with a newline about every 80.
+
+        while (!out.full()) {
+            uint64_t c = random.below(96);
+            out.put((c == 95) ? '\n' : (char) (' ' + c));
+        }
+    } else if (strcmp(argv[1], "english") == 0) {
+        englishText(&out, &random);
+    } else if (strcmp(argv[1], "repetitive") == 0) {
+        // A 4 KB passage, repeated with one character in a thousand
+        // changed, so that matching suffixes share very long prefixes.
+
+        Writer passage(NULL, 4096);
+        englishText(&passage, &random);
+        string text = passage.buffer;
+
+        while (!out.full()) {
+            string copy = text;
+            for (size_t i = 0; i < copy.size(); ++i) {
+                if (random.below(1000) == 0) {
+                    copy[i] = 'a' + (char) random.below(26);
+                }
+            }
+            out.put(copy.data(), copy.size());
+        }
+    } else {
+        fprintf(stderr, "gencorpus: unknown kind \"%s\".\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,516 @@
+// decoder.cpp --
+//
+// This file implements markov's input decoder, as described in decoder.h.
+// The decoder thread reads compressed input a megabyte at a time and
+// inflates it into a ring of DECODER_CHUNKS chunks, filling each in turn
+// and handing it over whole; it waits only when every chunk is full and
+// not yet taken, so reading, inflating and the reader's own work on the
+// text all overlap.
+//
+// Copyright (c) 2004-2009 Electric Cloud, Inc.
+// All rights reserved.
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Electric Cloud nor the names of its employees may
+//       be used to endorse or promote products derived from this software
+//       without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "decoder.h"
+
+//----------------------------------------------------------------------------
+// ZstdApi
+//
+//      The parts of libzstd's streaming interface that the decoder uses,
+//      looked up in the shared library, and the buffers they take, laid
+//      out as zstd.h lays out ZSTD_inBuffer and ZSTD_outBuffer.
+//----------------------------------------------------------------------------
+
+struct ZstdInBuffer {
+    const void     *src;
+    size_t          size;
+    size_t          pos;
+};
+
+struct ZstdOutBuffer {
+    void           *dst;
+    size_t          size;
+    size_t          pos;
+};
+
+struct ZstdApi {
+    void         *(*createDStream)();
+    size_t        (*freeDStream)(void *stream);
+    size_t        (*decompressStream)(void *stream, ZstdOutBuffer *output,
+                          ZstdInBuffer *input);
+    unsigned int  (*isError)(size_t code);
+    const char   *(*getErrorName)(size_t code);
+};
+
+//----------------------------------------------------------------------------
+// Decoder
+//
+//      A decoder: its input, the bytes already read from it to recognize
+//      the format, and the ring of chunks, guarded by one mutex.  Chunk
+//      produced % DECODER_CHUNKS is the next to fill and chunk consumed %
+//      DECODER_CHUNKS the next to hand over; the reader holds the one it
+//      was last handed until it asks for another.
+//----------------------------------------------------------------------------
+
+static const int DECODER_CHUNKS = 4;
+static const size_t DECODER_CHUNK_BYTES = 4 << 20;
+static const size_t DECODER_INPUT_BYTES = 1 << 20;
+
+struct Decoder {
+    int                 fd;
+    Compression         compression;
+    char                head[16];       // Read before the decoder started.
+    size_t              headLength;
+    char               *input;          // DECODER_INPUT_BYTES.
+
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      filled;         // Chunk filled, or finished.
+    pthread_cond_t      emptied;        // Chunk released, or stopping.
+    char               *chunks[DECODER_CHUNKS];
+    size_t              lengths[DECODER_CHUNKS];
+    unsigned int        produced;
+    unsigned int        consumed;
+    bool                held;           // Reader holds chunk consumed.
+    bool                finished;       // No more chunks will be filled.
+    bool                stopping;
+    bool                failed;
+};
+
+//----------------------------------------------------------------------------
+// detectCompression, compressionName
+//
+//      Recognize the format of input beginning with length bytes of head by
+//      its magic number, and name a format for messages.
+//----------------------------------------------------------------------------
+
+Compression detectCompression(const unsigned char *head, size_t length)
+{
+    if (length >= 2 && head[0] == 0x1f && head[1] == 0x8b) {
+        return COMPRESSION_GZIP;
+    }
+    if (length >= 4 && head[0] == 0x28 && head[1] == 0xb5
+            && head[2] == 0x2f && head[3] == 0xfd) {
+        return COMPRESSION_ZSTD;
+    }
+    return COMPRESSION_NONE;
+}
+
+const char *compressionName(Compression compression)
+{
+    switch (compression) {
+        case COMPRESSION_GZIP:
+            return "gzip";
+        case COMPRESSION_ZSTD:
+            return "zstd";
+        default:
+            return "uncompressed";
+    }
+}
+
+//----------------------------------------------------------------------------
+// loadZstd
+//
+//      Look up the zstd functions in libzstd.so.1, once.  Returns false,
+//      with a message, if the library or any of them is missing.
+//----------------------------------------------------------------------------
+
+static bool loadZstd(ZstdApi *api)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static ZstdApi loaded;
+    static int state = 0;           // 0 untried, 1 loaded, -1 failed.
+
+    pthread_mutex_lock(&lock);
+    if (state == 0) {
+        state = -1;
+        void *library = dlopen("libzstd.so.1", RTLD_NOW);
+        if (library == NULL) {
+            fprintf(stderr, "markov: unable to load zstd: %s.\n",
+                    dlerror());
+        } else {
+            *(void **) &loaded.createDStream =
+                    dlsym(library, "ZSTD_createDStream");
+            *(void **) &loaded.freeDStream =
+                    dlsym(library, "ZSTD_freeDStream");
+            *(void **) &loaded.decompressStream =
+                    dlsym(library, "ZSTD_decompressStream");
+            *(void **) &loaded.isError = dlsym(library, "ZSTD_isError");
+            *(void **) &loaded.getErrorName =
+                    dlsym(library, "ZSTD_getErrorName");
+            if (loaded.createDStream == NULL || loaded.freeDStream == NULL
+                    || loaded.decompressStream == NULL
+                    || loaded.isError == NULL
+                    || loaded.getErrorName == NULL) {
+                fprintf(stderr, "markov: libzstd.so.1 lacks the streaming "
+                        "interface.\n");
+                dlclose(library);
+            } else {
+                state = 1;
+            }
+        }
+    }
+    *api = loaded;
+    bool ok = state == 1;
+    pthread_mutex_unlock(&lock);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// readInput
+//
+//      Read the next piece of compressed input into the decoder's input
+//      buffer, starting with the bytes read before it started, retrying
+//      interrupted reads.  Returns the bytes read, 0 at end of file, or -1,
+//      with a message, on an error.
+//----------------------------------------------------------------------------
+
+static ssize_t readInput(Decoder *decoder)
+{
+    if (decoder->headLength > 0) {
+        size_t length = decoder->headLength;
+        memcpy(decoder->input, decoder->head, length);
+        decoder->headLength = 0;
+        return length;
+    }
+    for (;;) {
+        ssize_t got = read(decoder->fd, decoder->input, DECODER_INPUT_BYTES);
+        if (got >= 0) {
+            return got;
+        }
+        if (errno != EINTR) {
+            fprintf(stderr, "markov: error reading input data: %s.\n",
+                    strerror(errno));
+            return -1;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// claimChunk, publishChunk
+//
+//      Wait for a free chunk to fill, returning NULL instead if the decoder
+//      is being stopped; and hand a filled chunk of length bytes over to
+//      the reader.
+//----------------------------------------------------------------------------
+
+static char *claimChunk(Decoder *decoder)
+{
+    pthread_mutex_lock(&decoder->lock);
+    while (decoder->produced - decoder->consumed == DECODER_CHUNKS
+            && !decoder->stopping) {
+        pthread_cond_wait(&decoder->emptied, &decoder->lock);
+    }
+    char *chunk = decoder->stopping
+            ? NULL : decoder->chunks[decoder->produced % DECODER_CHUNKS];
+    pthread_mutex_unlock(&decoder->lock);
+    return chunk;
+}
+
+static void publishChunk(Decoder *decoder, size_t length)
+{
+    pthread_mutex_lock(&decoder->lock);
+    decoder->lengths[decoder->produced % DECODER_CHUNKS] = length;
+    decoder->produced++;
+    pthread_cond_signal(&decoder->filled);
+    pthread_mutex_unlock(&decoder->lock);
+}
+
+//----------------------------------------------------------------------------
+// inflateGzip
+//
+//      Decompress gzip input into chunks, one member after another until
+//      the input ends.  Returns false, with a message, if the input is
+//      corrupt or ends inside a member.  Stopping the decoder stops this
+//      early, and successfully.
+//----------------------------------------------------------------------------
+
+static bool inflateGzip(Decoder *decoder)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK) {
+        fprintf(stderr, "markov: unable to start gzip decompression.\n");
+        return false;
+    }
+
+    char *chunk = claimChunk(decoder);
+    size_t used = 0;
+    bool eof = false;
+    bool ended = false;             // At the end of a member.
+    bool pending = false;           // Output may be waiting inside zlib.
+    bool ok = true;
+    while (chunk != NULL) {
+        if (used == DECODER_CHUNK_BYTES) {
+            publishChunk(decoder, used);
+            chunk = claimChunk(decoder);
+            used = 0;
+            continue;
+        }
+        if (stream.avail_in == 0 && !eof) {
+            ssize_t got = readInput(decoder);
+            if (got < 0) {
+                ok = false;
+                break;
+            }
+            eof = got == 0;
+            stream.next_in = (Bytef *) decoder->input;
+            stream.avail_in = got;
+        }
+        if (stream.avail_in == 0 && eof && !pending) {
+            break;
+        }
+        if (ended) {
+            inflateReset(&stream);
+            ended = false;
+        }
+
+        stream.next_out = (Bytef *) chunk + used;
+        stream.avail_out = DECODER_CHUNK_BYTES - used;
+        int status = inflate(&stream, Z_NO_FLUSH);
+        used = DECODER_CHUNK_BYTES - stream.avail_out;
+        pending = stream.avail_out == 0;
+        if (status == Z_STREAM_END) {
+            ended = true;
+            pending = false;
+        } else if (status == Z_BUF_ERROR) {
+            pending = false;
+        } else if (status != Z_OK) {
+            fprintf(stderr, "markov: corrupt gzip input: %s.\n",
+                    (stream.msg != NULL) ? stream.msg : "unknown error");
+            ok = false;
+            break;
+        }
+    }
+    if (ok && chunk != NULL && !ended) {
+        fprintf(stderr, "markov: gzip input is truncated.\n");
+        ok = false;
+    }
+    if (ok && chunk != NULL && used > 0) {
+        publishChunk(decoder, used);
+    }
+    inflateEnd(&stream);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// inflateZstd
+//
+//      Decompress zstd input into chunks, one frame after another until
+//      the input ends, as inflateGzip does gzip.
+//----------------------------------------------------------------------------
+
+static bool inflateZstd(Decoder *decoder)
+{
+    ZstdApi zstd;
+    if (!loadZstd(&zstd)) {
+        return false;
+    }
+    void *stream = zstd.createDStream();
+    if (stream == NULL) {
+        fprintf(stderr, "markov: unable to start zstd decompression.\n");
+        return false;
+    }
+
+    char *chunk = claimChunk(decoder);
+    ZstdInBuffer in = { decoder->input, 0, 0 };
+    ZstdOutBuffer out = { chunk, DECODER_CHUNK_BYTES, 0 };
+    size_t status = 0;              // 0 at the end of a frame.
+    bool eof = false;
+    bool pending = false;           // Output may be waiting inside zstd.
+    bool ok = true;
+    while (chunk != NULL) {
+        if (out.pos == out.size) {
+            publishChunk(decoder, out.pos);
+            chunk = claimChunk(decoder);
+            out.dst = chunk;
+            out.pos = 0;
+            continue;
+        }
+        if (in.pos == in.size && !eof) {
+            ssize_t got = readInput(decoder);
+            if (got < 0) {
+                ok = false;
+                break;
+            }
+            eof = got == 0;
+            in.size = got;
+            in.pos = 0;
+        }
+        if (in.pos == in.size && eof && !pending) {
+            break;
+        }
+
+        status = zstd.decompressStream(stream, &out, &in);
+        if (zstd.isError(status)) {
+            fprintf(stderr, "markov: corrupt zstd input: %s.\n",
+                    zstd.getErrorName(status));
+            ok = false;
+            break;
+        }
+        pending = out.pos == out.size && status != 0;
+    }
+    if (ok && chunk != NULL && status != 0) {
+        fprintf(stderr, "markov: zstd input is truncated.\n");
+        ok = false;
+    }
+    if (ok && chunk != NULL && out.pos > 0) {
+        publishChunk(decoder, out.pos);
+    }
+    zstd.freeDStream(stream);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// decoderThread
+//
+//      Thread body: decompress the whole input, then mark the decoder
+//      finished, so the reader sees the end once it has taken every chunk.
+//----------------------------------------------------------------------------
+
+static void *decoderThread(void *arg)
+{
+    Decoder *decoder = (Decoder *) arg;
+    bool ok = (decoder->compression == COMPRESSION_GZIP)
+            ? inflateGzip(decoder) : inflateZstd(decoder);
+
+    pthread_mutex_lock(&decoder->lock);
+    decoder->failed = !ok;
+    decoder->finished = true;
+    pthread_cond_signal(&decoder->filled);
+    pthread_mutex_unlock(&decoder->lock);
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// startDecoder
+//
+//      Start decompressing input in the given format from fd, whose first
+//      headLength bytes, at most 16, have already been read into head.
+//      fd stays open and is only read until the decoder is stopped.
+//      Returns NULL, with a message, if the thread cannot be started.
+//----------------------------------------------------------------------------
+
+Decoder *startDecoder(int fd, Compression compression, const char *head,
+        size_t headLength)
+{
+    Decoder *decoder = new Decoder;
+    decoder->fd = fd;
+    decoder->compression = compression;
+    memcpy(decoder->head, head, headLength);
+    decoder->headLength = headLength;
+    decoder->input = new char[DECODER_INPUT_BYTES];
+    pthread_mutex_init(&decoder->lock, 0);
+    pthread_cond_init(&decoder->filled, 0);
+    pthread_cond_init(&decoder->emptied, 0);
+    for (int i = 0; i < DECODER_CHUNKS; ++i) {
+        decoder->chunks[i] = new char[DECODER_CHUNK_BYTES];
+        decoder->lengths[i] = 0;
+    }
+    decoder->produced = 0;
+    decoder->consumed = 0;
+    decoder->held = false;
+    decoder->finished = false;
+    decoder->stopping = false;
+    decoder->failed = false;
+    if (pthread_create(&decoder->thread, 0, decoderThread, decoder) != 0) {
+        fprintf(stderr, "markov: unable to start decoder thread.\n");
+        pthread_mutex_destroy(&decoder->lock);
+        pthread_cond_destroy(&decoder->filled);
+        pthread_cond_destroy(&decoder->emptied);
+        for (int i = 0; i < DECODER_CHUNKS; ++i) {
+            delete [] decoder->chunks[i];
+        }
+        delete [] decoder->input;
+        delete decoder;
+        return NULL;
+    }
+    return decoder;
+}
+
+//----------------------------------------------------------------------------
+// nextChunk
+//
+//      Give back the chunk taken last, if any, and wait for the next one.
+//      Points data at it and returns its length, which stays valid until
+//      the next call, or returns 0 at the end of the decompressed text or
+//      after the decoder has failed.
+//----------------------------------------------------------------------------
+
+size_t nextChunk(Decoder *decoder, const char **data)
+{
+    pthread_mutex_lock(&decoder->lock);
+    if (decoder->held) {
+        decoder->consumed++;
+        decoder->held = false;
+        pthread_cond_signal(&decoder->emptied);
+    }
+    while (decoder->produced == decoder->consumed && !decoder->finished) {
+        pthread_cond_wait(&decoder->filled, &decoder->lock);
+    }
+    size_t length = 0;
+    if (decoder->produced != decoder->consumed && !decoder->failed) {
+        unsigned int slot = decoder->consumed % DECODER_CHUNKS;
+        *data = decoder->chunks[slot];
+        length = decoder->lengths[slot];
+        decoder->held = true;
+    }
+    pthread_mutex_unlock(&decoder->lock);
+    return length;
+}
+
+//----------------------------------------------------------------------------
+// stopDecoder
+//
+//      Stop the decoder thread, whether or not the reader has taken every
+//      chunk, and free the decoder.  Returns false if decompression failed.
+//----------------------------------------------------------------------------
+
+bool stopDecoder(Decoder *decoder)
+{
+    pthread_mutex_lock(&decoder->lock);
+    decoder->stopping = true;
+    pthread_cond_signal(&decoder->emptied);
+    pthread_mutex_unlock(&decoder->lock);
+    pthread_join(decoder->thread, 0);
+
+    bool failed = decoder->failed;
+    pthread_mutex_destroy(&decoder->lock);
+    pthread_cond_destroy(&decoder->filled);
+    pthread_cond_destroy(&decoder->emptied);
+    for (int i = 0; i < DECODER_CHUNKS; ++i) {
+        delete [] decoder->chunks[i];
+    }
+    delete [] decoder->input;
+    delete decoder;
+    return !failed;
+}
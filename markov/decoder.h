@@ -0,0 +1,60 @@
+// decoder.h --
+//
+// Decompression of compressed sample text.  A decoder reads gzip or zstd
+// input from a file descriptor and inflates it on a thread of its own into
+// a small ring of chunks, which the reader takes in order as they fill, so
+// the reader can work on the text that has arrived while the rest is
+// still being inflated.  Concatenated gzip members and zstd frames are
+// read as one text.
+//
+// gzip comes from zlib.  zstd comes from libzstd.so.1, which is loaded
+// when a zstd input is first seen, so markov builds and runs without it
+// when it is not needed.
+//
+// Copyright (c) 2004-2009 Electric Cloud, Inc.
+// All rights reserved.
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Electric Cloud nor the names of its employees may
+//       be used to endorse or promote products derived from this software
+//       without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef MARKOV_DECODER_H
+#define MARKOV_DECODER_H
+
+#include <stddef.h>
+
+enum Compression {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_ZSTD
+};
+
+struct Decoder;
+
+Compression detectCompression(const unsigned char *head, size_t length);
+const char *compressionName(Compression compression);
+Decoder *startDecoder(int fd, Compression compression, const char *head,
+        size_t headLength);
+size_t nextChunk(Decoder *decoder, const char **data);
+bool stopDecoder(Decoder *decoder);
+
+#endif
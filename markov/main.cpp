@@ -2,32 +2,217 @@
 //
 // This file implements a simple character level markov text generator.  It
 // reads sample text from standard input, then generates any number of
-// K-order markov texts to a series of files.
+// K-order markov texts to a series of files.  The model and the generator
+// themselves are in the library declared in markov.h; this is the
+// command-line driver around it.
 //
 //
 // Usage:
 //
 //      markov [options] < sample_text
+//      markov [options] --input=sample_text
 //
 //          --order=K           Specify the number of preceeding tokens to 
 //                              consider in determining the next token.
-//                              Default is 3.
+//                              Default is 3.  K may also be a list of
+//                              orders and ranges, such as 2,3,4,6 or 2-4,6:
+//                              the suffix array is built once, and a set of
+//                              samples is generated for each order, to
+//                              files named output.K.0 through
+//                              output.K.N-1.  Sample N of each order has
+//                              the same seed as output.N of a single-order
+//                              run.
 //          --outputsize=N      Number of bytes to output.  The generator will
 //                              not necessarily generate exactly this many 
 //                              bytes.  For example, it may wander too close
 //                              to the end of the original input when
 //                              generating output, and lose the ability to
-//                              generate more text.  Also, the generator 
+//                              generate more text, unless --backoff is
+//                              given.  Also, the generator 
 //                              always tries to end the file with a newline,
 //                              so it will continue to generate output after
 //                              hitting N bytes, until a newline is output
 //                              or 2*N bytes have been output.  Default is
 //                              10000 bytes.
-//          --inputsize=N       Maximum number of bytes of input to read.
-//                              Default is 5,000,000 bytes.
+//          --input=FILE        Read the sample text from FILE, which is
+//                              memory-mapped rather than copied.  Default
+//                              is to read standard input to end of file.
+//                              Text compressed with gzip or zstd, in a
+//                              file or on standard input, is recognized by
+//                              its magic number and decompressed on a
+//                              thread of its own while the text that has
+//                              arrived is copied in and its two-byte
+//                              prefixes are counted for the suffix index.
+//                              zstd needs libzstd.so.1 at run time.
+//          --inputsize=N       Maximum number of bytes of input to use,
+//                              counted after decompression.  Default is 0,
+//                              meaning all of it.
 //          --setsize=N         Number of output samples to produce.  Files
 //                              named "output.0" through "output.N-1" will
 //                              be created.  Default is 1.
+//          --output=-          Write every sample to standard output
+//                              instead of to its file, as a series of
+//                              records: a line "NAME LENGTH", where NAME is
+//                              the file name the sample would have had,
+//                              followed by LENGTH bytes of its text.  A
+//                              sample's records are in order, but samples
+//                              generated at once interleave, and a record
+//                              of length 0 ends a sample.  Either way,
+//                              samples are written as they are generated,
+//                              a megabyte at a time, by a writer thread of
+//                              their own, so a sample of any size takes
+//                              only that much memory.
+//          --sa-algo=ALGO      Suffix array construction algorithm.  "sais"
+//                              uses the linear-time SA-IS algorithm; "qsort"
+//                              uses a comparison sort, which is kept as a
+//                              reference; "parallel" uses prefix doubling
+//                              on --threads threads; "external" sorts out
+//                              of core, in --sa-memory, for text bigger
+//                              than memory.  All four produce the same
+//                              order: bytewise, NULs included, with a
+//                              suffix that runs out first sorting before
+//                              the longer one.  Default is sais.
+//
+//                              The external sort uses the DC3 algorithm as
+//                              scans and external merge sorts over scratch
+//                              files next to the --save-model file, which it
+//                              needs, so its time grows with the size of the
+//                              text, not with how repetitive it is; the text
+//                              is only read in order, through its mapping, so
+//                              give it with --input, uncompressed, since
+//                              compressed text is decompressed into
+//                              memory.  The model is saved as soon as it is
+//                              sorted, without an LCP array or transition
+//                              table, and generation goes on from the saved
+//                              file as with --load-model.  Use --setsize=0 to
+//                              just build the model.
+//          --sa-memory=MB      Memory for --sa-algo=external to sort in, in
+//                              megabytes.  Default is 1024.
+//          --sa-verify         After construction, check that every pair of
+//                              adjacent suffixes is in that order, and exit
+//                              with an error if not.
+//          --engine=ENGINE     How to choose each next character.  "table"
+//                              collapses the sorted suffixes into a table
+//                              of the distinct successors of every K-gram,
+//                              with an alias table per K-gram so that each
+//                              character costs one hash lookup and one
+//                              random draw.  "suffix" searches the suffix
+//                              array for every character, as the original
+//                              generator did.  "fm" draws the same
+//                              characters as "suffix" from an FM-index of
+//                              the text instead, a little over one byte
+//                              per input byte against four or five for
+//                              the suffix array, at the cost of a backward
+//                              search step per context byte.  It builds no
+//                              suffix array unless one is to be checked or
+//                              saved.  Default is table.
+//          --threads=N         Number of threads to generate samples with,
+//                              and to sort with for --sa-algo=parallel.
+//                              Default is 1.
+//          --seed=N            Master seed for the random number generator.
+//                              Each sample is seeded from this and its own
+//                              number, so a given seed reproduces the same
+//                              output files for any number of threads.
+//                              Default is taken from the clock, and is
+//                              reported on stderr.
+//          --rng=ENGINE        Random number engine.  "xoshiro" is
+//                              xoshiro256** and "pcg" is PCG32; both are
+//                              fast, keep their state in the sample being
+//                              generated, and draw bounded numbers without
+//                              bias.  "rand_r" is the C library's rand_r
+//                              with the original scaling, which reproduces
+//                              the output of earlier versions for the same
+//                              seed.  Default is xoshiro.
+//          --save-model=FILE   After building the model, write the corpus,
+//                              the suffix array and either the LCP array
+//                              (--engine=suffix) or the transition table
+//                              (--engine=table) to FILE.  Use
+//                              --setsize=0 to save without generating.
+//          --load-model=FILE   Memory-map a model written by --save-model
+//                              instead of reading and sorting sample text.
+//                              The input options are ignored.  If the
+//                              model has no transition table for --order,
+//                              one is built from its suffix array.
+//          --append=FILE       Add the text of FILE to the end of the
+//                              model's, whether loaded or built, sorting
+//                              only the suffixes that move and merging
+//                              them into the existing suffix array in one
+//                              pass, so refreshing a big model with a
+//                              little new text costs little more than
+//                              copying it.  Give --save-model to keep the
+//                              result.  The order is the same as sorting
+//                              the whole text afresh.  FILE may be
+//                              compressed, as with --input.
+//          --search=METHOD     How the suffix engine finds the suffixes
+//                              matching a prefix.  "bucket" binary searches
+//                              the bucket for the first two bytes;
+//                              "eytzinger" descends a cache-friendly tree of
+//                              sampled, inlined prefix keys; "binary"
+//                              searches the whole array, as the original
+//                              generator did.  Default is bucket.
+//          --search-bench=N    Look up N prefixes from random places in the
+//                              input with each search method, comparing
+//                              prefixes with strncmp and with each set of
+//                              compare kernels the processor runs, report
+//                              the lookup rate of each and its speed-up
+//                              over strncmp, and which set generation
+//                              would time as fastest, and exit.
+//          --stats             When done, report on stderr the wall and CPU
+//                              time of the input, index and generation
+//                              phases; prefix bucket usage; string compares
+//                              (or hash probes) per lookup; the average
+//                              number of matching suffixes (or successors);
+//                              characters generated per second per sample;
+//                              and peak RSS.
+//          --stats-json[=FILE] Write the same statistics as one JSON object
+//                              to FILE, or to standard output.
+//          --tokens=UNIT       What the model is built from.  "char" treats
+//                              the text as bytes, as the original generator
+//                              did.  "word" splits it into words, each
+//                              carrying the spaces after it, interns them
+//                              as integers and builds a suffix array over
+//                              those, so that --order counts words and a
+//                              lookup compares K integers.  Word mode always
+//                              uses that suffix array, whatever --engine
+//                              says.  Default is char.
+//          --backoff           When the last K tokens have no successor in
+//                              the input, draw the next one from the
+//                              longest shorter context that has one, as
+//                              PPM does, rather than ending the sample.
+//                              The shorter contexts are found in the suffix
+//                              array, whichever engine is used, and the
+//                              next token tries one more token of context
+//                              than the last, so the order climbs back to
+//                              K.  Long orders then run to full length.
+//          --batch=N           Generate N samples at a time on each thread,
+//                              advancing them in lockstep one memory load
+//                              at a time and prefetching each sample's
+//                              next load before the others are served, so
+//                              their cache misses overlap.  The output is
+//                              the same as with N = 1.  Only the table and
+//                              suffix engines interleave, and not with
+//                              --backoff.  Sample times in --stats are then
+//                              per batch, so chars/s is per thread.  This
+//                              only pays once the model is well beyond the
+//                              cache: on a 1M corpus it is neutral or up to
+//                              a quarter slower, and so is a table that
+//                              stays cached, while 64M models run 1.3 to
+//                              3.6 times faster at a batch of 16.  Default
+//                              is 1.
+//          --serve=SOCKET      Build or load the model once, then answer
+//                              generation requests on the Unix domain
+//                              socket SOCKET with --threads worker threads
+//                              until interrupted, instead of writing
+//                              output files.  --order and --outputsize are
+//                              the defaults for requests.
+//          --queue=N           Number of connections that may wait for a
+//                              --serve worker; more are turned away.
+//                              Default is 64.
+//          --client=SOCKET     Ask the server on SOCKET for --setsize
+//                              samples of --order and --outputsize, seeded
+//                              with --seed, and write them to output files
+//                              just as a local run would.  No model is
+//                              built.
 //
 // Copyright (c) 2004-2009 Electric Cloud, Inc.
 // All rights reserved.
@@ -55,50 +240,405 @@
 // ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
 // POSSIBILITY OF SUCH DAMAGE.
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <vector>
+
+#include "markov.h"
+#include "server.h"
+#include "writer.h"
+
 using namespace std;
 
-static int K = 3;
+//----------------------------------------------------------------------------
+// SampleSet
+//
+//      The samples to generate and the generators to use, one per order,
+//      shared by every worker thread.  Samples are handed out in batches of
+//      up to batch samples of one order, numbered through all the orders in
+//      turn, so one counter hands out work for every order and the threads
+//      spread over them.  The batch counter and the stats totals are the
+//      only things the workers write, and they do so atomically.
+//----------------------------------------------------------------------------
+
+struct SampleSet {
+    const MarkovGenerator  *generators;
+    int                     orders;
+    bool                    perOrder;   // Name files output.K.N.
+    int                     outputChars;
+    OutputWriter           *writer;
+    unsigned int            seed;       // Master seed for every sample.
+    int                     setSize;    // Samples per order.
+    int                     batch;      // Samples generated together.
+    int                     nextBatch;  // Next batch to be claimed.
+    GenerationStats         totals;
+};
+
+//----------------------------------------------------------------------------
+// parseOrders
+//
+//      Parse a list of orders such as "3", "2,3,4,6" or "2-4,6" into
+//      orders, dropping repeats.  Returns false if the list is malformed or
+//      holds an order outside [1, ORDER_MAX].
+//----------------------------------------------------------------------------
+
+static const long ORDER_MAX = 1 << 20;
+
+static bool parseOrders(const char *text, vector<int> *orders)
+{
+    orders->clear();
+    const char *p = text;
+    for (;;) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p) {
+            return false;
+        }
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            ++p;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return false;
+            }
+            p = end;
+        }
+        if (first < 1 || last < first || last > ORDER_MAX) {
+            return false;
+        }
+        for (long k = first; k <= last; ++k) {
+            if (find(orders->begin(), orders->end(), k) == orders->end()) {
+                orders->push_back(k);
+            }
+        }
+        if (*p == 0) {
+            return true;
+        }
+        if (*p != ',') {
+            return false;
+        }
+        ++p;
+    }
+}
+
+//----------------------------------------------------------------------------
+// SampleOutput, writeSampleChunk
+//
+//      The sink a sample is generated into: each chunk the generator spills
+//      goes to the writer under the sample's name.
+//----------------------------------------------------------------------------
+
+struct SampleOutput {
+    OutputWriter   *writer;
+    char            name[32];
+};
+
+static void writeSampleChunk(void *context, const char *data, size_t length)
+{
+    SampleOutput *output = (SampleOutput *) context;
+    writeChunk(output->writer, output->name, data, length);
+}
+
+//----------------------------------------------------------------------------
+// endSampleOutput
+//
+//      Finish one sample's output, and show its progress on stderr.
+//----------------------------------------------------------------------------
+
+static void endSampleOutput(const SampleOutput *output, size_t length)
+{
+    endSample(output->writer, output->name);
+    for (size_t i = 250; i <= length; i += 250) {
+        write(2, ".", 1);
+    }
+    write(2, "done\n", 5);
+}
+
+//----------------------------------------------------------------------------
+// generateWorker
+//
+//      Thread body: claim batches of sample numbers from the shared counter
+//      until they run out, streaming each sample to the writer as output.N
+//      or output.K.N.  Every worker owns its own output buffers, of at most
+//      OUTPUT_CHUNK bytes whatever the sample size, and the generator keeps
+//      its RNG state on the stack, so the only contention is the counter
+//      and the writer's queue.  Sample time is the time of the whole batch.
+//----------------------------------------------------------------------------
+
+static const size_t OUTPUT_CHUNK = 1 << 20;
+static const size_t WRITER_QUEUE_BYTES = 64 << 20;
+
+static void *generateWorker(void *arg)
+{
+    SampleSet *set = (SampleSet *) arg;
+    size_t capacity = min((size_t) set->outputChars * 2, OUTPUT_CHUNK);
+    for (int i = 0; i < set->orders; ++i) {
+        if (capacity <= (size_t) set->generators[i].order()) {
+            capacity = set->generators[i].order() + 1;
+        }
+    }
+    vector<char *> outputs(set->batch);
+    for (int i = 0; i < set->batch; ++i) {
+        outputs[i] = new char[capacity];
+    }
+    vector<unsigned int> seeds(set->batch);
+    vector<size_t> lengths(set->batch);
+    vector<SampleOutput> sampleOutputs(set->batch);
+    vector<SampleSink> sinks(set->batch);
+    for (int i = 0; i < set->batch; ++i) {
+        sampleOutputs[i].writer = set->writer;
+        sinks[i].write = writeSampleChunk;
+        sinks[i].context = &sampleOutputs[i];
+    }
+    GenerationStats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    int batches = (set->setSize + set->batch - 1) / set->batch;
+    for (;;) {
+        int current = __sync_fetch_and_add(&set->nextBatch, 1);
+        if (current >= batches * set->orders) {
+            break;
+        }
+        const MarkovGenerator *generator =
+                &set->generators[current / batches];
+        int first = (current % batches) * set->batch;
+        int count = min(set->batch, set->setSize - first);
+        for (int i = 0; i < count; ++i) {
+            seeds[i] = markovSampleSeed(set->seed, first + i);
+            sampleFileName(sampleOutputs[i].name, generator->order(),
+                    set->perOrder, first + i);
+        }
+
+        struct timeval begin, end;
+        gettimeofday(&begin, 0);
+        if (count == 1) {
+            lengths[0] = generator->generate(outputs[0], capacity,
+                    set->outputChars, seeds[0], &stats, &sinks[0]);
+        } else {
+            generator->generateBatch(&outputs[0], capacity,
+                    set->outputChars, &seeds[0], &lengths[0], count, &stats,
+                    &sinks[0]);
+        }
+        gettimeofday(&end, 0);
+        stats.sampleMicros += (end.tv_sec - begin.tv_sec) * 1000000ull
+                + end.tv_usec - begin.tv_usec;
+
+        for (int i = 0; i < count; ++i) {
+            endSampleOutput(&sampleOutputs[i], lengths[i]);
+        }
+    }
+
+    __sync_fetch_and_add(&set->totals.samples, stats.samples);
+    __sync_fetch_and_add(&set->totals.characters, stats.characters);
+    __sync_fetch_and_add(&set->totals.lookups, stats.lookups);
+    __sync_fetch_and_add(&set->totals.compares, stats.compares);
+    __sync_fetch_and_add(&set->totals.rangeTotal, stats.rangeTotal);
+    __sync_fetch_and_add(&set->totals.backoffs, stats.backoffs);
+    __sync_fetch_and_add(&set->totals.sampleMicros, stats.sampleMicros);
+
+    for (int i = 0; i < set->batch; ++i) {
+        delete [] outputs[i];
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// PhaseTimer
+//
+//      Wall and CPU time for one phase of a run.  CPU time is for the whole
+//      process, so with several threads it can exceed wall time.
+//----------------------------------------------------------------------------
+
+struct PhaseTimer {
+    double          wall;
+    double          cpu;
+};
+
+static void processTimes(double *wall, double *cpu)
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+    *wall = now.tv_sec + now.tv_usec / 1e6;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    *cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+            + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void startPhase(PhaseTimer *timer)
+{
+    processTimes(&timer->wall, &timer->cpu);
+}
+
+static void stopPhase(PhaseTimer *timer)
+{
+    double wall, cpu;
+    processTimes(&wall, &cpu);
+    timer->wall = wall - timer->wall;
+    timer->cpu = cpu - timer->cpu;
+}
+
+// Phases timed for --stats.
+
+enum StatsPhase {
+    PHASE_INPUT,
+    PHASE_INDEX,
+    PHASE_GENERATE,
+    PHASE_COUNT
+};
+
+static const char *PHASE_NAMES[PHASE_COUNT] = { "input", "index", "generate" };
+
+struct RunStats {
+    PhaseTimer      phases[PHASE_COUNT];
+    unsigned int    bucketsUsed;    // Non-empty prefix buckets.
+    uint64_t        largestBucket;
+    GenerationStats generation;
+};
 
 //----------------------------------------------------------------------------
-// strcmpIndirect
+// reportStats, reportStatsJson
 //
-//      Compare two strings given by pointers to pointers to the strings.
-//      This is just a simple wrapper around strcmp which accomodates an
-//      extra level of indirection.
+//      Print the phase times and generation counters, as a table for people
+//      or as one JSON object for scripts that track runs over time.
 //----------------------------------------------------------------------------
 
-int strcmpIndirect(const void *a, const void *b) {
-    const char *stringA, *stringB;
-    stringA = *((char **)a);
-    stringB = *((char **)b);
+static void reportStats(FILE *f, const RunStats *stats)
+{
+    const PhaseTimer *phases = stats->phases;
+    const GenerationStats *totals = &stats->generation;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double lookups = totals->lookups ? totals->lookups : 1;
+    double seconds = totals->sampleMicros ? totals->sampleMicros / 1e6 : 1e-9;
 
-    return strcmp(stringA, stringB);
+    fprintf(f, "markov stats:\n");
+    fprintf(f, "    %-10s %12s %12s\n", "phase", "wall (s)", "cpu (s)");
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        fprintf(f, "    %-10s %12.3f %12.3f\n", PHASE_NAMES[p],
+                phases[p].wall, phases[p].cpu);
+    }
+    fprintf(f, "    prefix buckets used     %12u\n", stats->bucketsUsed);
+    fprintf(f, "    largest bucket          %12llu\n",
+            (unsigned long long) stats->largestBucket);
+    fprintf(f, "    samples                 %12llu\n",
+            (unsigned long long) totals->samples);
+    fprintf(f, "    characters              %12llu\n",
+            (unsigned long long) totals->characters);
+    fprintf(f, "    lookups                 %12llu\n",
+            (unsigned long long) totals->lookups);
+    fprintf(f, "    compares per lookup     %12.2f\n",
+            totals->compares / lookups);
+    fprintf(f, "    average range           %12.2f\n",
+            totals->rangeTotal / lookups);
+    fprintf(f, "    backoffs                %12llu\n",
+            (unsigned long long) totals->backoffs);
+    fprintf(f, "    chars/s per sample      %12.0f\n",
+            totals->characters / seconds);
+    fprintf(f, "    peak RSS (KB)           %12ld\n", usage.ru_maxrss);
+}
+
+static void reportStatsJson(FILE *f, const RunStats *stats)
+{
+    const PhaseTimer *phases = stats->phases;
+    const GenerationStats *totals = &stats->generation;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double lookups = totals->lookups ? totals->lookups : 1;
+    double seconds = totals->sampleMicros ? totals->sampleMicros / 1e6 : 1e-9;
+
+    fprintf(f, "{\"phases\": {");
+    for (int p = 0; p < PHASE_COUNT; ++p) {
+        fprintf(f, "%s\"%s\": {\"wall\": %.6f, \"cpu\": %.6f}",
+                p ? ", " : "", PHASE_NAMES[p], phases[p].wall, phases[p].cpu);
+    }
+    fprintf(f, "}, \"prefix_buckets_used\": %u, \"largest_bucket\": %llu, "
+            "\"samples\": %llu, \"characters\": %llu, "
+            "\"lookups\": %llu, \"compares_per_lookup\": %.4f, "
+            "\"average_range\": %.4f, \"backoffs\": %llu, "
+            "\"chars_per_second_per_sample\": %.1f, \"peak_rss_kb\": %ld}\n",
+            stats->bucketsUsed, (unsigned long long) stats->largestBucket,
+            (unsigned long long) totals->samples,
+            (unsigned long long) totals->characters,
+            (unsigned long long) totals->lookups,
+            totals->compares / lookups, totals->rangeTotal / lookups,
+            (unsigned long long) totals->backoffs,
+            totals->characters / seconds, usage.ru_maxrss);
 }
 
 // The following enum supplies integer values for our command-line options.
 
 enum {
     MARKOV_OPTIONS_INPUT_SIZE = 500,
+    MARKOV_OPTIONS_INPUT,
     MARKOV_OPTIONS_ORDER,
     MARKOV_OPTIONS_OUTPUT_SIZE,
     MARKOV_OPTIONS_NUMBER_OF_SAMPLES,
+    MARKOV_OPTIONS_OUTPUT,
+    MARKOV_OPTIONS_SA_ALGO,
+    MARKOV_OPTIONS_SA_VERIFY,
+    MARKOV_OPTIONS_SA_MEMORY,
+    MARKOV_OPTIONS_ENGINE,
+    MARKOV_OPTIONS_THREADS,
+    MARKOV_OPTIONS_SEED,
+    MARKOV_OPTIONS_RNG,
+    MARKOV_OPTIONS_SAVE_MODEL,
+    MARKOV_OPTIONS_LOAD_MODEL,
+    MARKOV_OPTIONS_APPEND,
+    MARKOV_OPTIONS_SEARCH,
+    MARKOV_OPTIONS_SEARCH_BENCH,
+    MARKOV_OPTIONS_STATS,
+    MARKOV_OPTIONS_STATS_JSON,
+    MARKOV_OPTIONS_TOKENS,
+    MARKOV_OPTIONS_BACKOFF,
+    MARKOV_OPTIONS_BATCH,
+    MARKOV_OPTIONS_SERVE,
+    MARKOV_OPTIONS_QUEUE,
+    MARKOV_OPTIONS_CLIENT,
     MARKOV_OPTIONS_HELP
 };
 
 // Our list of commmand-line options.
 
 static struct option MARKOV_OPTIONS[] = {
+    { "input",          1,      0,      MARKOV_OPTIONS_INPUT },
     { "inputsize",      1,      0,      MARKOV_OPTIONS_INPUT_SIZE },
     { "order",          1,      0,      MARKOV_OPTIONS_ORDER },
     { "outputsize",     1,      0,      MARKOV_OPTIONS_OUTPUT_SIZE },
     { "setsize",        1,      0,      MARKOV_OPTIONS_NUMBER_OF_SAMPLES },
+    { "output",         1,      0,      MARKOV_OPTIONS_OUTPUT },
+    { "sa-algo",        1,      0,      MARKOV_OPTIONS_SA_ALGO },
+    { "sa-verify",      0,      0,      MARKOV_OPTIONS_SA_VERIFY },
+    { "sa-memory",      1,      0,      MARKOV_OPTIONS_SA_MEMORY },
+    { "engine",         1,      0,      MARKOV_OPTIONS_ENGINE },
+    { "threads",        1,      0,      MARKOV_OPTIONS_THREADS },
+    { "seed",           1,      0,      MARKOV_OPTIONS_SEED },
+    { "rng",            1,      0,      MARKOV_OPTIONS_RNG },
+    { "save-model",     1,      0,      MARKOV_OPTIONS_SAVE_MODEL },
+    { "load-model",     1,      0,      MARKOV_OPTIONS_LOAD_MODEL },
+    { "append",         1,      0,      MARKOV_OPTIONS_APPEND },
+    { "search",         1,      0,      MARKOV_OPTIONS_SEARCH },
+    { "search-bench",   1,      0,      MARKOV_OPTIONS_SEARCH_BENCH },
+    { "stats",          0,      0,      MARKOV_OPTIONS_STATS },
+    { "stats-json",     2,      0,      MARKOV_OPTIONS_STATS_JSON },
+    { "tokens",         1,      0,      MARKOV_OPTIONS_TOKENS },
+    { "backoff",        0,      0,      MARKOV_OPTIONS_BACKOFF },
+    { "batch",          1,      0,      MARKOV_OPTIONS_BATCH },
+    { "serve",          1,      0,      MARKOV_OPTIONS_SERVE },
+    { "queue",          1,      0,      MARKOV_OPTIONS_QUEUE },
+    { "client",         1,      0,      MARKOV_OPTIONS_CLIENT },
     { "help",           0,      0,      MARKOV_OPTIONS_HELP },
     { 0,                0,      0,      0}
 };
@@ -114,15 +654,59 @@ static void usage(char *argv[])
     fprintf(stderr, 
 "markov\n"
 "Generate letter-level Markov text based on sample text read from standard\n"
-"input, writing to output files named output.*.\n\n"
+"input or a file, writing to output files named output.*.\n\n"
 "Usage:\n"
 "%s [options ...]\n\n"
 "Valid options are:\n\n"
+"    --input=FILE         Map the sample text from FILE instead of reading\n"
+"                         standard input.  gzip and zstd input, from either,\n"
+"                         is decompressed as it is read.\n"
+"    --inputsize=N        Maximum bytes of sample text to use, after any\n"
+"                         decompression (default 0, meaning no limit).\n"
 "    --order=K            Number of preceeding characters to consider when\n"
-"                         generating the next character (default 3).\n"
+"                         generating the next character (default 3).  A\n"
+"                         list such as 2,3,4,6 or 2-4,6 generates a set of\n"
+"                         output.K.* files for each order.\n"
 "    --outputsize=N       Number of characters to generate in the output\n"
 "                         file (default 10000).\n"
 "    --setsize=N          Number of output files to generate (default 1).\n"
+"    --output=-           Write the samples to standard output as records\n"
+"                         instead of to files.\n"
+"    --sa-algo=ALGO       Suffix array construction algorithm: sais,\n"
+"                         qsort, parallel or external (default sais).\n"
+"    --sa-memory=MB       Memory for --sa-algo=external (default 1024).\n"
+"    --sa-verify          Check the suffix array order after construction.\n"
+"    --engine=ENGINE      Generation engine: table, suffix or fm (default\n"
+"                         table).\n"
+"    --threads=N          Number of generation threads, and sort threads\n"
+"                         for --sa-algo=parallel (default 1).\n"
+"    --seed=N             Master random seed (default from the clock).\n"
+"    --rng=ENGINE         Random number engine: xoshiro, pcg or rand_r\n"
+"                         (default xoshiro).\n"
+"    --save-model=FILE    Save the corpus, suffix array and transition\n"
+"                         table to FILE.\n"
+"    --load-model=FILE    Use a model saved with --save-model instead of\n"
+"                         reading and sorting sample text.\n"
+"    --append=FILE        Add the text of FILE to the model, sorting only\n"
+"                         the new suffixes.\n"
+"    --search=METHOD      Suffix engine search: bucket, eytzinger or\n"
+"                         binary (default bucket).\n"
+"    --search-bench=N     Time N lookups with each search method and\n"
+"                         compare kernel, and exit.\n"
+"    --stats              Report phase times and generation counters on\n"
+"                         stderr.\n"
+"    --stats-json[=FILE]  Write the same as JSON to FILE (default stdout).\n"
+"    --tokens=UNIT        Build the model from char or word tokens\n"
+"                         (default char).\n"
+"    --backoff            Fall back to shorter contexts instead of stopping\n"
+"                         at a dead end.\n"
+"    --batch=N            Samples each thread generates in lockstep\n"
+"                         (default 1).\n"
+"    --serve=SOCKET       Answer generation requests on a Unix socket.\n"
+"    --queue=N            Connections allowed to wait for --serve (default\n"
+"                         64).\n"
+"    --client=SOCKET      Fetch samples from a --serve server instead of\n"
+"                         building a model.\n"
             "\n"
             , tail);
     return;
@@ -130,21 +714,58 @@ static void usage(char *argv[])
 
 int main(int argc, char *argv[])
 {
-    int MAX_CHARS = 5000000;
+    vector<int> ORDERS(1, 3);
+    bool ORDER_GIVEN = false;
+    uint64_t MAX_CHARS = 0;
+    const char *INPUT_FILE = NULL;
     int OUTPUT_CHARS = 10000;
     int SET_SIZE = 1;
+    bool OUTPUT_STDOUT = false;
+    SuffixAlgorithm SA_ALGO = SA_ALGO_SAIS;
+    bool SA_VERIFY = false;
+    bool SA_EXTERNAL = false;
+    uint64_t SA_MEMORY = 1024;
+    GenerationEngine ENGINE = ENGINE_TABLE;
+    int THREADS = 1;
+    unsigned int SEED = 0;
+    bool SEED_GIVEN = false;
+    RandomEngine RNG = RANDOM_XOSHIRO;
+    const char *SAVE_MODEL = NULL;
+    const char *LOAD_MODEL = NULL;
+    const char *APPEND = NULL;
+    SearchMethod SEARCH = SEARCH_BUCKET;
+    int SEARCH_BENCH = 0;
+    bool STATS = false;
+    const char *STATS_JSON = NULL;
+    bool WORDS = false;
+    bool BACKOFF = false;
+    int BATCH = 1;
+    const char *SERVE = NULL;
+    int QUEUE = 64;
+    const char *CLIENT = NULL;
     extern char *optarg;
 
     bool done = false;
     while (!done) {
         switch (getopt_long(argc, argv, "", MARKOV_OPTIONS, 0)) {
             case MARKOV_OPTIONS_INPUT_SIZE: {
-                MAX_CHARS = atoi(optarg);
+                MAX_CHARS = strtoull(optarg, 0, 10);
+                break;
+            }
+
+            case MARKOV_OPTIONS_INPUT: {
+                INPUT_FILE = optarg;
                 break;
             }
 
             case MARKOV_OPTIONS_ORDER: {
-                K = atoi(optarg);
+                if (!parseOrders(optarg, &ORDERS)) {
+                    fprintf(stderr, "markov: bad order list \"%s\".\n",
+                            optarg);
+                    usage(argv);
+                    return 1;
+                }
+                ORDER_GIVEN = true;
                 break;
             }
 
@@ -158,6 +779,196 @@ int main(int argc, char *argv[])
                 break;
             }
 
+            case MARKOV_OPTIONS_OUTPUT: {
+                if (strcmp(optarg, "-") != 0) {
+                    fprintf(stderr, "markov: --output only takes -; samples "
+                            "otherwise go to output.* files.\n");
+                    usage(argv);
+                    return 1;
+                }
+                OUTPUT_STDOUT = true;
+                break;
+            }
+
+            case MARKOV_OPTIONS_SA_ALGO: {
+                SA_EXTERNAL = false;
+                if (strcmp(optarg, "sais") == 0) {
+                    SA_ALGO = SA_ALGO_SAIS;
+                } else if (strcmp(optarg, "qsort") == 0) {
+                    SA_ALGO = SA_ALGO_QSORT;
+                } else if (strcmp(optarg, "parallel") == 0) {
+                    SA_ALGO = SA_ALGO_PARALLEL;
+                } else if (strcmp(optarg, "external") == 0) {
+                    SA_EXTERNAL = true;
+                } else {
+                    fprintf(stderr, "markov: unknown suffix array "
+                            "algorithm \"%s\".\n", optarg);
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            }
+
+            case MARKOV_OPTIONS_SA_VERIFY: {
+                SA_VERIFY = true;
+                break;
+            }
+
+            case MARKOV_OPTIONS_SA_MEMORY: {
+                SA_MEMORY = strtoull(optarg, 0, 10);
+                if (SA_MEMORY < 1) {
+                    fprintf(stderr, "markov: --sa-memory must be at least "
+                            "1.\n");
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            }
+
+            case MARKOV_OPTIONS_ENGINE: {
+                if (strcmp(optarg, "table") == 0) {
+                    ENGINE = ENGINE_TABLE;
+                } else if (strcmp(optarg, "suffix") == 0) {
+                    ENGINE = ENGINE_SUFFIX;
+                } else if (strcmp(optarg, "fm") == 0) {
+                    ENGINE = ENGINE_FM;
+                } else {
+                    fprintf(stderr, "markov: unknown engine \"%s\".\n",
+                            optarg);
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            }
+
+            case MARKOV_OPTIONS_THREADS: {
+                THREADS = atoi(optarg);
+                if (THREADS < 1) {
+                    fprintf(stderr, "markov: --threads must be at least "
+                            "1.\n");
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            }
+
+            case MARKOV_OPTIONS_SEED: {
+                SEED = (unsigned int) strtoul(optarg, 0, 10);
+                SEED_GIVEN = true;
+                break;
+            }
+
+            case MARKOV_OPTIONS_RNG: {
+                if (strcmp(optarg, "xoshiro") == 0) {
+                    RNG = RANDOM_XOSHIRO;
+                } else if (strcmp(optarg, "pcg") == 0) {
+                    RNG = RANDOM_PCG;
+                } else if (strcmp(optarg, "rand_r") == 0) {
+                    RNG = RANDOM_RAND_R;
+                } else {
+                    fprintf(stderr, "markov: unknown random engine \"%s\".\n",
+                            optarg);
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            }
+
+            case MARKOV_OPTIONS_SAVE_MODEL: {
+                SAVE_MODEL = optarg;
+                break;
+            }
+
+            case MARKOV_OPTIONS_LOAD_MODEL: {
+                LOAD_MODEL = optarg;
+                break;
+            }
+
+            case MARKOV_OPTIONS_APPEND: {
+                APPEND = optarg;
+                break;
+            }
+
+            case MARKOV_OPTIONS_SEARCH: {
+                if (strcmp(optarg, "bucket") == 0) {
+                    SEARCH = SEARCH_BUCKET;
+                } else if (strcmp(optarg, "eytzinger") == 0) {
+                    SEARCH = SEARCH_EYTZINGER;
+                } else if (strcmp(optarg, "binary") == 0) {
+                    SEARCH = SEARCH_BINARY;
+                } else {
+                    fprintf(stderr, "markov: unknown search method "
+                            "\"%s\".\n", optarg);
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            }
+
+            case MARKOV_OPTIONS_SEARCH_BENCH: {
+                SEARCH_BENCH = atoi(optarg);
+                break;
+            }
+
+            case MARKOV_OPTIONS_STATS: {
+                STATS = true;
+                break;
+            }
+
+            case MARKOV_OPTIONS_STATS_JSON: {
+                STATS_JSON = (optarg != NULL) ? optarg : "-";
+                break;
+            }
+
+            case MARKOV_OPTIONS_TOKENS: {
+                if (strcmp(optarg, "char") == 0) {
+                    WORDS = false;
+                } else if (strcmp(optarg, "word") == 0) {
+                    WORDS = true;
+                } else {
+                    fprintf(stderr, "markov: unknown token unit \"%s\".\n",
+                            optarg);
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            }
+
+            case MARKOV_OPTIONS_BACKOFF: {
+                BACKOFF = true;
+                break;
+            }
+
+            case MARKOV_OPTIONS_BATCH: {
+                BATCH = atoi(optarg);
+                if (BATCH < 1) {
+                    fprintf(stderr, "markov: --batch must be at least 1.\n");
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            }
+
+            case MARKOV_OPTIONS_SERVE: {
+                SERVE = optarg;
+                break;
+            }
+
+            case MARKOV_OPTIONS_QUEUE: {
+                QUEUE = atoi(optarg);
+                if (QUEUE < 1) {
+                    fprintf(stderr, "markov: --queue must be at least 1.\n");
+                    usage(argv);
+                    return 1;
+                }
+                break;
+            }
+
+            case MARKOV_OPTIONS_CLIENT: {
+                CLIENT = optarg;
+                break;
+            }
+
             case MARKOV_OPTIONS_HELP: {
                 usage(argv);
                 return 1;
@@ -175,142 +986,301 @@ int main(int argc, char *argv[])
             }
         }
     }
-    
-    char *input = new char[MAX_CHARS];
-    char **suffixes = new char *[MAX_CHARS];
-    char *output = new char[OUTPUT_CHARS * 2];
-
-    // Read as much input as we are willing to read.
-
-    int bytesRead = read(0, input, MAX_CHARS - 1);
-    if (bytesRead < 0) {
-        fprintf(stderr, "markov: error reading input data, exiting.\n");
+    if (WORDS) {
+        ENGINE = ENGINE_WORD;
+    }
+    if (SA_EXTERNAL && SAVE_MODEL == NULL && LOAD_MODEL == NULL) {
+        fprintf(stderr, "markov: --sa-algo=external needs --save-model to "
+                "sort into.\n");
         return 1;
     }
-
-    if (bytesRead == 0) {
-        fprintf(stderr, "markov: no input data, exiting.\n");
+    if (OUTPUT_STDOUT && (CLIENT != NULL || SERVE != NULL)) {
+        fprintf(stderr, "markov: --output=- only applies to local "
+                "generation.\n");
         return 1;
     }
-
-    input[bytesRead] = 0;
-
-    // Set up the suffix array.  Each element in this array points to a 
-    // distinct character in the input.
-
-    fprintf(stderr, "markov: initializing suffix array.\n");
-    for (int i = 0; i < bytesRead; ++i) {
-        suffixes[i] = &(input[i]);
+    if (OUTPUT_STDOUT && STATS_JSON != NULL && strcmp(STATS_JSON, "-") == 0) {
+        fprintf(stderr, "markov: --output=- and --stats-json cannot both "
+                "use standard output.\n");
+        return 1;
     }
 
-    // Now sort the array to bring suffixes with similar prefixes together.
-    // We'll use a qsort with a special strcmp that adds a level of 
-    // indirection, so we can sort the pointers.
+    // A client needs no model of its own.
 
-    fprintf(stderr, "markov: sorting suffix array.\n");
-    qsort(suffixes, bytesRead, sizeof(char *), strcmpIndirect);
+    if (CLIENT != NULL) {
+        if (!SEED_GIVEN) {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            SEED = now.tv_usec;
+        }
+        fprintf(stderr, "markov: seed is %u.\n", SEED);
+        if (!ORDER_GIVEN) {
+            return runClient(CLIENT, 0, false, OUTPUT_CHARS, SEED, SET_SIZE);
+        }
+        for (size_t i = 0; i < ORDERS.size(); ++i) {
+            if (runClient(CLIENT, ORDERS[i], ORDERS.size() > 1, OUTPUT_CHARS,
+                    SEED, SET_SIZE) != 0) {
+                return 1;
+            }
+        }
+        return 0;
+    }
 
-    // Seed the random number generator.
+    MarkovModel model;
+    bool saved = false;
+    RunStats stats;
+    memset(&stats, 0, sizeof(stats));
+    startPhase(&stats.phases[PHASE_INPUT]);
 
-    struct timeval now;
-    gettimeofday(&now, 0);
-    srand(now.tv_usec);
+    if (LOAD_MODEL != NULL) {
+        // Everything comes from the model file, already sorted.
 
-    for (int current = 0 ; current < SET_SIZE ; ++current) {
-        // Seed the output with a random sequence of K characters from the
-        // input.
+        if (!model.load(LOAD_MODEL)) {
+            fprintf(stderr, "markov: error loading model, exiting.\n");
+            return 1;
+        }
+        fprintf(stderr, "markov: loaded model from %s.\n", LOAD_MODEL);
+        stopPhase(&stats.phases[PHASE_INPUT]);
+        startPhase(&stats.phases[PHASE_INDEX]);
+    } else {
+        // Map the input file, or read all of standard input.
 
-        int seedStart = (int) ((bytesRead / 2) * rand() / (RAND_MAX + 1.0));
-        int index = 0;
-        memset(output, 0, OUTPUT_CHARS * 2);
+        bool loaded = (INPUT_FILE != NULL)
+                ? model.readFile(INPUT_FILE, MAX_CHARS)
+                : model.readStream(0, MAX_CHARS);
+        if (!loaded) {
+            fprintf(stderr, "markov: error reading input data, exiting.\n");
+            return 1;
+        }
 
-        for (index = 0; index < K; ++index) {
-            output[index] = input[index + seedStart];
+        if (model.size() == 0) {
+            fprintf(stderr, "markov: no input data, exiting.\n");
+            return 1;
         }
+        stopPhase(&stats.phases[PHASE_INPUT]);
+        startPhase(&stats.phases[PHASE_INDEX]);
 
-        // Now output approximately OUTPUT_CHARS characters.  We say
-        // approximately because we will only stop output if we have
-        // just written a newline, to try to guarantee well-formed
-        // output.  This means that in general, we will output more
-        // than OUTPUT_CHARS characters.
+        // Set up the suffix array.  Each element in this array is the
+        // offset of a distinct character in the input, and the array is
+        // sorted to bring suffixes with similar prefixes together.  Word
+        // mode and the FM engine have their own indexes, so they need this
+        // one only to check, benchmark or save it.
 
-        done = false;
-        while (!done && (index < (OUTPUT_CHARS * 2))) {
-            if (index % 250 == 0) {
-                write(2, ".", 1);
+        if (SA_EXTERNAL) {
+            fprintf(stderr, "markov: sorting suffix array out of core into "
+                    "%s.\n", SAVE_MODEL);
+            if (!model.buildIndexFile(SAVE_MODEL, SA_MEMORY << 20)) {
+                fprintf(stderr, "markov: error building model, exiting.\n");
+                return 1;
+            }
+            saved = true;
+        } else if ((ENGINE != ENGINE_WORD && ENGINE != ENGINE_FM)
+                || SA_VERIFY || SEARCH_BENCH > 0 || SAVE_MODEL != NULL
+                || APPEND != NULL) {
+            fprintf(stderr, "markov: sorting suffix array.\n");
+            if (!model.buildIndex(SA_ALGO, THREADS)) {
+                fprintf(stderr, "markov: error building model, exiting.\n");
+                return 1;
             }
+        }
+    }
 
-            // First search the suffix array for the first suffix with the
-            // prefix output[index - K].
+    // New text is merged into the index, which must then be saved again.
+
+    if (APPEND != NULL) {
+        fprintf(stderr, "markov: appending %s.\n", APPEND);
+        if (!model.appendFile(APPEND, 0)) {
+            fprintf(stderr, "markov: error appending input data, "
+                    "exiting.\n");
+            return 1;
+        }
+        saved = false;
+    }
+    if (model.suffixWidth() != 0) {
+        fprintf(stderr, "markov: suffix array uses %d bytes per suffix.\n",
+                model.suffixWidth());
 
-            char *prefix = &(output[index - K]);
+        model.bucketUsage(&stats.bucketsUsed, &stats.largestBucket);
+        fprintf(stderr, "markov: %u prefix buckets in use, largest holds "
+                "%llu suffixes.\n", stats.bucketsUsed,
+                (unsigned long long) stats.largestBucket);
+    }
 
-            int l = -1;
-            int u = bytesRead;
-            while ((l + 1) != u) {
-                int m = (l + u) / 2;
-                if (strncmp(suffixes[m], prefix, K) < 0) {
-                    l = m;
-                } else {
-                    u = m;
-                }
-            }
+    if (SA_VERIFY) {
+        uint64_t bad = model.verify();
+        if (bad != 0) {
+            fprintf(stderr, "markov: suffix array is out of order at "
+                    "index %llu, exiting.\n", (unsigned long long) bad);
+            return 1;
+        }
+        fprintf(stderr, "markov: suffix array verified.\n");
+    }
 
-            // "u" now holds the index of the first suffix that
-            // matches.  Of all the suffixes with this prefix, pick
-            // one at random.
+    // Lay out the search trees, if the suffix engine is going to use them
+    // or we are comparing search methods.
 
-            int choice = 0;
-            for (int i = 0; suffixes[u + i] 
-                         && strncmp(suffixes[u + i], prefix, K) == 0; ++i) {
-                if ((rand() % (i + 1)) == 0) {
-                    choice = i;
-                }
+    if ((ENGINE == ENGINE_SUFFIX && SEARCH == SEARCH_EYTZINGER)
+            || SEARCH_BENCH > 0) {
+        for (size_t i = 0; i < ORDERS.size(); ++i) {
+            if (!model.buildSearchTree(ORDERS[i])) {
+                return 1;
+            }
+            fprintf(stderr, "markov: order %d search tree holds %llu "
+                    "samples.\n", ORDERS[i],
+                    (unsigned long long) model.searchTreeSamples(ORDERS[i]));
+        }
+    }
+    if (SEARCH_BENCH > 0) {
+        for (size_t i = 0; i < ORDERS.size(); ++i) {
+            if (!model.benchmarkSearch(ORDERS[i], SEARCH_BENCH, SEED)) {
+                return 1;
             }
+        }
+        return 0;
+    }
 
-            // Now take the K+1'th character of the chosen suffix.  If this
-            // character is the null terminator, then we're done.  If this 
-            // character is a newline and we have output at least OUTPUT_CHARS
-            // characters, then we're done.  Otherwise, we loop.
+    // The suffix engine finds the extent of each run of matching suffixes
+    // from the LCP array, which serves every order.  The table engine
+    // collapses the sorted suffixes into a transition table for each
+    // order, unless the model came with one.  Backoff needs the LCP
+    // array with either engine.
 
-            switch (suffixes[u + choice][K]) {
-                case '\0':
-                    // We happened to find the suffix that starts
-                    // exactly K characters from the end of the input.
-                    // If this is the only suffix that matches the
-                    // prefix, then we're done, regardless of how many
-                    // characters of output we've generated.
-                    // Otherwise, we'll loop and try again.
+    if ((ENGINE == ENGINE_SUFFIX || (BACKOFF && ENGINE == ENGINE_TABLE))
+            && !model.hasLcp()) {
+        fprintf(stderr, "markov: building LCP array.\n");
+    }
+    if (ENGINE == ENGINE_WORD) {
+        fprintf(stderr, "markov: indexing words.\n");
+    }
+    if (ENGINE == ENGINE_FM) {
+        fprintf(stderr, "markov: building FM index.\n");
+    }
+    for (size_t i = 0; i < ORDERS.size(); ++i) {
+        int k = ORDERS[i];
+        if (ENGINE == ENGINE_TABLE && !model.hasTable(k)) {
+            fprintf(stderr, "markov: building order %d transition table.\n",
+                    k);
+        }
+        if (!model.prepare(k, ENGINE, SEARCH, BACKOFF)) {
+            fprintf(stderr, "markov: error building model, exiting.\n");
+            return 1;
+        }
+        unsigned int contexts, transitions;
+        if (ENGINE == ENGINE_TABLE
+                && model.tableSize(k, &contexts, &transitions)) {
+            fprintf(stderr, "markov: order %d has %u contexts, %u "
+                    "transitions.\n", k, contexts, transitions);
+        }
+    }
+    uint64_t wordCount;
+    unsigned int vocabulary;
+    if (ENGINE == ENGINE_WORD && model.wordCount(&wordCount, &vocabulary)) {
+        fprintf(stderr, "markov: %llu words, %u distinct.\n",
+                (unsigned long long) wordCount, vocabulary);
+    }
+    if (ENGINE == ENGINE_FM) {
+        fprintf(stderr, "markov: FM index takes %llu bytes, %.2f per input "
+                "byte.\n", (unsigned long long) model.fmIndexBytes(),
+                (double) model.fmIndexBytes() / model.size());
+    }
 
-                    if ((choice == 0) 
-                            && (strncmp(suffixes[u + 1], prefix, K)) != 0) {
-                        done = true;
-                    }
-                    break;
+    stopPhase(&stats.phases[PHASE_INDEX]);
 
-                case '\n':
-                    if (index >= OUTPUT_CHARS) {
-                        done = true;
-                    }
+    // A model file holds one transition table, the first order's.  An
+    // external sort has already saved its model.
 
-                    // DELIBERATELY FALL THROUGH: WE WANT THE NEWLINE
-                    // IN OUTPUT.
+    if (SAVE_MODEL != NULL && !saved) {
+        if (!model.save(SAVE_MODEL,
+                (ENGINE == ENGINE_TABLE) ? ORDERS[0] : 0)) {
+            fprintf(stderr, "markov: error saving model, exiting.\n");
+            return 1;
+        }
+        fprintf(stderr, "markov: saved model to %s.\n", SAVE_MODEL);
+    }
 
-                default:
-                    output[index] = suffixes[u + choice][K];
-                    index++;
-                    break;
-            }
+    vector<MarkovGenerator> generators(ORDERS.size());
+    for (size_t i = 0; i < ORDERS.size(); ++i) {
+        if (!generators[i].init(&model, ORDERS[i], ENGINE, SEARCH,
+                BACKOFF, RNG)) {
+            return 1;
         }
+    }
 
-        char filename[32];
-        sprintf(filename, "output.%d", current);
-        FILE *f = fopen(filename, "w");
-        fprintf(f, "%s", output);
-        fclose(f);
+    // In server mode, the clients say what to generate.
 
-        write(2, "done\n", 5);
+    if (SERVE != NULL) {
+        ServerConfig config;
+        config.path = SERVE;
+        config.threads = THREADS;
+        config.queueSize = QUEUE;
+        config.outputChars = OUTPUT_CHARS;
+        return runServer(&generators[0], generators.size(), &config);
+    }
+
+    // Generate the samples, spreading them over the worker threads.  Each
+    // sample is seeded from the master seed and its own number, so the
+    // output is the same however many threads there are.
+
+    if (!SEED_GIVEN) {
+        struct timeval now;
+        gettimeofday(&now, 0);
+        SEED = now.tv_usec;
+    }
+    fprintf(stderr, "markov: seed is %u.\n", SEED);
+
+    SampleSet set;
+    set.generators = &generators[0];
+    set.orders = generators.size();
+    set.perOrder = generators.size() > 1;
+    set.outputChars = OUTPUT_CHARS;
+    set.writer = startWriter(OUTPUT_STDOUT ? 1 : -1, WRITER_QUEUE_BYTES);
+    if (set.writer == NULL) {
+        return 1;
+    }
+    set.seed = SEED;
+    set.setSize = SET_SIZE;
+    set.batch = (BATCH < SET_SIZE) ? BATCH : max(SET_SIZE, 1);
+    set.nextBatch = 0;
+    memset(&set.totals, 0, sizeof(set.totals));
+
+    startPhase(&stats.phases[PHASE_GENERATE]);
+    int batches = (SET_SIZE + set.batch - 1) / set.batch * set.orders;
+    if (THREADS > batches) {
+        THREADS = (batches > 0) ? batches : 1;
+    }
+    vector<pthread_t> workers(THREADS - 1);
+    for (int i = 0; i < THREADS - 1; ++i) {
+        if (pthread_create(&workers[i], 0, generateWorker, &set) != 0) {
+            fprintf(stderr, "markov: unable to start worker thread.\n");
+            return 1;
+        }
+    }
+    generateWorker(&set);
+    for (int i = 0; i < THREADS - 1; ++i) {
+        pthread_join(workers[i], 0);
+    }
+    bool written = stopWriter(set.writer);
+    stopPhase(&stats.phases[PHASE_GENERATE]);
+    if (!written) {
+        return 1;
+    }
+    stats.generation = set.totals;
+
+    if (STATS) {
+        reportStats(stderr, &stats);
+    }
+    if (STATS_JSON != NULL) {
+        FILE *f = (strcmp(STATS_JSON, "-") == 0)
+                ? stdout : fopen(STATS_JSON, "w");
+        if (f == NULL) {
+            fprintf(stderr, "markov: unable to create %s: %s.\n",
+                    STATS_JSON, strerror(errno));
+            return 1;
+        }
+        reportStatsJson(f, &stats);
+        if (f != stdout) {
+            fclose(f);
+        }
     }
     return 0;
 }
-
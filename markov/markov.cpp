@@ -0,0 +1,5868 @@
+// markov.cpp --
+//
+// This file implements the markov text generation library declared in
+// markov.h: reading and indexing sample text, the model file format, and
+// generating samples from the suffix array or the transition table.
+//
+// Copyright (c) 2004-2009 Electric Cloud, Inc.
+// All rights reserved.
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Electric Cloud nor the names of its employees may
+//       be used to endorse or promote products derived from this software
+//       without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <algorithm>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "decoder.h"
+#include "markov.h"
+
+using namespace std;
+
+// Suffixes are bucketed by their first two bytes, with the end of the input
+// sorting below every byte, so that the one-byte suffix at the very end has
+// a bucket of its own ahead of the two-byte ones.
+
+static const unsigned int PREFIX_BUCKETS = 256 * 257;
+
+static inline unsigned int prefixBucket(const unsigned char *text,
+        uint64_t n, uint64_t i)
+{
+    return text[i] * 257 + ((i + 1 < n) ? text[i + 1] + 1 : 0);
+}
+
+//----------------------------------------------------------------------------
+// Corpus
+//
+//      The sample text, always followed by at least one NUL byte so that it
+//      can be treated as a C string.  It is either a read-only mapping of a
+//      file or anonymous memory filled from a stream; either way it is
+//      released with munmap.
+//----------------------------------------------------------------------------
+
+struct Corpus {
+    char           *data;
+    uint64_t        size;           // Bytes of text, excluding the NUL.
+    size_t          mapped;         // Bytes mapped at data.
+};
+
+static size_t pageRound(uint64_t n)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+//----------------------------------------------------------------------------
+// allocateInput, growInput
+//
+//      Reserve anonymous memory for text read from a stream, and double it
+//      with mremap as it fills.  The memory is marked for transparent huge
+//      pages, which cuts TLB misses in the suffix sort as well as here.
+//      Both return false, with a message, on failure; growInput frees the
+//      memory when it fails.
+//----------------------------------------------------------------------------
+
+static bool allocateInput(char **data, size_t capacity)
+{
+    *data = (char *) mmap(0, capacity, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (*data == MAP_FAILED) {
+        fprintf(stderr, "markov: unable to allocate input buffer: %s.\n",
+                strerror(errno));
+        return false;
+    }
+    madvise(*data, capacity, MADV_HUGEPAGE);
+    return true;
+}
+
+static bool growInput(char **data, size_t *capacity)
+{
+    char *grown = (char *) mremap(*data, *capacity, *capacity * 2,
+            MREMAP_MAYMOVE);
+    if (grown == MAP_FAILED) {
+        fprintf(stderr, "markov: unable to grow input buffer: %s.\n",
+                strerror(errno));
+        munmap(*data, *capacity);
+        return false;
+    }
+    *data = grown;
+    madvise(*data + *capacity, *capacity, MADV_HUGEPAGE);
+    *capacity *= 2;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// readHead
+//
+//      Read up to length bytes from the start of fd, enough to recognize a
+//      compressed format by, stopping early only at end of file.  Returns
+//      the bytes read, or -1 on an error, leaving it in errno.
+//----------------------------------------------------------------------------
+
+static ssize_t readHead(int fd, char *head, size_t length)
+{
+    size_t size = 0;
+    while (size < length) {
+        ssize_t got = read(fd, head + size, length - size);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (got == 0) {
+            break;
+        }
+        size += got;
+    }
+    return size;
+}
+
+//----------------------------------------------------------------------------
+// readCompressed
+//
+//      Decompress the rest of fd, whose first headLength bytes are in head,
+//      into memory as readCorpusStream reads plain text, stopping after
+//      maxBytes if that is not 0.  A decoder thread inflates the text a
+//      chunk ahead while this one copies each chunk in and, if counts is
+//      not NULL, adds its two-byte prefixes to a histogram that it points
+//      counts at, ready for countPrefixBuckets, so that the first pass of
+//      building the index is over by the time the text has all arrived.
+//      Returns false, with a message, on failure.
+//----------------------------------------------------------------------------
+
+static bool readCompressed(int fd, Compression compression, const char *head,
+        size_t headLength, uint64_t maxBytes, Corpus *corpus,
+        uint64_t **counts)
+{
+    size_t capacity = 16 << 20;
+    char *data;
+    if (!allocateInput(&data, capacity)) {
+        return false;
+    }
+    Decoder *decoder = startDecoder(fd, compression, head, headLength);
+    if (decoder == NULL) {
+        munmap(data, capacity);
+        return false;
+    }
+    uint64_t *histogram = NULL;
+    if (counts != NULL) {
+        histogram = new uint64_t[PREFIX_BUCKETS + 1];
+        memset(histogram, 0, (PREFIX_BUCKETS + 1) * sizeof(uint64_t));
+    }
+
+    const unsigned char *text = (const unsigned char *) data;
+    uint64_t size = 0;
+    uint64_t counted = 0;
+    const char *chunk;
+    size_t length;
+    while ((maxBytes == 0 || size < maxBytes)
+            && (length = nextChunk(decoder, &chunk)) > 0) {
+        if (maxBytes != 0 && length > maxBytes - size) {
+            length = maxBytes - size;
+        }
+
+        // Always leave room for the NUL, which the anonymous mapping
+        // already provides.
+
+        while (size + length + 1 > capacity) {
+            if (!growInput(&data, &capacity)) {
+                stopDecoder(decoder);
+                delete [] histogram;
+                return false;
+            }
+            text = (const unsigned char *) data;
+        }
+        memcpy(data + size, chunk, length);
+        size += length;
+
+        // The last byte's bucket depends on whether more text follows, so
+        // it waits for the next chunk.
+
+        if (histogram != NULL) {
+            for (; counted + 1 < size; ++counted) {
+                histogram[prefixBucket(text, size, counted)]++;
+            }
+        }
+    }
+    if (!stopDecoder(decoder)) {
+        munmap(data, capacity);
+        delete [] histogram;
+        return false;
+    }
+    if (histogram != NULL) {
+        for (; counted < size; ++counted) {
+            histogram[prefixBucket(text, size, counted)]++;
+        }
+        *counts = histogram;
+    }
+
+    corpus->data = data;
+    corpus->size = size;
+    corpus->mapped = capacity;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// mapCorpusFile
+//
+//      Map up to maxBytes of the named file (all of it, if maxBytes is 0).
+//      An anonymous zero-filled region one byte larger than the text is
+//      reserved first and the file is mapped over the front of it, so the
+//      terminating NUL is there even when the text ends on a page boundary,
+//      and nothing is copied.  A gzip or zstd file is decompressed into
+//      memory instead, by readCompressed, and then if counts is not NULL it
+//      is pointed at the prefix histogram counted on the way; otherwise it
+//      is set to NULL.  Returns false, with a message, on failure.
+//----------------------------------------------------------------------------
+
+static bool mapCorpusFile(const char *path, uint64_t maxBytes, Corpus *corpus,
+        uint64_t **counts)
+{
+    if (counts != NULL) {
+        *counts = NULL;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "markov: unable to open %s: %s.\n", path,
+                strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "markov: unable to stat %s: %s.\n", path,
+                strerror(errno));
+        close(fd);
+        return false;
+    }
+    char head[4];
+    ssize_t headLength = readHead(fd, head, sizeof(head));
+    if (headLength < 0) {
+        fprintf(stderr, "markov: error reading %s: %s.\n", path,
+                strerror(errno));
+        close(fd);
+        return false;
+    }
+    Compression compression = detectCompression(
+            (const unsigned char *) head, headLength);
+    if (compression != COMPRESSION_NONE) {
+        bool ok = readCompressed(fd, compression, head, headLength,
+                maxBytes, corpus, counts);
+        close(fd);
+        return ok;
+    }
+
+    uint64_t size = info.st_size;
+    if (maxBytes != 0 && size > maxBytes) {
+        size = maxBytes;
+    }
+    corpus->size = size;
+    corpus->mapped = pageRound(size + 1);
+    char *data = (char *) mmap(0, corpus->mapped, PROT_READ,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED
+            || (size != 0 && mmap(data, size, PROT_READ,
+                    MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        fprintf(stderr, "markov: unable to map %s: %s.\n", path,
+                strerror(errno));
+        if (data != MAP_FAILED) {
+            munmap(data, corpus->mapped);
+        }
+        corpus->data = NULL;
+        corpus->size = 0;
+        corpus->mapped = 0;
+        close(fd);
+        return false;
+    }
+    close(fd);
+    corpus->data = data;
+
+    madvise(corpus->data, corpus->mapped, MADV_WILLNEED);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// readCorpusStream
+//
+//      Read fd to end of file, or up to maxBytes if that is not 0, into
+//      anonymous memory from allocateInput, growing it as it fills.
+//      Unlike a single read, this cannot be cut short by a pipe.  gzip and
+//      zstd streams are decompressed, as mapCorpusFile does them, with
+//      counts set the same way.  Returns false, with a message, on failure.
+//----------------------------------------------------------------------------
+
+static bool readCorpusStream(int fd, uint64_t maxBytes, Corpus *corpus,
+        uint64_t **counts)
+{
+    if (counts != NULL) {
+        *counts = NULL;
+    }
+    char head[4];
+    ssize_t headLength = readHead(fd, head, sizeof(head));
+    if (headLength < 0) {
+        fprintf(stderr, "markov: error reading input data: %s.\n",
+                strerror(errno));
+        return false;
+    }
+    Compression compression = detectCompression(
+            (const unsigned char *) head, headLength);
+    if (compression != COMPRESSION_NONE) {
+        return readCompressed(fd, compression, head, headLength, maxBytes,
+                corpus, counts);
+    }
+
+    size_t capacity = 16 << 20;
+    char *data;
+    if (!allocateInput(&data, capacity)) {
+        return false;
+    }
+    uint64_t size = headLength;
+    if (maxBytes != 0 && size > maxBytes) {
+        size = maxBytes;
+    }
+    memcpy(data, head, size);
+    for (;;) {
+        if (size + 1 == capacity && !growInput(&data, &capacity)) {
+            return false;
+        }
+
+        // Always leave room for the NUL, which the anonymous mapping
+        // already provides.
+
+        uint64_t want = capacity - 1 - size;
+        if (maxBytes != 0 && want > maxBytes - size) {
+            want = maxBytes - size;
+        }
+        if (want == 0) {
+            break;
+        }
+        ssize_t got = read(fd, data + size, want);
+        if (got < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "markov: error reading input data: %s.\n",
+                    strerror(errno));
+            munmap(data, capacity);
+            return false;
+        }
+        if (got == 0) {
+            break;
+        }
+        size += got;
+    }
+
+    corpus->data = data;
+    corpus->size = size;
+    corpus->mapped = capacity;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// SuffixIndex
+//
+//      The suffix array, stored as offsets into the input rather than as
+//      pointers.  An offset takes 4 bytes when the input is under 4 GB, and
+//      5 bytes (packed, little-endian) otherwise, instead of the 8 bytes of
+//      a pointer.
+//
+//      Alongside it is a bucket table giving the range of suffixes that
+//      start with each one- or two-byte prefix, so that a search only has
+//      to look inside one bucket.
+//----------------------------------------------------------------------------
+
+struct SuffixIndex {
+    uint64_t        count;          // Number of suffixes.
+    int             width;          // Bytes per entry, 4 or 5.
+    unsigned char  *data;
+    uint64_t       *buckets;        // PREFIX_BUCKETS + 1 bucket starts.
+};
+
+static inline uint64_t suffixAt(const SuffixIndex *index, uint64_t i)
+{
+    if (index->width == 4) {
+        return ((const uint32_t *) index->data)[i];
+    }
+    const unsigned char *entry = index->data + i * 5;
+    uint32_t low;
+    memcpy(&low, entry, 4);
+    return low | ((uint64_t) entry[4] << 32);
+}
+
+static inline const unsigned char *suffixEntry(const SuffixIndex *index,
+        uint64_t i)
+{
+    return index->data + i * index->width;
+}
+
+static inline void setSuffixAt(SuffixIndex *index, uint64_t i,
+        uint64_t offset)
+{
+    if (index->width == 4) {
+        ((uint32_t *) index->data)[i] = (uint32_t) offset;
+        return;
+    }
+    unsigned char *entry = index->data + i * 5;
+    uint32_t low = (uint32_t) offset;
+    memcpy(entry, &low, 4);
+    entry[4] = (unsigned char) (offset >> 32);
+}
+
+//----------------------------------------------------------------------------
+// initSuffixIndex
+//
+//      Allocate an index for n suffixes, choosing the narrowest width that
+//      can hold every offset.  Offsets must stay below 2^32 - 1 for the
+//      4-byte form, since SA-IS reserves the all-ones value.  Returns
+//      false, with a message, if there is not enough memory.
+//----------------------------------------------------------------------------
+
+static bool initSuffixIndex(SuffixIndex *index, uint64_t n)
+{
+    index->count = n;
+    index->width = (n < 0xffffffffull) ? 4 : 5;
+    index->data = new (std::nothrow) unsigned char[n * index->width];
+    index->buckets = new (std::nothrow) uint64_t[PREFIX_BUCKETS + 1];
+    if (index->data == NULL || index->buckets == NULL) {
+        fprintf(stderr, "markov: unable to allocate suffix array for %llu "
+                "suffixes.\n", (unsigned long long) n);
+        delete [] index->data;
+        delete [] index->buckets;
+        index->data = NULL;
+        index->buckets = NULL;
+        return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// countPrefixBuckets
+//
+//      Fill in the bucket table of index from a histogram of the two-byte
+//      prefixes of input[0..n), or from counts if that is not NULL, when
+//      readCompressed has already counted them.  This needs only the text,
+//      so it can be done before or during the sort.
+//----------------------------------------------------------------------------
+
+static void countPrefixBuckets(const char *input, uint64_t n,
+        const uint64_t *counts, SuffixIndex *index)
+{
+    const unsigned char *text = (const unsigned char *) input;
+    uint64_t *buckets = index->buckets;
+    if (counts != NULL) {
+        memcpy(buckets, counts, (PREFIX_BUCKETS + 1) * sizeof(uint64_t));
+    } else {
+        memset(buckets, 0, (PREFIX_BUCKETS + 1) * sizeof(uint64_t));
+        for (uint64_t i = 0; i < n; ++i) {
+            buckets[prefixBucket(text, n, i)]++;
+        }
+    }
+    uint64_t total = 0;
+    for (unsigned int b = 0; b <= PREFIX_BUCKETS; ++b) {
+        uint64_t count = buckets[b];
+        buckets[b] = total;
+        total += count;
+    }
+}
+
+//----------------------------------------------------------------------------
+// prefixRange
+//
+//      Narrow [*lo, *hi) to the bucket holding every suffix that starts
+//      with the first min(k, 2) bytes of prefix.
+//----------------------------------------------------------------------------
+
+static inline void prefixRange(const SuffixIndex *index, const char *prefix,
+        int k, uint64_t *lo, uint64_t *hi)
+{
+    const unsigned char *p = (const unsigned char *) prefix;
+    if (k >= 2) {
+        unsigned int bucket = p[0] * 257 + p[1] + 1;
+        *lo = index->buckets[bucket];
+        *hi = index->buckets[bucket + 1];
+    } else if (k == 1) {
+        *lo = index->buckets[p[0] * 257];
+        *hi = index->buckets[p[0] * 257 + 257];
+    } else {
+        *lo = 0;
+        *hi = index->count;
+    }
+}
+
+//----------------------------------------------------------------------------
+// compareSuffixes
+//
+//      Compare the suffixes at a and b of input[0..n) in suffix array
+//      order: bytewise, with the end of the input below every byte.
+//----------------------------------------------------------------------------
+
+static inline int compareSuffixes(const char *input, uint64_t n, uint64_t a,
+        uint64_t b)
+{
+    uint64_t left = n - a;
+    uint64_t right = n - b;
+    int order = memcmp(input + a, input + b, min(left, right));
+    if (order != 0) {
+        return order;
+    }
+    return (left < right) ? -1 : (left > right);
+}
+
+//----------------------------------------------------------------------------
+// SuffixLess
+//
+//      Orders suffixes, given as offsets into input[0..n), the way
+//      compareSuffixes orders them, for the reference sort.
+//----------------------------------------------------------------------------
+
+template <typename Index>
+struct SuffixLess {
+    const char     *input;
+    uint64_t        n;
+
+    bool operator()(Index a, Index b) const
+    {
+        return compareSuffixes(input, n, a, b) < 0;
+    }
+};
+
+//----------------------------------------------------------------------------
+// saisInduce
+//
+//      The induced sorting step of SA-IS: seed the buckets with the given
+//      LMS positions, then induce the order of the L-type suffixes left to
+//      right and of the S-type suffixes right to left.
+//----------------------------------------------------------------------------
+
+template <typename Symbol, typename Index>
+static void saisInduce(const Symbol *s, Index n, Index *sa,
+        const vector<bool> &isS, const vector<Index> &seeds,
+        const vector<Index> &bucketL, const vector<Index> &bucketS,
+        vector<Index> &cursor)
+{
+    const Index EMPTY = (Index) -1;
+
+    for (Index i = 0; i < n; ++i) {
+        sa[i] = EMPTY;
+    }
+    cursor = bucketS;
+    for (size_t i = 0; i < seeds.size(); ++i) {
+        Index d = seeds[i];
+        if (d != n) {
+            sa[cursor[s[d]]++] = d;
+        }
+    }
+    cursor = bucketL;
+    sa[cursor[s[n - 1]]++] = n - 1;
+    for (Index i = 0; i < n; ++i) {
+        Index v = sa[i];
+        if (v != EMPTY && v >= 1 && !isS[v - 1]) {
+            sa[cursor[s[v - 1]]++] = v - 1;
+        }
+    }
+    cursor = bucketL;
+    for (Index i = n; i-- > 0; ) {
+        Index v = sa[i];
+        if (v != EMPTY && v >= 1 && isS[v - 1]) {
+            sa[--cursor[s[v - 1] + 1]] = v - 1;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// saisBuild
+//
+//      Construct the suffix array of s[0..n), with symbols in [0, upper],
+//      in linear time using the SA-IS algorithm of Nong, Zhang and Chan.
+//      The end of the string acts as a virtual sentinel smaller than any
+//      symbol, so no terminator is needed and a proper prefix always sorts
+//      before the longer suffix -- the order compareSuffixes gives, which
+//      is strcmp's for text without embedded NULs.
+//
+//      The reduced problem is solved recursively with the LMS substring
+//      names as symbols, so Symbol is the input character type and Index
+//      is both the position type and the symbol type of the recursion.
+//----------------------------------------------------------------------------
+
+template <typename Symbol, typename Index>
+static void saisBuild(const Symbol *s, Index n, Index upper, Index *sa)
+{
+    const Index EMPTY = (Index) -1;
+
+    if (n == 0) {
+        return;
+    }
+    if (n == 1) {
+        sa[0] = 0;
+        return;
+    }
+    if (n == 2) {
+        if (s[0] < s[1]) {
+            sa[0] = 0;
+            sa[1] = 1;
+        } else {
+            sa[0] = 1;
+            sa[1] = 0;
+        }
+        return;
+    }
+
+    // Classify every position as S-type (true) or L-type (false).  The
+    // last position is L-type, since the virtual sentinel follows it.
+
+    vector<bool> isS(n, false);
+    for (Index i = n - 1; i-- > 0; ) {
+        isS[i] = (s[i] == s[i + 1]) ? isS[i + 1] : (s[i] < s[i + 1]);
+    }
+
+    // bucketL[c] is the first slot of the bucket for symbol c, which is
+    // where its L-type suffixes go; bucketS[c] is the first slot of the
+    // S-type suffixes in that bucket.
+
+    vector<Index> bucketL(upper + 2, 0);
+    vector<Index> bucketS(upper + 2, 0);
+    for (Index i = 0; i < n; ++i) {
+        if (!isS[i]) {
+            bucketS[s[i]]++;
+        } else {
+            bucketL[s[i] + 1]++;
+        }
+    }
+    for (Index c = 0; c <= upper; ++c) {
+        bucketS[c] += bucketL[c];
+        if (c < upper) {
+            bucketL[c + 1] += bucketS[c];
+        }
+    }
+
+    // Find the LMS (leftmost S-type) positions, and number them in text
+    // order.
+
+    vector<Index> lmsIndex(n + 1, EMPTY);
+    Index m = 0;
+    for (Index i = 1; i < n; ++i) {
+        if (!isS[i - 1] && isS[i]) {
+            lmsIndex[i] = m++;
+        }
+    }
+    vector<Index> lms;
+    lms.reserve(m);
+    for (Index i = 1; i < n; ++i) {
+        if (!isS[i - 1] && isS[i]) {
+            lms.push_back(i);
+        }
+    }
+
+    vector<Index> cursor(upper + 2);
+    saisInduce(s, n, sa, isS, lms, bucketL, bucketS, cursor);
+    if (m == 0) {
+        return;
+    }
+
+    // The LMS suffixes now appear in sa ordered by their LMS substrings.
+    // Give each distinct LMS substring a name, and sort the string of
+    // names recursively to get the true order of the LMS suffixes.
+
+    vector<Index> sortedLms;
+    sortedLms.reserve(m);
+    for (Index i = 0; i < n; ++i) {
+        if (lmsIndex[sa[i]] != EMPTY) {
+            sortedLms.push_back(sa[i]);
+        }
+    }
+
+    vector<Index> names(m);
+    Index nameCount = 0;
+    names[lmsIndex[sortedLms[0]]] = 0;
+    for (Index i = 1; i < m; ++i) {
+        Index l = sortedLms[i - 1];
+        Index r = sortedLms[i];
+        Index endL = (lmsIndex[l] + 1 < m) ? lms[lmsIndex[l] + 1] : n;
+        Index endR = (lmsIndex[r] + 1 < m) ? lms[lmsIndex[r] + 1] : n;
+        bool same = true;
+        if (endL - l != endR - r) {
+            same = false;
+        } else {
+            while (l < endL && s[l] == s[r]) {
+                ++l;
+                ++r;
+            }
+            if (l < endL || endL == n || endR == n || s[l] != s[r]) {
+                same = false;
+            }
+        }
+        if (!same) {
+            ++nameCount;
+        }
+        names[lmsIndex[sortedLms[i]]] = nameCount;
+    }
+    vector<Index>().swap(lmsIndex);
+
+    vector<Index> namesSa(m);
+    saisBuild<Index, Index>(&names[0], m, nameCount, &namesSa[0]);
+    for (Index i = 0; i < m; ++i) {
+        sortedLms[i] = lms[namesSa[i]];
+    }
+    vector<Index>().swap(names);
+    vector<Index>().swap(namesSa);
+
+    saisInduce(s, n, sa, isS, sortedLms, bucketL, bucketS, cursor);
+}
+
+//----------------------------------------------------------------------------
+// runThreads
+//
+//      Run body on threads threads, passing args[i] to thread i, and wait
+//      for all of them.  Thread 0 is the caller.
+//----------------------------------------------------------------------------
+
+static void runThreads(int threads, void *(*body)(void *), void **args)
+{
+    vector<pthread_t> workers(threads);
+    int started = 1;
+    for (; started < threads; ++started) {
+        if (pthread_create(&workers[started], 0, body, args[started]) != 0) {
+            break;
+        }
+    }
+
+    // If a thread could not be started, do its share here.
+
+    body(args[0]);
+    for (int i = started; i < threads; ++i) {
+        body(args[i]);
+    }
+    for (int i = 1; i < started; ++i) {
+        pthread_join(workers[i], 0);
+    }
+}
+
+//----------------------------------------------------------------------------
+// DoublingSort
+//
+//      Shared state for the parallel prefix doubling sort.  After each
+//      round the suffixes are ordered by their first h characters, and the
+//      rank of every suffix is one more than the first slot of its group of
+//      suffixes that are still equal over those h characters.  Each round
+//      sorts the unfinished groups by the rank h characters further on,
+//      doubling h.  Groups are independent, so the threads take them as
+//      tasks; splitting the groups and updating ranks is a separate phase,
+//      since sorting reads the ranks of arbitrary suffixes.
+//----------------------------------------------------------------------------
+
+enum DoublingPhase {
+    DOUBLING_COUNT,
+    DOUBLING_SCATTER,
+    DOUBLING_SORT,
+    DOUBLING_RANK
+};
+
+template <typename Index>
+struct DoublingSort {
+    typedef pair<Index, Index> Range;
+
+    const unsigned char    *text;
+    Index                   n;
+    uint64_t                h;
+    Index                  *sa;
+    Index                  *rank;
+    pair<Index, Index>     *pairs;      // (key, suffix) while sorting.
+    int                     threads;
+    DoublingPhase           phase;
+    vector<Index>           counts;     // PREFIX_BUCKETS per thread.
+    vector<Index>           starts;     // First slot of each bucket.
+    vector<Range>           groups;     // Unfinished [start, end) groups.
+    size_t                  batch;      // Groups claimed at a time.
+    size_t                  nextGroup;
+    vector<vector<Range> >  split;      // New groups found by each thread.
+};
+
+template <typename Index>
+struct DoublingWorker {
+    DoublingSort<Index>    *sort;
+    int                     id;
+};
+
+template <typename Index>
+static void *doublingWorker(void *arg)
+{
+    DoublingWorker<Index> *worker = (DoublingWorker<Index> *) arg;
+    DoublingSort<Index> *sort = worker->sort;
+    int id = worker->id;
+    Index n = sort->n;
+    Index chunkStart = (Index) ((uint64_t) n * id / sort->threads);
+    Index chunkEnd = (Index) ((uint64_t) n * (id + 1) / sort->threads);
+
+    switch (sort->phase) {
+        case DOUBLING_COUNT: {
+            Index *counts = &sort->counts[id * PREFIX_BUCKETS];
+            for (Index i = chunkStart; i < chunkEnd; ++i) {
+                counts[prefixBucket(sort->text, n, i)]++;
+            }
+            break;
+        }
+
+        case DOUBLING_SCATTER: {
+            // counts now holds where this thread's share of each bucket
+            // starts.
+
+            Index *cursor = &sort->counts[id * PREFIX_BUCKETS];
+            for (Index i = chunkStart; i < chunkEnd; ++i) {
+                unsigned int bucket = prefixBucket(sort->text, n, i);
+                sort->sa[cursor[bucket]++] = i;
+                sort->rank[i] = sort->starts[bucket] + 1;
+            }
+            break;
+        }
+
+        case DOUBLING_SORT: {
+            for (;;) {
+                size_t first = __sync_fetch_and_add(&sort->nextGroup,
+                        sort->batch);
+                if (first >= sort->groups.size()) {
+                    break;
+                }
+                size_t last = first + sort->batch;
+                if (last > sort->groups.size()) {
+                    last = sort->groups.size();
+                }
+                for (size_t g = first; g < last; ++g) {
+                    Index start = sort->groups[g].first;
+                    Index end = sort->groups[g].second;
+                    for (Index i = start; i < end; ++i) {
+                        uint64_t next = sort->sa[i] + sort->h;
+                        sort->pairs[i].first = (next < n)
+                                ? sort->rank[next] : 0;
+                        sort->pairs[i].second = sort->sa[i];
+                    }
+                    std::sort(sort->pairs + start, sort->pairs + end);
+                }
+            }
+            break;
+        }
+
+        case DOUBLING_RANK: {
+            vector<typename DoublingSort<Index>::Range> &split =
+                    sort->split[id];
+            for (;;) {
+                size_t first = __sync_fetch_and_add(&sort->nextGroup,
+                        sort->batch);
+                if (first >= sort->groups.size()) {
+                    break;
+                }
+                size_t last = first + sort->batch;
+                if (last > sort->groups.size()) {
+                    last = sort->groups.size();
+                }
+                for (size_t g = first; g < last; ++g) {
+                    Index start = sort->groups[g].first;
+                    Index end = sort->groups[g].second;
+                    Index head = start;
+                    for (Index i = start; i < end; ++i) {
+                        if (i > start
+                                && sort->pairs[i].first
+                                        != sort->pairs[i - 1].first) {
+                            if (i - head > 1) {
+                                split.push_back(make_pair(head, i));
+                            }
+                            head = i;
+                        }
+                        sort->sa[i] = sort->pairs[i].second;
+                        sort->rank[sort->pairs[i].second] = head + 1;
+                    }
+                    if (end - head > 1) {
+                        split.push_back(make_pair(head, end));
+                    }
+                }
+            }
+            break;
+        }
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// doublingBuild
+//
+//      Construct the suffix array of text[0..n) on the given number of
+//      threads, in the same order as saisBuild, and fill in buckets with
+//      the start of every prefix bucket.  The first round is a parallel
+//      counting sort on two characters; each later round doubles
+//      the number of characters compared.  This takes O(n log n) work in
+//      the worst case, against linear for SA-IS, but spreads it evenly over
+//      the threads, and needs about 4 Index-sized words per suffix.
+//      Returns false, with a message, if there is not enough memory.
+//----------------------------------------------------------------------------
+
+template <typename Index>
+static bool doublingBuild(const unsigned char *text, Index n, Index *sa,
+        int threads, uint64_t *buckets)
+{
+    if (n == 0) {
+        memset(buckets, 0, (PREFIX_BUCKETS + 1) * sizeof(uint64_t));
+        return true;
+    }
+    if ((uint64_t) threads > n) {
+        threads = (int) n;
+    }
+
+    DoublingSort<Index> sort;
+    sort.text = text;
+    sort.n = n;
+    sort.sa = sa;
+    sort.rank = new (std::nothrow) Index[n];
+    sort.pairs = new (std::nothrow) pair<Index, Index>[n];
+    if (sort.rank == NULL || sort.pairs == NULL) {
+        fprintf(stderr, "markov: unable to allocate prefix doubling "
+                "arrays.\n");
+        delete [] sort.rank;
+        delete [] sort.pairs;
+        return false;
+    }
+    sort.threads = threads;
+    sort.counts.assign((size_t) threads * PREFIX_BUCKETS, 0);
+    sort.starts.resize(PREFIX_BUCKETS);
+    sort.split.resize(threads);
+
+    vector<DoublingWorker<Index> > workers(threads);
+    vector<void *> args(threads);
+    for (int t = 0; t < threads; ++t) {
+        workers[t].sort = &sort;
+        workers[t].id = t;
+        args[t] = &workers[t];
+    }
+
+    // Bucket the suffixes by their first two characters.
+
+    sort.phase = DOUBLING_COUNT;
+    runThreads(threads, doublingWorker<Index>, &args[0]);
+
+    Index total = 0;
+    for (unsigned int b = 0; b < PREFIX_BUCKETS; ++b) {
+        sort.starts[b] = total;
+        for (int t = 0; t < threads; ++t) {
+            Index count = sort.counts[t * PREFIX_BUCKETS + b];
+            sort.counts[t * PREFIX_BUCKETS + b] = total;
+            total += count;
+        }
+        buckets[b] = sort.starts[b];
+        if (total - sort.starts[b] > 1) {
+            sort.groups.push_back(make_pair(sort.starts[b], total));
+        }
+    }
+    buckets[PREFIX_BUCKETS] = n;
+
+    sort.phase = DOUBLING_SCATTER;
+    runThreads(threads, doublingWorker<Index>, &args[0]);
+    vector<Index>().swap(sort.counts);
+
+    // Double until every group is a single suffix.
+
+    for (sort.h = 2; !sort.groups.empty(); sort.h *= 2) {
+        sort.batch = sort.groups.size() / ((size_t) threads * 64) + 1;
+
+        sort.phase = DOUBLING_SORT;
+        sort.nextGroup = 0;
+        runThreads(threads, doublingWorker<Index>, &args[0]);
+
+        sort.phase = DOUBLING_RANK;
+        sort.nextGroup = 0;
+        runThreads(threads, doublingWorker<Index>, &args[0]);
+
+        sort.groups.clear();
+        for (int t = 0; t < threads; ++t) {
+            sort.groups.insert(sort.groups.end(), sort.split[t].begin(),
+                    sort.split[t].end());
+            sort.split[t].clear();
+        }
+    }
+
+    delete [] sort.rank;
+    delete [] sort.pairs;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// buildSuffixArray
+//
+//      Allocate index and fill it with the offset of every suffix of
+//      input[0..n), sorted as compareSuffixes orders them, using the
+//      requested algorithm, along with its prefix buckets, from counts if
+//      that is not NULL.  Only SA_ALGO_PARALLEL uses more than one thread,
+//      and it gets the buckets from its first round for free.  Returns
+//      false, with a message and index freed, if there is not enough
+//      memory.
+//----------------------------------------------------------------------------
+
+static bool buildSuffixArray(const char *input, uint64_t n,
+        const uint64_t *counts, SuffixIndex *index, SuffixAlgorithm algorithm,
+        int threads)
+{
+    if (!initSuffixIndex(index, n)) {
+        return false;
+    }
+    if (algorithm != SA_ALGO_PARALLEL) {
+        countPrefixBuckets(input, n, counts, index);
+    }
+
+    // 4-byte offsets are sorted in place; wider ones are sorted as 64-bit
+    // values and then packed down.
+
+    uint64_t *wide = NULL;
+    if (index->width != 4) {
+        wide = new (std::nothrow) uint64_t[n];
+        if (wide == NULL) {
+            fprintf(stderr, "markov: unable to allocate suffix sort "
+                    "buffer.\n");
+            delete [] index->data;
+            delete [] index->buckets;
+            return false;
+        }
+    }
+
+    bool ok = true;
+    const unsigned char *text = (const unsigned char *) input;
+    switch (algorithm) {
+        case SA_ALGO_QSORT: {
+            // Sort the offsets by comparing the suffixes bytewise.  This is
+            // O(n log n) comparisons, each of which can scan arbitrarily
+            // far on repetitive input, but it is simple enough to serve as
+            // a reference.
+
+            if (wide == NULL) {
+                uint32_t *sa = (uint32_t *) index->data;
+                for (uint64_t i = 0; i < n; ++i) {
+                    sa[i] = (uint32_t) i;
+                }
+                SuffixLess<uint32_t> less = { input, n };
+                std::sort(sa, sa + n, less);
+            } else {
+                for (uint64_t i = 0; i < n; ++i) {
+                    wide[i] = i;
+                }
+                SuffixLess<uint64_t> less = { input, n };
+                std::sort(wide, wide + n, less);
+            }
+            break;
+        }
+
+        case SA_ALGO_SAIS: {
+            // SA-IS keeps its working arrays in vectors, so running out of
+            // memory there throws rather than returning.
+
+            try {
+                if (wide == NULL) {
+                    saisBuild<unsigned char, uint32_t>(text, n, 255,
+                            (uint32_t *) index->data);
+                } else {
+                    saisBuild<unsigned char, uint64_t>(text, n, 255, wide);
+                }
+            } catch (const std::bad_alloc &) {
+                fprintf(stderr, "markov: unable to allocate SA-IS "
+                        "arrays.\n");
+                ok = false;
+            }
+            break;
+        }
+
+        case SA_ALGO_PARALLEL: {
+            if (wide == NULL) {
+                ok = doublingBuild<uint32_t>(text, n,
+                        (uint32_t *) index->data, threads, index->buckets);
+            } else {
+                ok = doublingBuild<uint64_t>(text, n, wide, threads,
+                        index->buckets);
+            }
+            break;
+        }
+    }
+
+    if (ok && wide != NULL) {
+        for (uint64_t i = 0; i < n; ++i) {
+            setSuffixAt(index, i, wide[i]);
+        }
+    }
+    delete [] wide;
+    if (!ok) {
+        delete [] index->data;
+        delete [] index->buckets;
+    }
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// verifySuffixArray
+//
+//      Check that adjacent suffixes are in compareSuffixes order, NULs and
+//      all.  Returns the index of the first out-of-order suffix, or 0 if
+//      the array is sorted.
+//----------------------------------------------------------------------------
+
+static uint64_t verifySuffixArray(const char *input, const SuffixIndex *index)
+{
+    for (uint64_t i = 1; i < index->count; ++i) {
+        if (compareSuffixes(input, index->count, suffixAt(index, i - 1),
+                suffixAt(index, i)) > 0) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// tailRepeats, repeatedTailLength
+//
+//      Whether the last length bytes of input[0..n) occur anywhere else in
+//      it, found by a binary search of index; and the longest such tail,
+//      found by doubling and then halving the length.
+//----------------------------------------------------------------------------
+
+static bool tailRepeats(const char *input, uint64_t n,
+        const SuffixIndex *index, uint64_t length)
+{
+    const char *tail = input + n - length;
+    uint64_t lo, hi;
+    prefixRange(index, tail, (length < 2) ? 1 : 2, &lo, &hi);
+    while (lo < hi) {
+        uint64_t m = lo + (hi - lo) / 2;
+        uint64_t offset = suffixAt(index, m);
+        uint64_t left = n - offset;
+        int order = memcmp(input + offset, tail, min(left, length));
+        if (order < 0 || (order == 0 && left < length)) {
+            lo = m + 1;
+        } else {
+            hi = m;
+        }
+    }
+
+    // The tail itself is the first match, being the shortest; another
+    // match has to follow it.
+
+    if (lo + 1 >= index->count) {
+        return false;
+    }
+    uint64_t offset = suffixAt(index, lo + 1);
+    return n - offset >= length
+            && memcmp(input + offset, tail, length) == 0;
+}
+
+static uint64_t repeatedTailLength(const char *input, uint64_t n,
+        const SuffixIndex *index)
+{
+    uint64_t good = 0;
+    uint64_t bad = 1;
+    while (bad < n && tailRepeats(input, n, index, bad)) {
+        good = bad;
+        bad *= 2;
+    }
+    if (bad > n) {
+        bad = n;
+    }
+    while (good + 1 < bad) {
+        uint64_t m = good + (bad - good) / 2;
+        if (tailRepeats(input, n, index, m)) {
+            good = m;
+        } else {
+            bad = m;
+        }
+    }
+    return good;
+}
+
+//----------------------------------------------------------------------------
+// appendToIndex
+//
+//      Make corpus and index for the text of old followed by size bytes of
+//      text, from oldIndex, sorting only the suffixes that the new text
+//      can move.  Appending text leaves the order of two old suffixes alone
+//      unless one is a prefix of the other, which only the old suffixes
+//      that occur elsewhere in the old text can be: the last L of them, for
+//      the longest such tail.  Those and the new suffixes are sorted by
+//      SA-IS on their own, as they run to the end; each is given its rank
+//      among the rest of the old suffixes by a binary search of the old
+//      index that steps over the L, and one pass merges the two.  Returns
+//      false, with a message, on failure.
+//----------------------------------------------------------------------------
+
+static bool appendToIndex(const Corpus *old, const SuffixIndex *oldIndex,
+        const char *text, uint64_t size, Corpus *corpus, SuffixIndex *index)
+{
+    uint64_t oldSize = old->size;
+    uint64_t n = oldSize + size;
+    corpus->size = n;
+    corpus->mapped = pageRound(n + 1);
+    corpus->data = (char *) mmap(0, corpus->mapped, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (corpus->data == MAP_FAILED) {
+        fprintf(stderr, "markov: unable to allocate input buffer: %s.\n",
+                strerror(errno));
+        return false;
+    }
+    memcpy(corpus->data, old->data, oldSize);
+    memcpy(corpus->data + oldSize, text, size);
+    const char *input = corpus->data;
+
+    // The last old suffix always moves, as its prefix bucket changes.
+
+    uint64_t first = oldSize - max(repeatedTailLength(old->data, oldSize,
+            oldIndex), (uint64_t) 1);
+    uint64_t count = n - first;
+    const unsigned char *tail = (const unsigned char *) input + first;
+    vector<uint64_t> moved(count);
+    if (count < 0xffffffffull) {
+        vector<uint32_t> sa(count);
+        saisBuild<unsigned char, uint32_t>(tail, count, 255, &sa[0]);
+        for (uint64_t i = 0; i < count; ++i) {
+            moved[i] = first + sa[i];
+        }
+    } else {
+        saisBuild<unsigned char, uint64_t>(tail, count, 255, &moved[0]);
+        for (uint64_t i = 0; i < count; ++i) {
+            moved[i] += first;
+        }
+    }
+
+    // Rank each moved suffix among the old ones that stay put.  The ranks
+    // only grow, since both lists are in order.
+
+    vector<uint64_t> rank(count);
+    uint64_t floor = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t p = moved[i];
+        uint64_t lo, hi;
+        prefixRange(oldIndex, input + p, (n - p < 2) ? 1 : 2, &lo, &hi);
+        lo = max(lo, floor);
+        hi = max(hi, lo);
+        while (lo < hi) {
+            uint64_t m = lo + (hi - lo) / 2;
+            uint64_t k = m;
+            while (k < hi && suffixAt(oldIndex, k) >= first) {
+                ++k;
+            }
+            if (k == hi) {
+                hi = m;
+            } else if (compareSuffixes(input, n, suffixAt(oldIndex, k), p)
+                    < 0) {
+                lo = k + 1;
+            } else {
+                hi = m;
+            }
+        }
+        rank[i] = lo;
+        floor = lo;
+    }
+
+    if (!initSuffixIndex(index, n)) {
+        munmap(corpus->data, corpus->mapped);
+        return false;
+    }
+    uint64_t j = 0;
+    uint64_t i = 0;
+    for (uint64_t k = 0; k < oldSize; ++k) {
+        while (i < count && rank[i] <= k) {
+            setSuffixAt(index, j++, moved[i++]);
+        }
+        uint64_t offset = suffixAt(oldIndex, k);
+        if (offset < first) {
+            setSuffixAt(index, j++, offset);
+        }
+    }
+    while (i < count) {
+        setSuffixAt(index, j++, moved[i++]);
+    }
+    countPrefixBuckets(input, n, NULL, index);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// SearchTree
+//
+//      A sample of every SEARCH_SAMPLE'th suffix, with the first
+//      min(K, 8) bytes of each inlined as a big-endian integer key and laid
+//      out in Eytzinger (breadth-first) order.  Descending the tree walks
+//      one contiguous array, so the next several levels can be prefetched
+//      a cache line at a time, and no probe touches the suffix array or
+//      the input.  The descent narrows the search to one sample interval,
+//      which a short binary search over the real suffixes finishes off.
+//----------------------------------------------------------------------------
+
+static const uint64_t SEARCH_SAMPLE = 16;
+
+struct SearchTree {
+    int             keyBytes;       // min(K, 8).
+    uint64_t        count;          // Number of samples.
+    uint64_t       *keys;           // keys[1..count], Eytzinger order.
+    uint64_t       *rank;           // Sorted sample number of each node.
+};
+
+// Load up to len bytes at p as a big-endian key, padding with zeros past
+// avail bytes, so keys order the same way strcmp orders the text.
+
+static inline uint64_t searchKey(const char *p, uint64_t avail, int len)
+{
+    uint64_t key = 0;
+    for (int i = 0; i < len; ++i) {
+        key <<= 8;
+        if ((uint64_t) i < avail) {
+            key |= (unsigned char) p[i];
+        }
+    }
+    return key << (8 * (8 - len));
+}
+
+//----------------------------------------------------------------------------
+// fillSearchTree
+//
+//      Place samples [first, ...) in the subtree rooted at node, in order,
+//      by an in-order walk.  Returns the next sample to place.
+//----------------------------------------------------------------------------
+
+static uint64_t fillSearchTree(SearchTree *tree, const char *input,
+        const SuffixIndex *index, uint64_t node, uint64_t sample)
+{
+    if (node > tree->count) {
+        return sample;
+    }
+    sample = fillSearchTree(tree, input, index, 2 * node, sample);
+    uint64_t offset = suffixAt(index, sample * SEARCH_SAMPLE);
+    tree->keys[node] = searchKey(input + offset, index->count - offset,
+            tree->keyBytes);
+    tree->rank[node] = sample;
+    return fillSearchTree(tree, input, index, 2 * node + 1, sample + 1);
+}
+
+//----------------------------------------------------------------------------
+// buildSearchTree
+//
+//      Sample the sorted suffixes and build the tree for order k.  Returns
+//      false, with a message, if there is no memory for it.
+//----------------------------------------------------------------------------
+
+static bool buildSearchTree(SearchTree *tree, const char *input,
+        const SuffixIndex *index, int k)
+{
+    tree->keyBytes = (k < 8) ? k : 8;
+    tree->count = (index->count + SEARCH_SAMPLE - 1) / SEARCH_SAMPLE;
+
+    // Node 0 is unused; aligning the array puts the 8 grandchildren three
+    // levels below any node in a single cache line.
+
+    void *keys;
+    if (posix_memalign(&keys, 64, (tree->count + 1) * sizeof(uint64_t)) != 0) {
+        fprintf(stderr, "markov: unable to allocate search tree.\n");
+        return false;
+    }
+    tree->keys = (uint64_t *) keys;
+    tree->keys[0] = 0;
+    tree->rank = new uint64_t[tree->count + 1];
+    tree->rank[0] = tree->count;
+    fillSearchTree(tree, input, index, 1, 0);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// searchTreeBound
+//
+//      Return the sorted number of the first sample whose key is greater
+//      than key, or greater than or equal to it if strict is false; count
+//      if there is none.  The descent is branch-free, and prefetches the
+//      nodes three levels down as it goes.
+//----------------------------------------------------------------------------
+
+static inline uint64_t searchTreeBound(const SearchTree *tree, uint64_t key,
+        bool strict)
+{
+    const uint64_t *keys = tree->keys;
+    uint64_t n = tree->count;
+    uint64_t node = 1;
+    while (node <= n) {
+        __builtin_prefetch(keys + 8 * node);
+        node = 2 * node + (strict ? (keys[node] <= key) : (keys[node] < key));
+    }
+
+    // Strip the trailing right turns, and the left turn before them, to
+    // get back to the node where the search last went left.
+
+    node >>= __builtin_ffsll(~node);
+    return tree->rank[node];
+}
+
+//----------------------------------------------------------------------------
+// searchBounds
+//
+//      Narrow the range a search for the k bytes at prefix must cover, as
+//      the method chooses: not at all, to one prefix bucket, or to one
+//      search tree interval.  The suffix at *l sorts before the prefix and
+//      the one at *u at or after it, where -1 and the suffix count stand
+//      for the ends of the array.
+//----------------------------------------------------------------------------
+
+static inline void searchBounds(const SuffixIndex *suffixes,
+        const SearchTree *tree, SearchMethod method, const char *prefix,
+        int k, int64_t *lower, int64_t *upper)
+{
+    int64_t l = -1;
+    int64_t u = suffixes->count;
+
+    switch (method) {
+        case SEARCH_BINARY: {
+            break;
+        }
+
+        case SEARCH_BUCKET: {
+            uint64_t bucketStart, bucketEnd;
+            prefixRange(suffixes, prefix, k, &bucketStart, &bucketEnd);
+            l = (int64_t) bucketStart - 1;
+            u = bucketEnd;
+            break;
+        }
+
+        case SEARCH_EYTZINGER: {
+            // With the whole prefix in the key, the first sample at or
+            // after it bounds the match; otherwise only the first sample
+            // past the key does.
+
+            uint64_t key = searchKey(prefix, k, tree->keyBytes);
+            uint64_t first = searchTreeBound(tree, key, false);
+            if (first > 0) {
+                l = (first - 1) * SEARCH_SAMPLE;
+            }
+            uint64_t last = (k <= 8)
+                    ? first : searchTreeBound(tree, key, true);
+            if (last < tree->count) {
+                u = last * SEARCH_SAMPLE;
+            }
+            break;
+        }
+    }
+    *lower = l;
+    *upper = u;
+}
+
+//----------------------------------------------------------------------------
+// PrefixKernels
+//
+//      Functions that compare the first k bytes of a suffix with a prefix,
+//      as memcmp would, except that a suffix of fewer than k bytes (avail
+//      is what is left of the input) sorts before any prefix it starts
+//      with, as it does in the suffix array.  They stand in for strncmp on
+//      the search path, which walks a byte at a time looking for a NUL.
+//
+//      There is one function for each length up to PREFIX_KERNEL_MAX, with
+//      the length a compile-time constant, and a general one for longer
+//      prefixes.  On x86-64 they compare 16 bytes at a time with SSE2, or
+//      32 with AVX2 on processors that have it, and find the first
+//      difference from the movemask of a byte compare.  A load may run
+//      past the k bytes, though never onto another page; the bytes past k
+//      are masked off, and a suffix too near the end of the input is
+//      compared a byte at a time.  None of them wins everywhere, so a
+//      generator times each set, strncmp included, and keeps the fastest.
+//----------------------------------------------------------------------------
+
+static const int PREFIX_KERNEL_MAX = 32;
+
+typedef int (*PrefixCompare)(const char *text, uint64_t avail,
+        const char *prefix, int k);
+
+struct PrefixKernels {
+    const char     *name;
+    PrefixCompare   byLength[PREFIX_KERNEL_MAX + 1];
+    PrefixCompare   longer;
+};
+
+static inline int comparePrefix(const PrefixKernels *kernels,
+        const char *text, uint64_t avail, const char *prefix, int k)
+{
+    PrefixCompare compare = (k <= PREFIX_KERNEL_MAX)
+            ? kernels->byLength[k] : kernels->longer;
+    return compare(text, avail, prefix, k);
+}
+
+static inline int compareBytes(const char *text, uint64_t avail,
+        const char *prefix, int k)
+{
+    int limit = (avail < (uint64_t) k) ? (int) avail : k;
+    for (int i = 0; i < limit; ++i) {
+        if (text[i] != prefix[i]) {
+            return (unsigned char) text[i] - (unsigned char) prefix[i];
+        }
+    }
+    return (limit < k) ? -1 : 0;
+}
+
+static int compareScalar(const char *text, uint64_t avail,
+        const char *prefix, int k)
+{
+    return compareBytes(text, avail, prefix, k);
+}
+
+template <int K>
+static int compareScalarK(const char *text, uint64_t avail,
+        const char *prefix, int)
+{
+    return compareBytes(text, avail, prefix, K);
+}
+
+static int compareStrncmp(const char *text, uint64_t, const char *prefix,
+        int k)
+{
+    return strncmp(text, prefix, k);
+}
+
+template <int K>
+static int compareStrncmpK(const char *text, uint64_t, const char *prefix,
+        int)
+{
+    return strncmp(text, prefix, K);
+}
+
+#define PREFIX_KERNEL_TABLE(kernel) { \
+    kernel<0>,    kernel<1>,  kernel<2>,  kernel<3>,  kernel<4>,  \
+    kernel<5>,    kernel<6>,  kernel<7>,  kernel<8>,  kernel<9>,  \
+    kernel<10>,   kernel<11>, kernel<12>, kernel<13>, kernel<14>, \
+    kernel<15>,   kernel<16>, kernel<17>, kernel<18>, kernel<19>, \
+    kernel<20>,   kernel<21>, kernel<22>, kernel<23>, kernel<24>, \
+    kernel<25>,   kernel<26>, kernel<27>, kernel<28>, kernel<29>, \
+    kernel<30>,   kernel<31>, kernel<32> }
+
+static const PrefixKernels SCALAR_KERNELS = {
+    "scalar", PREFIX_KERNEL_TABLE(compareScalarK), compareScalar
+};
+
+// The baseline the benchmark measures the others against.
+
+static const PrefixKernels STRNCMP_KERNELS = {
+    "strncmp", PREFIX_KERNEL_TABLE(compareStrncmpK), compareStrncmp
+};
+
+#if defined(__x86_64__)
+
+// Whether a load of bytes bytes at p stays on p's page, which is mapped.
+
+static inline bool loadStaysOnPage(const char *p, int bytes)
+{
+    return ((uintptr_t) p & 4095) <= (uintptr_t) (4096 - bytes);
+}
+
+static inline int firstDifference(const char *text, const char *prefix,
+        unsigned int differ)
+{
+    int i = __builtin_ctz(differ);
+    return (unsigned char) text[i] - (unsigned char) prefix[i];
+}
+
+// Compare 16 bytes at offset at, keeping the differences below limit.
+
+__attribute__((no_sanitize_address))
+static inline int compare16(const char *text, const char *prefix, int at,
+        int limit)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *) (text + at));
+    __m128i b = _mm_loadu_si128((const __m128i *) (prefix + at));
+    unsigned int differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) & 0xffff;
+    if (limit < 16) {
+        differ &= (1u << limit) - 1;
+    }
+    return (differ != 0) ? firstDifference(text + at, prefix + at, differ)
+            : 0;
+}
+
+// Compare k >= 16 bytes in 16-byte steps, the last step overlapping the
+// one before rather than running past k.
+
+static inline int compareSse2Long(const char *text, const char *prefix,
+        int k)
+{
+    int at = 0;
+    for (; at + 16 < k; at += 16) {
+        int order = compare16(text, prefix, at, 16);
+        if (order != 0) {
+            return order;
+        }
+    }
+    return compare16(text, prefix, k - 16, 16);
+}
+
+template <int K>
+static int compareSse2K(const char *text, uint64_t avail, const char *prefix,
+        int)
+{
+    if (avail < (uint64_t) K) {
+        return compareBytes(text, avail, prefix, K);
+    }
+    if (K >= 16) {
+        return compareSse2Long(text, prefix, K);
+    }
+    if (!loadStaysOnPage(text, 16) || !loadStaysOnPage(prefix, 16)) {
+        return compareBytes(text, avail, prefix, K);
+    }
+    return compare16(text, prefix, 0, K);
+}
+
+static int compareSse2(const char *text, uint64_t avail, const char *prefix,
+        int k)
+{
+    if (avail < (uint64_t) k || k < 16) {
+        return compareBytes(text, avail, prefix, k);
+    }
+    return compareSse2Long(text, prefix, k);
+}
+
+static const PrefixKernels SSE2_KERNELS = {
+    "sse2", PREFIX_KERNEL_TABLE(compareSse2K), compareSse2
+};
+
+// The same with 32-byte AVX2 compares, for prefixes of more than 16
+// bytes; the shorter ones fit one SSE2 compare.
+
+__attribute__((target("avx2"), no_sanitize_address))
+static inline int compare32(const char *text, const char *prefix, int at,
+        int limit)
+{
+    __m256i a = _mm256_loadu_si256((const __m256i *) (text + at));
+    __m256i b = _mm256_loadu_si256((const __m256i *) (prefix + at));
+    unsigned int differ = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+    if (limit < 32) {
+        differ &= (1u << limit) - 1;
+    }
+    return (differ != 0) ? firstDifference(text + at, prefix + at, differ)
+            : 0;
+}
+
+__attribute__((target("avx2")))
+static inline int compareAvx2Long(const char *text, const char *prefix,
+        int k)
+{
+    int at = 0;
+    for (; at + 32 < k; at += 32) {
+        int order = compare32(text, prefix, at, 32);
+        if (order != 0) {
+            return order;
+        }
+    }
+    return compare32(text, prefix, k - 32, 32);
+}
+
+template <int K>
+__attribute__((target("avx2")))
+static int compareAvx2K(const char *text, uint64_t avail, const char *prefix,
+        int)
+{
+    if (K <= 16 || avail < (uint64_t) K) {
+        return compareSse2K<K>(text, avail, prefix, K);
+    }
+    if (K == 32) {
+        return compare32(text, prefix, 0, 32);
+    }
+    if (!loadStaysOnPage(text, 32) || !loadStaysOnPage(prefix, 32)) {
+        return compareSse2Long(text, prefix, K);
+    }
+    return compare32(text, prefix, 0, K);
+}
+
+__attribute__((target("avx2")))
+static int compareAvx2(const char *text, uint64_t avail, const char *prefix,
+        int k)
+{
+    if (avail < (uint64_t) k || k < 32) {
+        return compareSse2(text, avail, prefix, k);
+    }
+    return compareAvx2Long(text, prefix, k);
+}
+
+static const PrefixKernels AVX2_KERNELS = {
+    "avx2", PREFIX_KERNEL_TABLE(compareAvx2K), compareAvx2
+};
+
+#endif
+
+//----------------------------------------------------------------------------
+// availableKernels
+//
+//      Fill in kernels with every set this processor runs, strncmp first,
+//      and return how many.
+//----------------------------------------------------------------------------
+
+static int availableKernels(const PrefixKernels **kernels)
+{
+    int count = 0;
+    kernels[count++] = &STRNCMP_KERNELS;
+    kernels[count++] = &SCALAR_KERNELS;
+#if defined(__x86_64__)
+    kernels[count++] = &SSE2_KERNELS;
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[count++] = &AVX2_KERNELS;
+    }
+#endif
+    return count;
+}
+
+//----------------------------------------------------------------------------
+// findFirstSuffix
+//
+//      Return the index of the first suffix that starts with the k bytes at
+//      prefix, or of the first suffix past them if there is none, by a
+//      binary search with the given kernels within the range searchBounds
+//      gives.  The number of compares is added to *compares.
+//----------------------------------------------------------------------------
+
+static inline uint64_t findFirstSuffix(const char *input,
+        const SuffixIndex *suffixes, const SearchTree *tree,
+        SearchMethod method, const PrefixKernels *kernels,
+        const char *prefix, int k, uint64_t *compares)
+{
+    int64_t l, u;
+    searchBounds(suffixes, tree, method, prefix, k, &l, &u);
+    PrefixCompare compare = (k <= PREFIX_KERNEL_MAX)
+            ? kernels->byLength[k] : kernels->longer;
+    uint64_t n = suffixes->count;
+    while ((l + 1) != u) {
+        int64_t m = (l + u) / 2;
+        ++*compares;
+        uint64_t offset = suffixAt(suffixes, m);
+        if (compare(input + offset, n - offset, prefix, k) < 0) {
+            l = m;
+        } else {
+            u = m;
+        }
+    }
+    return u;
+}
+
+//----------------------------------------------------------------------------
+// fastestKernels
+//
+//      Return the set of compare kernels that runs order-k lookups fastest
+//      on this input, timed over a few thousand prefixes taken from it.
+//      Which set wins depends on the processor, the text, k and the search
+//      method, and the wider compares lose to strncmp often enough that
+//      the choice is measured rather than made by the processor alone.
+//      strncmp is a candidate only when the input holds no NUL for it to
+//      stop at; otherwise it would order suffixes differently.
+//----------------------------------------------------------------------------
+
+static const PrefixKernels *fastestKernels(const char *input,
+        const SuffixIndex *suffixes, const SearchTree *tree,
+        SearchMethod method, int k)
+{
+    static const int LOOKUPS = 2048;
+    static const int ROUNDS = 3;
+
+    const PrefixKernels *kernels[4];
+    int kernelCount = availableKernels(kernels);
+    uint64_t n = suffixes->count;
+    int skip = (memchr(input, 0, n) != NULL) ? 1 : 0;
+    if (n < (uint64_t) k || kernelCount - skip == 1) {
+        return kernels[skip];
+    }
+
+    unsigned int seed = 1;
+    vector<uint64_t> starts(LOOKUPS);
+    for (int i = 0; i < LOOKUPS; ++i) {
+        uint64_t r = ((uint64_t) rand_r(&seed) << 31) | rand_r(&seed);
+        starts[i] = r % (n - k + 1);
+    }
+
+    // Alternate the sets from round to round and keep each one's best
+    // time, so that a stall in one round does not decide the choice.
+
+    double best[4];
+    for (int j = 0; j < kernelCount; ++j) {
+        best[j] = 1e9;
+    }
+    uint64_t checksum = 0, compares = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        for (int j = skip; j < kernelCount; ++j) {
+            struct timeval begin, end;
+            gettimeofday(&begin, 0);
+            for (int i = 0; i < LOOKUPS; ++i) {
+                checksum += findFirstSuffix(input, suffixes, tree, method,
+                        kernels[j], input + starts[i], k, &compares);
+            }
+            gettimeofday(&end, 0);
+            double seconds = (end.tv_sec - begin.tv_sec)
+                    + (end.tv_usec - begin.tv_usec) / 1e6;
+            if (seconds < best[j]) {
+                best[j] = seconds;
+            }
+        }
+    }
+
+    // On a tie, keep the earlier set: strncmp, then the plainer kernels.
+
+    int fastest = skip;
+    for (int j = skip + 1; j < kernelCount; ++j) {
+        if (best[j] < best[fastest]) {
+            fastest = j;
+        }
+    }
+    return kernels[fastest];
+}
+
+//----------------------------------------------------------------------------
+// benchmarkSearch
+//
+//      Time count lookups of prefixes taken from random places in the
+//      input with each search method and each set of compare kernels this
+//      processor runs, reporting lookups per second on stderr, the
+//      speed-up over strncmp, and the set generation would pick.  Every
+//      method must find the same suffixes.
+//      Returns false if they disagree.
+//----------------------------------------------------------------------------
+
+static bool benchmarkSearch(const char *input, const SuffixIndex *suffixes,
+        const SearchTree *tree, int k, int count, unsigned int seed)
+{
+    static const char *NAMES[] = { "binary", "bucket", "eytzinger" };
+
+    uint64_t n = suffixes->count;
+    if (n < (uint64_t) k || count <= 0) {
+        return true;
+    }
+    vector<uint64_t> starts(count);
+    for (int i = 0; i < count; ++i) {
+        uint64_t r = ((uint64_t) rand_r(&seed) << 31) | rand_r(&seed);
+        starts[i] = r % (n - k + 1);
+    }
+
+    // strncmp stops at a NUL in the text, so it is left out of the check.
+
+    const PrefixKernels *kernels[4];
+    int kernelCount = availableKernels(kernels);
+    uint64_t expected = 0;
+    bool first = true;
+    for (int method = SEARCH_BINARY; method <= SEARCH_EYTZINGER; ++method) {
+        double baseline = 0;
+        for (int j = 0; j < kernelCount; ++j) {
+            struct timeval begin, end;
+            uint64_t checksum = 0, compares = 0;
+            gettimeofday(&begin, 0);
+            for (int i = 0; i < count; ++i) {
+                checksum += findFirstSuffix(input, suffixes, tree,
+                        (SearchMethod) method, kernels[j], input + starts[i],
+                        k, &compares);
+            }
+            gettimeofday(&end, 0);
+
+            double seconds = (end.tv_sec - begin.tv_sec)
+                    + (end.tv_usec - begin.tv_usec) / 1e6;
+            double rate = count / (seconds > 0 ? seconds : 1e-9);
+            if (j == 0) {
+                baseline = rate;
+            }
+            fprintf(stderr, "markov: %-10s %-8s %12.0f lookups/s %8.2f "
+                    "compares/lookup %6.2fx\n", NAMES[method],
+                    kernels[j]->name, rate, (double) compares / count,
+                    rate / baseline);
+            if (kernels[j] == &STRNCMP_KERNELS) {
+                continue;
+            }
+            if (first) {
+                expected = checksum;
+                first = false;
+            } else if (checksum != expected) {
+                fprintf(stderr, "markov: %s search with %s kernels "
+                        "disagrees with binary search.\n", NAMES[method],
+                        kernels[j]->name);
+                return false;
+            }
+        }
+        fprintf(stderr, "markov: %-10s generation uses %s kernels\n",
+                NAMES[method], fastestKernels(input, suffixes, tree,
+                (SearchMethod) method, k)->name);
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// LcpIndex
+//
+//      The LCP array -- the length of the common prefix of each suffix and
+//      the one before it in sorted order -- together with a min-tree over
+//      blocks of it.  The suffixes sharing a K-byte prefix with suffix u
+//      run up to the first later entry below K, which the tree finds in
+//      O(log n) steps without comparing any text.  Entries are capped at
+//      LCP_MAX, so the index serves any order up to that.
+//----------------------------------------------------------------------------
+
+static const unsigned int LCP_MAX = 0xffff;
+static const uint64_t LCP_BLOCK = 64;
+
+struct LcpIndex {
+    uint64_t        count;          // Number of suffixes.
+    uint16_t       *lcp;            // lcp[0] is 0.
+    uint64_t        leaves;         // Power of two, at least the blocks.
+    uint16_t       *tree;           // tree[1..2 * leaves), min of children.
+};
+
+//----------------------------------------------------------------------------
+// kasaiBuild
+//
+//      Fill lcp from the suffix array in linear time with the algorithm of
+//      Kasai et al.: walking the suffixes in text order, the common prefix
+//      with the sorted predecessor shrinks by at most one each step.
+//----------------------------------------------------------------------------
+
+template <typename Index>
+static void kasaiBuild(const unsigned char *text, const SuffixIndex *index,
+        uint16_t *lcp)
+{
+    uint64_t n = index->count;
+    Index *rank = new Index[n];
+    for (uint64_t i = 0; i < n; ++i) {
+        rank[suffixAt(index, i)] = (Index) i;
+    }
+
+    uint64_t h = 0;
+    lcp[0] = 0;
+    for (uint64_t i = 0; i < n; ++i) {
+        uint64_t r = rank[i];
+        if (r == 0) {
+            h = 0;
+            continue;
+        }
+        uint64_t j = suffixAt(index, r - 1);
+        while (i + h < n && j + h < n && text[i + h] == text[j + h]) {
+            ++h;
+        }
+        lcp[r] = (h < LCP_MAX) ? (uint16_t) h : LCP_MAX;
+        if (h > 0) {
+            --h;
+        }
+    }
+    delete [] rank;
+}
+
+static uint64_t lcpLeaves(uint64_t count)
+{
+    uint64_t blocks = (count + LCP_BLOCK - 1) / LCP_BLOCK;
+    uint64_t leaves = 1;
+    while (leaves < blocks) {
+        leaves <<= 1;
+    }
+    return leaves;
+}
+
+//----------------------------------------------------------------------------
+// buildLcpIndex
+//
+//      Compute the LCP array of the sorted suffixes of input, and the block
+//      min-tree over it.  Leaves past the end hold 0, so a search that runs
+//      off the end stops there.
+//----------------------------------------------------------------------------
+
+static void buildLcpIndex(LcpIndex *lcp, const char *input,
+        const SuffixIndex *index)
+{
+    uint64_t n = index->count;
+    lcp->count = n;
+    lcp->lcp = new uint16_t[n > 0 ? n : 1];
+    lcp->lcp[0] = 0;
+    if (index->width == 4) {
+        kasaiBuild<uint32_t>((const unsigned char *) input, index, lcp->lcp);
+    } else {
+        kasaiBuild<uint64_t>((const unsigned char *) input, index, lcp->lcp);
+    }
+
+    lcp->leaves = lcpLeaves(n);
+    lcp->tree = new uint16_t[2 * lcp->leaves];
+    memset(lcp->tree, 0, 2 * lcp->leaves * sizeof(uint16_t));
+    for (uint64_t b = 0; b * LCP_BLOCK < n; ++b) {
+        uint16_t least = LCP_MAX;
+        for (uint64_t i = b * LCP_BLOCK; i < n && i < (b + 1) * LCP_BLOCK;
+                ++i) {
+            if (lcp->lcp[i] < least) {
+                least = lcp->lcp[i];
+            }
+        }
+        lcp->tree[lcp->leaves + b] = least;
+    }
+    for (uint64_t node = lcp->leaves; node-- > 1; ) {
+        uint16_t left = lcp->tree[2 * node];
+        uint16_t right = lcp->tree[2 * node + 1];
+        lcp->tree[node] = (left < right) ? left : right;
+    }
+}
+
+//----------------------------------------------------------------------------
+// lcpRangeEnd
+//
+//      Return the first index after u whose suffix does not share the
+//      first k bytes of suffix u, or the number of suffixes if they all do.
+//      k must not exceed LCP_MAX.
+//----------------------------------------------------------------------------
+
+static inline uint64_t lcpRangeEnd(const LcpIndex *lcp, uint64_t u,
+        unsigned int k)
+{
+    const uint16_t *values = lcp->lcp;
+    uint64_t n = lcp->count;
+
+    // Finish the block u is in.
+
+    uint64_t j = u + 1;
+    for (; j < n && j % LCP_BLOCK != 0; ++j) {
+        if (values[j] < k) {
+            return j;
+        }
+    }
+    if (j >= n) {
+        return n;
+    }
+
+    // Climb until a right sibling holds an entry below k, then descend to
+    // the first such block.
+
+    uint64_t node = lcp->leaves + j / LCP_BLOCK;
+    if (lcp->tree[node] >= k) {
+        for (;;) {
+            if (node == 1) {
+                return n;
+            }
+            if ((node & 1) == 0 && lcp->tree[node + 1] < k) {
+                ++node;
+                break;
+            }
+            node >>= 1;
+        }
+        while (node < lcp->leaves) {
+            node = 2 * node + ((lcp->tree[2 * node] < k) ? 0 : 1);
+        }
+    }
+
+    for (j = (node - lcp->leaves) * LCP_BLOCK; j < n; ++j) {
+        if (values[j] < k) {
+            return j;
+        }
+    }
+    return n;
+}
+
+//----------------------------------------------------------------------------
+// Random
+//
+//      The random number state of one sample, for whichever engine the
+//      generator was given.  RANDOM_RAND_R keeps the C library's rand_r and
+//      its floating point scaling, so that seeds reproduce the output of
+//      earlier versions.  RANDOM_XOSHIRO is xoshiro256** and RANDOM_PCG is
+//      PCG32 (XSH RR), both seeded from the sample seed through splitmix64;
+//      their bounded draws use Lemire's multiply-and-reject method, which
+//      is exactly uniform and almost never divides.
+//----------------------------------------------------------------------------
+
+struct Random {
+    RandomEngine    engine;
+    unsigned int    legacy;         // rand_r state.
+    uint64_t        s[4];           // xoshiro256** state, or PCG state and
+                                    // increment in s[0] and s[1].
+};
+
+static inline uint64_t splitMix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t rotateLeft(uint64_t x, int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+static void randomSeed(Random *r, RandomEngine engine, unsigned int seed)
+{
+    r->engine = engine;
+    r->legacy = seed;
+    uint64_t x = seed;
+    for (int i = 0; i < 4; ++i) {
+        r->s[i] = splitMix64(&x);
+    }
+    r->s[1] |= 1;                   // PCG needs an odd increment.
+}
+
+static inline uint32_t pcgNext(Random *r)
+{
+    uint64_t old = r->s[0];
+    r->s[0] = old * 6364136223846793005ull + r->s[1];
+    uint32_t shifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+    unsigned int rotation = (unsigned int) (old >> 59);
+    return (shifted >> rotation) | (shifted << ((32 - rotation) & 31));
+}
+
+//----------------------------------------------------------------------------
+// randomNext
+//
+//      Return 64 random bits.  Not used with RANDOM_RAND_R.
+//----------------------------------------------------------------------------
+
+static inline uint64_t randomNext(Random *r)
+{
+    if (r->engine == RANDOM_PCG) {
+        uint64_t high = pcgNext(r);
+        return (high << 32) | pcgNext(r);
+    }
+    uint64_t *s = r->s;
+    uint64_t result = rotateLeft(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotateLeft(s[3], 45);
+    return result;
+}
+
+//----------------------------------------------------------------------------
+// randomBelow
+//
+//      Return a random number in [0, n), for n > 0.
+//----------------------------------------------------------------------------
+
+static inline uint64_t randomBelow(Random *r, uint64_t n)
+{
+    if (r->engine == RANDOM_RAND_R) {
+        return (uint64_t) (n * (rand_r(&r->legacy) / (RAND_MAX + 1.0)));
+    }
+    unsigned __int128 m = (unsigned __int128) randomNext(r) * n;
+    uint64_t low = (uint64_t) m;
+    if (low < n) {
+        uint64_t threshold = -n % n;
+        while (low < threshold) {
+            m = (unsigned __int128) randomNext(r) * n;
+            low = (uint64_t) m;
+        }
+    }
+    return (uint64_t) (m >> 64);
+}
+
+//----------------------------------------------------------------------------
+// TransitionTable
+//
+//      The order-K model in collapsed form.  Every distinct K-gram in the
+//      input is a "context", found through an open-addressed hash table
+//      keyed on the K-gram itself.  Each context owns a run of columns, one
+//      per distinct successor character, laid out as a Walker alias table:
+//      to sample, pick a column uniformly, then keep its symbol if a second
+//      uniform fraction is below the column threshold, otherwise take its
+//      alias.  A context with no columns is a dead end: it occurs only at
+//      the very end of the input.
+//
+//      Everything lives in flat arrays of offsets rather than pointers.
+//----------------------------------------------------------------------------
+
+struct TransitionTable {
+    int             order;          // K, the length of every context.
+    unsigned int    slotMask;       // Hash table size, minus one.
+    unsigned int   *slotHash;       // Hash of the context in each slot.
+    unsigned int   *slotContext;    // Context number + 1, or 0 if empty.
+    unsigned int    contextCount;
+    uint64_t       *contextKey;     // Input offset of one occurrence.
+    unsigned int   *contextFirst;   // First column; [contextCount] is end.
+    unsigned int    columnCount;
+    unsigned int   *threshold;      // Keep probability, scaled by 2^32.
+    unsigned char  *symbol;         // Successor character of the column.
+    unsigned char  *alias;          // Character used when not kept.
+};
+
+//----------------------------------------------------------------------------
+// hashContext
+//
+//      FNV-1a hash of a K-byte context.
+//----------------------------------------------------------------------------
+
+static inline unsigned int hashContext(const char *context, int k)
+{
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < k; ++i) {
+        hash ^= (unsigned char) context[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//----------------------------------------------------------------------------
+// buildAliasColumns
+//
+//      Fill in the alias table for one context from its successor counts,
+//      using Vose's method.  Weights are kept as integers scaled by the
+//      number of columns, so that the pairing is exact; only the final
+//      thresholds are rounded.
+//----------------------------------------------------------------------------
+
+static void buildAliasColumns(TransitionTable *table, unsigned int first,
+        unsigned int columns, const uint64_t *counts, uint64_t total)
+{
+    uint64_t weight[256];
+    unsigned int small[256], large[256];
+    int smallCount = 0, largeCount = 0;
+
+    for (unsigned int i = 0; i < columns; ++i) {
+        weight[i] = (uint64_t) counts[i] * columns;
+        table->alias[first + i] = table->symbol[first + i];
+        table->threshold[first + i] = 0xffffffffu;
+        if (weight[i] < total) {
+            small[smallCount++] = i;
+        } else {
+            large[largeCount++] = i;
+        }
+    }
+
+    while (smallCount > 0 && largeCount > 0) {
+        unsigned int s = small[--smallCount];
+        unsigned int l = large[--largeCount];
+
+        table->threshold[first + s] =
+                (unsigned int) ((double) weight[s] / total * 4294967296.0);
+        table->alias[first + s] = table->symbol[first + l];
+
+        weight[l] -= total - weight[s];
+        if (weight[l] < total) {
+            small[smallCount++] = l;
+        } else {
+            large[largeCount++] = l;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// buildTransitionTable
+//
+//      Walk the sorted suffixes once, collapsing each run of suffixes that
+//      share a K-byte prefix into a context with per-successor counts.
+//      Suffixes shorter than K cannot be contexts and are skipped.  Returns
+//      false, with a message, if there are too many contexts to index.
+//----------------------------------------------------------------------------
+
+static bool buildTransitionTable(TransitionTable *table, const char *input,
+        const SuffixIndex *index, int k)
+{
+    uint64_t n = index->count;
+
+    // Count the contexts and columns first, so the arrays can be sized
+    // exactly.
+
+    uint64_t contexts = 0, columns = 0;
+    bool seen[256];
+    for (uint64_t i = 0; i < n; ) {
+        uint64_t start = suffixAt(index, i);
+        if (n - start < (uint64_t) k) {
+            ++i;
+            continue;
+        }
+        memset(seen, 0, sizeof(seen));
+        uint64_t j = i;
+        for (; j < n; ++j) {
+            uint64_t offset = suffixAt(index, j);
+            if (n - offset < (uint64_t) k
+                    || memcmp(input + offset, input + start, k) != 0) {
+                break;
+            }
+            if (offset + k < n) {
+                unsigned char c = input[offset + k];
+                if (!seen[c]) {
+                    seen[c] = true;
+                    ++columns;
+                }
+            }
+        }
+        ++contexts;
+        i = j;
+    }
+    if (contexts >= 0x80000000ull || columns >= 0xffffffffull) {
+        fprintf(stderr, "markov: too many contexts for a transition table, "
+                "use the suffix engine.\n");
+        return false;
+    }
+
+    unsigned int slots = 1;
+    while (slots < contexts * 2) {
+        slots <<= 1;
+    }
+
+    table->order = k;
+    table->slotMask = slots - 1;
+    table->slotHash = new unsigned int[slots];
+    memset(table->slotHash, 0, slots * sizeof(unsigned int));
+    table->slotContext = new unsigned int[slots];
+    memset(table->slotContext, 0, slots * sizeof(unsigned int));
+    table->contextCount = (unsigned int) contexts;
+    table->contextKey = new uint64_t[contexts];
+    table->contextFirst = new unsigned int[contexts + 1];
+    table->columnCount = (unsigned int) columns;
+    table->threshold = new unsigned int[columns];
+    table->symbol = new unsigned char[columns];
+    table->alias = new unsigned char[columns];
+
+    // Now fill them in.
+
+    uint64_t counts[256];
+    unsigned int context = 0, column = 0;
+    for (uint64_t i = 0; i < n; ) {
+        uint64_t start = suffixAt(index, i);
+        if (n - start < (uint64_t) k) {
+            ++i;
+            continue;
+        }
+        uint64_t histogram[256];
+        memset(histogram, 0, sizeof(histogram));
+        uint64_t j = i;
+        for (; j < n; ++j) {
+            uint64_t offset = suffixAt(index, j);
+            if (n - offset < (uint64_t) k
+                    || memcmp(input + offset, input + start, k) != 0) {
+                break;
+            }
+            if (offset + k < n) {
+                histogram[(unsigned char) input[offset + k]]++;
+            }
+        }
+
+        unsigned int first = column;
+        uint64_t total = 0;
+        for (int c = 0; c < 256; ++c) {
+            if (histogram[c] != 0) {
+                table->symbol[column] = (unsigned char) c;
+                counts[column - first] = histogram[c];
+                total += histogram[c];
+                ++column;
+            }
+        }
+        buildAliasColumns(table, first, column - first, counts, total);
+
+        table->contextKey[context] = start;
+        table->contextFirst[context] = first;
+
+        unsigned int hash = hashContext(input + start, k);
+        unsigned int slot = hash & table->slotMask;
+        while (table->slotContext[slot] != 0) {
+            slot = (slot + 1) & table->slotMask;
+        }
+        table->slotHash[slot] = hash;
+        table->slotContext[slot] = context + 1;
+
+        ++context;
+        i = j;
+    }
+    table->contextFirst[context] = column;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// lookupContext
+//
+//      Find the context for the K bytes at prefix.  Returns the context
+//      number, or -1 if the K-gram never occurs in the input.  The number
+//      of slots probed is added to *probes.
+//----------------------------------------------------------------------------
+
+static inline int lookupContext(const TransitionTable *table,
+        const char *input, const char *prefix, uint64_t *probes)
+{
+    unsigned int hash = hashContext(prefix, table->order);
+    unsigned int slot = hash & table->slotMask;
+    for (;;) {
+        ++*probes;
+        unsigned int entry = table->slotContext[slot];
+        if (entry == 0) {
+            return -1;
+        }
+        if (table->slotHash[slot] == hash
+                && memcmp(input + table->contextKey[entry - 1], prefix,
+                        table->order) == 0) {
+            return entry - 1;
+        }
+        slot = (slot + 1) & table->slotMask;
+    }
+}
+
+//----------------------------------------------------------------------------
+// drawColumn
+//
+//      Choose one of columns alias table columns, and a 32-bit fraction to
+//      compare against its threshold.  rand_r gives both from one draw in
+//      [0, RAND_MAX]: the high part of draw * columns selects the column,
+//      and the rest is the fraction.  The other engines split one 64-bit
+//      draw: the high half picks the column by Lemire's method, drawing
+//      again in the rare case it would be biased, and the low half is the
+//      fraction.
+//----------------------------------------------------------------------------
+
+static inline void drawColumn(Random *r, unsigned int columns,
+        unsigned int *column, unsigned int *fraction)
+{
+    if (r->engine == RANDOM_RAND_R) {
+        uint64_t scaled = (uint64_t) rand_r(&r->legacy) * columns;
+        *column = (unsigned int) (scaled >> 31);
+        *fraction = (unsigned int) (scaled << 1);
+        return;
+    }
+    uint64_t x = randomNext(r);
+    uint64_t m = (x >> 32) * columns;
+    if ((uint32_t) m < columns) {
+        uint32_t threshold = -columns % columns;
+        while ((uint32_t) m < threshold) {
+            x = randomNext(r);
+            m = (x >> 32) * columns;
+        }
+    }
+    *column = (unsigned int) (m >> 32);
+    *fraction = (unsigned int) x;
+}
+
+//----------------------------------------------------------------------------
+// sampleTransition
+//
+//      Choose a successor of the given context: draw a column, then keep
+//      its symbol if the fraction is below the column threshold, otherwise
+//      take its alias.  Returns the character, or -1 if the context is a
+//      dead end.
+//----------------------------------------------------------------------------
+
+static inline int aliasSymbol(const TransitionTable *table,
+        unsigned int column, unsigned int fraction)
+{
+    if (fraction < table->threshold[column]) {
+        return table->symbol[column];
+    }
+    return table->alias[column];
+}
+
+static inline int sampleTransition(const TransitionTable *table, int context,
+        Random *r)
+{
+    unsigned int first = table->contextFirst[context];
+    unsigned int columns = table->contextFirst[context + 1] - first;
+    if (columns == 0) {
+        return -1;
+    }
+    unsigned int column, fraction;
+    drawColumn(r, columns, &column, &fraction);
+    return aliasSymbol(table, first + column, fraction);
+}
+
+//----------------------------------------------------------------------------
+// WordIndex
+//
+//      The input as a sequence of word tokens, for generating a word at a
+//      time.  A token is a run of non-space bytes together with the spaces
+//      that follow it, so the tokens concatenate back to the input and a
+//      token ending a line carries the newline.  Each distinct token is
+//      interned as a dense number, and the suffix array is built over the
+//      token numbers, so a lookup compares K fixed-width integers rather
+//      than K words of text.  Suffixes are bucketed by their first token.
+//----------------------------------------------------------------------------
+
+struct WordIndex {
+    uint64_t        count;          // Number of tokens.
+    uint32_t       *tokens;         // The input as token numbers.
+    uint32_t       *suffixes;       // Token positions, sorted.
+    uint32_t        vocabulary;     // Number of distinct tokens.
+    uint64_t       *spelling;       // Input offset of each token's text.
+    uint32_t       *length;         // Bytes in each token.
+    uint32_t       *buckets;        // vocabulary + 1 bucket starts.
+};
+
+static inline bool isWordSpace(unsigned char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'
+            || c == '\v';
+}
+
+//----------------------------------------------------------------------------
+// buildWordIndex
+//
+//      Split input[0..n) into tokens, intern them, and sort the token
+//      suffixes with SA-IS.  Tokens are numbered in order of first
+//      appearance; any numbering works, since lookups compare the same
+//      numbers the sort did.  Returns false, with a message, if there are
+//      too many tokens for 32-bit positions.
+//----------------------------------------------------------------------------
+
+static bool buildWordIndex(WordIndex *words, const char *input, uint64_t n)
+{
+    const unsigned char *text = (const unsigned char *) input;
+    vector<uint32_t> tokens;
+    vector<uint64_t> spelling;
+    vector<uint32_t> length;
+
+    // The intern table is open-addressed on the FNV hash of the token
+    // text, holding token number + 1, and doubles when half full.
+
+    vector<uint32_t> slots(1024, 0);
+    vector<uint32_t> hashes(1024);
+    uint32_t mask = slots.size() - 1;
+
+    for (uint64_t start = 0; start < n; ) {
+        uint64_t end = start;
+        while (end < n && !isWordSpace(text[end])) {
+            ++end;
+        }
+        while (end < n && isWordSpace(text[end])) {
+            ++end;
+        }
+        if (end - start >= 0xffffffffull
+                || tokens.size() >= 0xfffffffeull) {
+            fprintf(stderr, "markov: too many words to index.\n");
+            return false;
+        }
+        uint32_t size = (uint32_t) (end - start);
+        unsigned int hash = hashContext(input + start, size);
+        uint32_t slot = hash & mask;
+        uint32_t token = 0;
+        for (;; slot = (slot + 1) & mask) {
+            uint32_t entry = slots[slot];
+            if (entry == 0) {
+                token = spelling.size();
+                spelling.push_back(start);
+                length.push_back(size);
+                slots[slot] = token + 1;
+                hashes[slot] = hash;
+                break;
+            }
+            if (hashes[slot] == hash && length[entry - 1] == size
+                    && memcmp(input + spelling[entry - 1], input + start,
+                            size) == 0) {
+                token = entry - 1;
+                break;
+            }
+        }
+        tokens.push_back(token);
+        start = end;
+
+        if (spelling.size() * 2 > slots.size()) {
+            vector<uint32_t> grown(slots.size() * 2, 0);
+            vector<uint32_t> grownHashes(slots.size() * 2);
+            mask = grown.size() - 1;
+            for (size_t i = 0; i < slots.size(); ++i) {
+                if (slots[i] != 0) {
+                    uint32_t s = hashes[i] & mask;
+                    while (grown[s] != 0) {
+                        s = (s + 1) & mask;
+                    }
+                    grown[s] = slots[i];
+                    grownHashes[s] = hashes[i];
+                }
+            }
+            slots.swap(grown);
+            hashes.swap(grownHashes);
+        }
+    }
+
+    uint64_t count = tokens.size();
+    words->count = count;
+    words->vocabulary = spelling.size();
+    words->tokens = new uint32_t[count > 0 ? count : 1];
+    words->spelling = new uint64_t[words->vocabulary > 0
+            ? words->vocabulary : 1];
+    words->length = new uint32_t[words->vocabulary > 0
+            ? words->vocabulary : 1];
+    if (count > 0) {
+        memcpy(words->tokens, &tokens[0], count * sizeof(uint32_t));
+        memcpy(words->spelling, &spelling[0],
+                words->vocabulary * sizeof(uint64_t));
+        memcpy(words->length, &length[0],
+                words->vocabulary * sizeof(uint32_t));
+    }
+    vector<uint32_t>().swap(tokens);
+
+    words->suffixes = new uint32_t[count > 0 ? count : 1];
+    if (count > 0) {
+        saisBuild<uint32_t, uint32_t>(words->tokens, (uint32_t) count,
+                words->vocabulary - 1, words->suffixes);
+    }
+
+    words->buckets = new uint32_t[words->vocabulary + 1];
+    memset(words->buckets, 0, (words->vocabulary + 1) * sizeof(uint32_t));
+    for (uint64_t i = 0; i < count; ++i) {
+        words->buckets[words->tokens[i] + 1]++;
+    }
+    for (uint32_t t = 0; t < words->vocabulary; ++t) {
+        words->buckets[t + 1] += words->buckets[t];
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// compareWords
+//
+//      Compare the first k tokens of the suffix at position p with the k
+//      tokens of context, as the sort ordered them: a suffix that runs out
+//      first sorts before.  The number of calls is added to *compares.
+//----------------------------------------------------------------------------
+
+static inline int compareWords(const WordIndex *words, uint64_t p,
+        const uint32_t *context, int k, uint64_t *compares)
+{
+    ++*compares;
+    const uint32_t *suffix = words->tokens + p;
+    uint64_t avail = words->count - p;
+    for (int i = 0; i < k; ++i) {
+        if ((uint64_t) i == avail) {
+            return -1;
+        }
+        if (suffix[i] != context[i]) {
+            return (suffix[i] < context[i]) ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// findWordRange
+//
+//      Find the range [*first, *last) of suffixes that start with the k
+//      tokens of context, by binary searching the bucket of its first
+//      token for each end.
+//----------------------------------------------------------------------------
+
+static inline void findWordRange(const WordIndex *words,
+        const uint32_t *context, int k, uint64_t *first, uint64_t *last,
+        uint64_t *compares)
+{
+    const uint32_t *sa = words->suffixes;
+    int64_t bucketStart = words->buckets[context[0]];
+    int64_t bucketEnd = words->buckets[context[0] + 1];
+
+    int64_t l = bucketStart - 1, u = bucketEnd;
+    while (l + 1 != u) {
+        int64_t m = (l + u) / 2;
+        if (compareWords(words, sa[m], context, k, compares) < 0) {
+            l = m;
+        } else {
+            u = m;
+        }
+    }
+    *first = u;
+
+    l = u - 1;
+    u = bucketEnd;
+    while (l + 1 != u) {
+        int64_t m = (l + u) / 2;
+        if (compareWords(words, sa[m], context, k, compares) <= 0) {
+            l = m;
+        } else {
+            u = m;
+        }
+    }
+    *last = u;
+}
+
+//----------------------------------------------------------------------------
+// FmIndex
+//
+//      An FM-index of the input reversed: the Burrows-Wheeler transform of
+//      the reversed text, held in a wavelet matrix with rank directories,
+//      in place of both the suffix array and the text.  Searching the
+//      reversed text backwards for a reversed context takes the context's
+//      bytes in their own order, one rank step each, and leaves a range of
+//      rows, one for every occurrence of the context in the input.  The
+//      transform byte of each row is the byte that follows that occurrence,
+//      and within the range the rows are ordered by what precedes it, so
+//      the range holds exactly the successors the suffix array range would,
+//      and the i'th smallest of them is found by one more descent of the
+//      matrix.  Row 0 is the empty suffix, ahead of all the others, and
+//      holds the input's first byte; the row with no preceding byte, for
+//      the occurrence that ends the input, holds a 0 that takes no part in
+//      any count.
+//
+//      Level l of the matrix holds bit 7 - l of each symbol in the order
+//      left by sorting the level above stably on its bit, zeros first.
+//      Each level is a run of FM_BLOCK_WORDS-word blocks, one cache line
+//      apiece: the count of ones before the block, then FM_BLOCK_BITS bits.
+//      The whole index takes 8/7 of a byte per input byte.
+//----------------------------------------------------------------------------
+
+static const int FM_LEVELS = 8;
+static const unsigned int FM_BLOCK_WORDS = 8;
+static const unsigned int FM_BLOCK_BITS = (FM_BLOCK_WORDS - 1) * 64;
+
+struct FmIndex {
+    uint64_t        count;          // Rows, one more than input bytes.
+    uint64_t        primary;        // The row with no preceding byte.
+    uint64_t        blocks;         // Rank blocks per level.
+    uint64_t       *levels;         // FM_LEVELS runs of blocks.
+    uint64_t        zeros[FM_LEVELS];
+    uint64_t        first[257];     // The first row starting with c.
+    uint64_t        shift[256];     // first[c] less c's bottom start.
+};
+
+static inline const uint64_t *fmLevel(const FmIndex *fm, int level)
+{
+    return fm->levels + level * fm->blocks * FM_BLOCK_WORDS;
+}
+
+//----------------------------------------------------------------------------
+// fmRank
+//
+//      Count the ones among the first i bits of a level.
+//----------------------------------------------------------------------------
+
+static inline uint64_t fmRank(const uint64_t *level, uint64_t i)
+{
+    const uint64_t *block = level + i / FM_BLOCK_BITS * FM_BLOCK_WORDS;
+    unsigned int bits = i % FM_BLOCK_BITS;
+    uint64_t ones = block[0];
+    const uint64_t *word = block + 1;
+    for (; bits >= 64; bits -= 64) {
+        ones += __builtin_popcountll(*word++);
+    }
+    if (bits != 0) {
+        ones += __builtin_popcountll(*word & ((1ull << bits) - 1));
+    }
+    return ones;
+}
+
+//----------------------------------------------------------------------------
+// fmMap
+//
+//      Follow position i down the matrix along the bits of c.  What comes
+//      out is where c's run starts at the bottom level plus the number of
+//      c's among the first i symbols of the transform.
+//----------------------------------------------------------------------------
+
+static inline uint64_t fmMap(const FmIndex *fm, int c, uint64_t i)
+{
+    for (int level = 0; level < FM_LEVELS; ++level) {
+        uint64_t ones = fmRank(fmLevel(fm, level), i);
+        if ((c >> (7 - level)) & 1) {
+            i = fm->zeros[level] + ones;
+        } else {
+            i -= ones;
+        }
+    }
+    return i;
+}
+
+//----------------------------------------------------------------------------
+// buildFmIndex
+//
+//      Build the FM-index of input[0..n).  The reversed text is sorted with
+//      SA-IS, so building takes as much memory for a while as the suffix
+//      array does; only the index is kept.
+//----------------------------------------------------------------------------
+
+template <typename Index>
+static uint64_t fmTransform(const unsigned char *reversed, uint64_t n,
+        unsigned char *bwt)
+{
+    Index *sa = new Index[n];
+    saisBuild<unsigned char, Index>(reversed, n, 255, sa);
+    uint64_t primary = 0;
+    bwt[0] = reversed[n - 1];
+    for (uint64_t i = 0; i < n; ++i) {
+        if (sa[i] == 0) {
+            primary = i + 1;
+            bwt[i + 1] = 0;
+        } else {
+            bwt[i + 1] = reversed[sa[i] - 1];
+        }
+    }
+    delete [] sa;
+    return primary;
+}
+
+static bool buildFmIndex(FmIndex *fm, const char *input, uint64_t n)
+{
+    const unsigned char *text = (const unsigned char *) input;
+    uint64_t rows = n + 1;
+    fm->count = rows;
+    fm->primary = 0;
+    fm->blocks = rows / FM_BLOCK_BITS + 1;
+
+    unsigned char *bwt = new unsigned char[rows];
+    bwt[0] = 0;
+    if (n != 0) {
+        unsigned char *reversed = new unsigned char[n];
+        for (uint64_t i = 0; i < n; ++i) {
+            reversed[i] = text[n - 1 - i];
+        }
+        fm->primary = (n < 0xffffffffull)
+                ? fmTransform<uint32_t>(reversed, n, bwt)
+                : fmTransform<uint64_t>(reversed, n, bwt);
+        delete [] reversed;
+    }
+
+    void *levels;
+    uint64_t bytes = FM_LEVELS * fm->blocks * FM_BLOCK_WORDS
+            * sizeof(uint64_t);
+    if (posix_memalign(&levels, 64, bytes) != 0) {
+        fprintf(stderr, "markov: unable to allocate FM index.\n");
+        delete [] bwt;
+        return false;
+    }
+    fm->levels = (uint64_t *) levels;
+    memset(fm->levels, 0, bytes);
+
+    // Set each level's bits and block counts, then sort the symbols
+    // stably on that bit for the level below.
+
+    unsigned char *next = new unsigned char[rows];
+    for (int level = 0; level < FM_LEVELS; ++level) {
+        int bit = 7 - level;
+        uint64_t *blocks = (uint64_t *) fmLevel(fm, level);
+        for (uint64_t i = 0; i < rows; ++i) {
+            if ((bwt[i] >> bit) & 1) {
+                unsigned int r = i % FM_BLOCK_BITS;
+                blocks[i / FM_BLOCK_BITS * FM_BLOCK_WORDS + 1 + r / 64] |=
+                        1ull << (r % 64);
+            }
+        }
+        uint64_t ones = 0;
+        for (uint64_t b = 0; b < fm->blocks; ++b) {
+            uint64_t *block = blocks + b * FM_BLOCK_WORDS;
+            block[0] = ones;
+            for (unsigned int w = 1; w < FM_BLOCK_WORDS; ++w) {
+                ones += __builtin_popcountll(block[w]);
+            }
+        }
+        fm->zeros[level] = rows - ones;
+
+        uint64_t zero = 0, one = fm->zeros[level];
+        for (uint64_t i = 0; i < rows; ++i) {
+            if ((bwt[i] >> bit) & 1) {
+                next[one++] = bwt[i];
+            } else {
+                next[zero++] = bwt[i];
+            }
+        }
+        swap(bwt, next);
+    }
+    delete [] bwt;
+    delete [] next;
+
+    // The rows starting with c follow the empty suffix and those of every
+    // smaller byte, and the matrix numbers c's occurrences from where c's
+    // run starts.
+
+    uint64_t counts[256] = { 0 };
+    for (uint64_t i = 0; i < n; ++i) {
+        counts[text[i]]++;
+    }
+    uint64_t row = 1;
+    for (int c = 0; c < 256; ++c) {
+        fm->first[c] = row;
+        fm->shift[c] = row - fmMap(fm, c, 0);
+        row += counts[c];
+    }
+    fm->first[256] = row;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// fmExtend
+//
+//      Narrow [*lo, *hi), the rows for a context, to those for the context
+//      followed by c: one backward search step.
+//----------------------------------------------------------------------------
+
+static inline void fmExtend(const FmIndex *fm, int c, uint64_t *lo,
+        uint64_t *hi)
+{
+    uint64_t l = fmMap(fm, c, *lo) + fm->shift[c];
+    uint64_t h = fmMap(fm, c, *hi) + fm->shift[c];
+    if (c == 0) {
+        l -= (fm->primary < *lo);
+        h -= (fm->primary < *hi);
+    }
+    *lo = l;
+    *hi = h;
+}
+
+//----------------------------------------------------------------------------
+// fmSuccessor
+//
+//      Return the i'th smallest transform byte in rows [lo, hi), counting
+//      from 0.
+//----------------------------------------------------------------------------
+
+static inline int fmSuccessor(const FmIndex *fm, uint64_t lo, uint64_t hi,
+        uint64_t i)
+{
+    int c = 0;
+    for (int level = 0; level < FM_LEVELS; ++level) {
+        const uint64_t *bits = fmLevel(fm, level);
+        uint64_t loOnes = fmRank(bits, lo);
+        uint64_t hiOnes = fmRank(bits, hi);
+        uint64_t zeros = (hi - lo) - (hiOnes - loOnes);
+        if (i < zeros) {
+            lo -= loOnes;
+            hi -= hiOnes;
+            c <<= 1;
+        } else {
+            i -= zeros;
+            lo = fm->zeros[level] + loOnes;
+            hi = fm->zeros[level] + hiOnes;
+            c = (c << 1) | 1;
+        }
+    }
+    return c;
+}
+
+//----------------------------------------------------------------------------
+// ModelHeader
+//
+//      The start of a model file written by --save-model.  The header is
+//      followed by sections holding the corpus (with its NUL), the suffix
+//      index and its prefix buckets and, optionally, the LCP index and the
+//      transition table arrays, each starting on a MODEL_ALIGN boundary at
+//      the offset recorded here.  An absent section has size 0.  Everything
+//      is in native byte order; byteOrder catches files from a host that
+//      differs.
+//      The file is used in place through a read-only mapping, so processes
+//      loading the same model share it through the page cache.
+//----------------------------------------------------------------------------
+
+static const char MODEL_MAGIC[8] = { 'M', 'A', 'R', 'K', 'O', 'V', 'M', 0 };
+static const uint32_t MODEL_VERSION = 3;
+static const uint32_t MODEL_BYTE_ORDER = 0x01020304;
+static const uint64_t MODEL_ALIGN = 64;
+
+enum ModelSection {
+    MODEL_CORPUS,
+    MODEL_SUFFIXES,
+    MODEL_BUCKETS,
+    MODEL_LCP,
+    MODEL_LCP_TREE,
+    MODEL_SLOT_HASH,
+    MODEL_SLOT_CONTEXT,
+    MODEL_CONTEXT_KEY,
+    MODEL_CONTEXT_FIRST,
+    MODEL_THRESHOLD,
+    MODEL_SYMBOL,
+    MODEL_ALIAS,
+    MODEL_SECTION_COUNT
+};
+
+struct ModelHeader {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        byteOrder;
+    uint64_t        fileSize;
+    uint64_t        corpusSize;
+    uint64_t        suffixCount;
+    uint32_t        suffixWidth;
+    int32_t         tableOrder;     // 0 if there is no transition table.
+    uint32_t        slotMask;
+    uint32_t        contextCount;
+    uint32_t        columnCount;
+    uint32_t        reserved;
+    uint64_t        sectionOffset[MODEL_SECTION_COUNT];
+    uint64_t        sectionSize[MODEL_SECTION_COUNT];
+};
+
+//----------------------------------------------------------------------------
+// initModelHeader, layoutModel
+//
+//      Start a header for a model of corpusSize bytes with a suffix index
+//      of the given width, and, once every section size is filled in, place
+//      the sections and set the file size.
+//----------------------------------------------------------------------------
+
+static void initModelHeader(ModelHeader *header, uint64_t corpusSize,
+        int suffixWidth)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, MODEL_MAGIC, sizeof(header->magic));
+    header->version = MODEL_VERSION;
+    header->byteOrder = MODEL_BYTE_ORDER;
+    header->corpusSize = corpusSize;
+    header->suffixCount = corpusSize;
+    header->suffixWidth = suffixWidth;
+    header->sectionSize[MODEL_CORPUS] = corpusSize + 1;
+    header->sectionSize[MODEL_SUFFIXES] = corpusSize * suffixWidth;
+    header->sectionSize[MODEL_BUCKETS] =
+            (PREFIX_BUCKETS + 1) * sizeof(uint64_t);
+}
+
+static void layoutModel(ModelHeader *header)
+{
+    uint64_t offset = sizeof(*header);
+    for (int s = 0; s < MODEL_SECTION_COUNT; ++s) {
+        offset = (offset + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+        header->sectionOffset[s] = offset;
+        offset += header->sectionSize[s];
+    }
+    header->fileSize = offset;
+}
+
+//----------------------------------------------------------------------------
+// saveModel
+//
+//      Write the corpus, suffix index and, if they are not NULL, the LCP
+//      index and transition table to path.  The file is written under a
+//      temporary name and renamed into place, so a concurrent --load-model
+//      never sees a partial file.  Returns false, with a message, on
+//      failure.
+//----------------------------------------------------------------------------
+
+static bool saveModel(const char *path, const Corpus *corpus,
+        const SuffixIndex *index, const LcpIndex *lcp,
+        const TransitionTable *table)
+{
+    const void *sections[MODEL_SECTION_COUNT] = { 0 };
+    ModelHeader header;
+    initModelHeader(&header, corpus->size, index->width);
+    sections[MODEL_CORPUS] = corpus->data;
+    sections[MODEL_SUFFIXES] = index->data;
+    sections[MODEL_BUCKETS] = index->buckets;
+
+    if (lcp != NULL) {
+        sections[MODEL_LCP] = lcp->lcp;
+        header.sectionSize[MODEL_LCP] = lcp->count * sizeof(uint16_t);
+        sections[MODEL_LCP_TREE] = lcp->tree;
+        header.sectionSize[MODEL_LCP_TREE] =
+                2 * lcp->leaves * sizeof(uint16_t);
+    }
+
+    if (table != NULL) {
+        uint64_t slots = (uint64_t) table->slotMask + 1;
+        header.tableOrder = table->order;
+        header.slotMask = table->slotMask;
+        header.contextCount = table->contextCount;
+        header.columnCount = table->columnCount;
+
+        sections[MODEL_SLOT_HASH] = table->slotHash;
+        header.sectionSize[MODEL_SLOT_HASH] = slots * sizeof(unsigned int);
+        sections[MODEL_SLOT_CONTEXT] = table->slotContext;
+        header.sectionSize[MODEL_SLOT_CONTEXT] = slots * sizeof(unsigned int);
+        sections[MODEL_CONTEXT_KEY] = table->contextKey;
+        header.sectionSize[MODEL_CONTEXT_KEY] =
+                (uint64_t) table->contextCount * sizeof(uint64_t);
+        sections[MODEL_CONTEXT_FIRST] = table->contextFirst;
+        header.sectionSize[MODEL_CONTEXT_FIRST] =
+                ((uint64_t) table->contextCount + 1) * sizeof(unsigned int);
+        sections[MODEL_THRESHOLD] = table->threshold;
+        header.sectionSize[MODEL_THRESHOLD] =
+                (uint64_t) table->columnCount * sizeof(unsigned int);
+        sections[MODEL_SYMBOL] = table->symbol;
+        header.sectionSize[MODEL_SYMBOL] = table->columnCount;
+        sections[MODEL_ALIAS] = table->alias;
+        header.sectionSize[MODEL_ALIAS] = table->columnCount;
+    }
+
+    layoutModel(&header);
+
+    size_t length = strlen(path);
+    char *temp = new char[length + 8];
+    sprintf(temp, "%s.tmp", path);
+    FILE *f = fopen(temp, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "markov: unable to create %s: %s.\n", temp,
+                strerror(errno));
+        delete [] temp;
+        return false;
+    }
+
+    static const char padding[MODEL_ALIGN] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    uint64_t written = sizeof(header);
+    for (int s = 0; ok && s < MODEL_SECTION_COUNT; ++s) {
+        uint64_t pad = header.sectionOffset[s] - written;
+        ok = fwrite(padding, 1, pad, f) == pad
+                && fwrite(sections[s], 1, header.sectionSize[s], f)
+                        == header.sectionSize[s];
+        written = header.sectionOffset[s] + header.sectionSize[s];
+    }
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+    if (ok && rename(temp, path) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "markov: unable to write %s: %s.\n", path,
+                strerror(errno));
+        unlink(temp);
+    }
+    delete [] temp;
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// validModel
+//
+//      Whether the header of a model mapped at base, fileSize bytes long,
+//      describes sections that lie inside the file and have the sizes its
+//      counts call for, so that loadModel can point into them.  The prefix
+//      buckets and the end of the corpus are checked too, since searches
+//      trust them without bounds checks.
+//----------------------------------------------------------------------------
+
+static bool validModel(const ModelHeader *header, const char *base,
+        uint64_t fileSize)
+{
+    const uint64_t *at = header->sectionOffset;
+    const uint64_t *size = header->sectionSize;
+    for (int s = 0; s < MODEL_SECTION_COUNT; ++s) {
+        if (at[s] % MODEL_ALIGN != 0 || at[s] > fileSize
+                || size[s] > fileSize - at[s]) {
+            return false;
+        }
+    }
+
+    uint64_t n = header->corpusSize;
+    uint64_t width = header->suffixWidth;
+    if ((width != 4 && width != 5) || n >= fileSize
+            || header->suffixCount != n
+            || size[MODEL_CORPUS] != n + 1 || base[at[MODEL_CORPUS] + n] != 0
+            || size[MODEL_SUFFIXES] != n * width
+            || size[MODEL_BUCKETS]
+                    != (PREFIX_BUCKETS + 1) * sizeof(uint64_t)) {
+        return false;
+    }
+    const uint64_t *buckets = (const uint64_t *) (base + at[MODEL_BUCKETS]);
+    for (unsigned int b = 0; b <= PREFIX_BUCKETS; ++b) {
+        if (buckets[b] > n || (b > 0 && buckets[b] < buckets[b - 1])) {
+            return false;
+        }
+    }
+
+    if (size[MODEL_LCP] != 0 || size[MODEL_LCP_TREE] != 0) {
+        if (size[MODEL_LCP] != n * sizeof(uint16_t)
+                || size[MODEL_LCP_TREE]
+                        != 2 * lcpLeaves(n) * sizeof(uint16_t)) {
+            return false;
+        }
+    }
+
+    if (header->tableOrder == 0) {
+        for (int s = MODEL_SLOT_HASH; s <= MODEL_ALIAS; ++s) {
+            if (size[s] != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+    uint64_t slots = (uint64_t) header->slotMask + 1;
+    uint64_t contexts = header->contextCount;
+    uint64_t columns = header->columnCount;
+    return header->tableOrder > 0 && (uint64_t) header->tableOrder <= n
+            && (slots & (slots - 1)) == 0 && contexts < slots
+            && size[MODEL_SLOT_HASH] == slots * sizeof(unsigned int)
+            && size[MODEL_SLOT_CONTEXT] == slots * sizeof(unsigned int)
+            && size[MODEL_CONTEXT_KEY] == contexts * sizeof(uint64_t)
+            && size[MODEL_CONTEXT_FIRST]
+                    == (contexts + 1) * sizeof(unsigned int)
+            && size[MODEL_THRESHOLD] == columns * sizeof(unsigned int)
+            && size[MODEL_SYMBOL] == columns
+            && size[MODEL_ALIAS] == columns;
+}
+
+//----------------------------------------------------------------------------
+// loadModel
+//
+//      Map a model file written by saveModel and point corpus, index, lcp
+//      and table into it; nothing is copied.  Sets *hasLcp and *hasTable to
+//      whether the file includes an LCP index and a transition table, and
+//      *mapping and *mappingSize to the mapping, which the caller unmaps
+//      when it is done with the model.  Returns false, with a message,
+//      if the file cannot be mapped or is not a model this version can
+//      read.
+//----------------------------------------------------------------------------
+
+static bool loadModel(const char *path, Corpus *corpus, SuffixIndex *index,
+        LcpIndex *lcp, bool *hasLcp, TransitionTable *table, bool *hasTable,
+        char **mapping, size_t *mappingSize)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "markov: unable to open %s: %s.\n", path,
+                strerror(errno));
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0
+            || (uint64_t) info.st_size < sizeof(ModelHeader)) {
+        fprintf(stderr, "markov: %s is not a markov model.\n", path);
+        close(fd);
+        return false;
+    }
+    char *base = (char *) mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "markov: unable to map %s: %s.\n", path,
+                strerror(errno));
+        return false;
+    }
+
+    const ModelHeader *header = (const ModelHeader *) base;
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) != 0
+            || header->byteOrder != MODEL_BYTE_ORDER) {
+        fprintf(stderr, "markov: %s is not a markov model for this host.\n",
+                path);
+        munmap(base, info.st_size);
+        return false;
+    }
+    if (header->version != MODEL_VERSION) {
+        fprintf(stderr, "markov: %s is model version %u, expected %u.\n",
+                path, header->version, MODEL_VERSION);
+        munmap(base, info.st_size);
+        return false;
+    }
+    if (header->fileSize != (uint64_t) info.st_size) {
+        fprintf(stderr, "markov: %s is truncated.\n", path);
+        munmap(base, info.st_size);
+        return false;
+    }
+    if (!validModel(header, base, info.st_size)) {
+        fprintf(stderr, "markov: %s is not a markov model.\n", path);
+        munmap(base, info.st_size);
+        return false;
+    }
+
+    corpus->data = base + header->sectionOffset[MODEL_CORPUS];
+    corpus->size = header->corpusSize;
+    corpus->mapped = 0;             // Owned by the model mapping.
+
+    index->count = header->suffixCount;
+    index->width = header->suffixWidth;
+    index->data = (unsigned char *) base
+            + header->sectionOffset[MODEL_SUFFIXES];
+    index->buckets = (uint64_t *) (base
+            + header->sectionOffset[MODEL_BUCKETS]);
+
+    *hasLcp = (header->sectionSize[MODEL_LCP] != 0);
+    if (*hasLcp) {
+        lcp->count = header->suffixCount;
+        lcp->lcp = (uint16_t *) (base + header->sectionOffset[MODEL_LCP]);
+        lcp->leaves = lcpLeaves(header->suffixCount);
+        lcp->tree = (uint16_t *) (base
+                + header->sectionOffset[MODEL_LCP_TREE]);
+    }
+
+    *hasTable = (header->tableOrder != 0);
+    if (*hasTable) {
+        const uint64_t *at = header->sectionOffset;
+        table->order = header->tableOrder;
+        table->slotMask = header->slotMask;
+        table->slotHash = (unsigned int *) (base + at[MODEL_SLOT_HASH]);
+        table->slotContext = (unsigned int *) (base + at[MODEL_SLOT_CONTEXT]);
+        table->contextCount = header->contextCount;
+        table->contextKey = (uint64_t *) (base + at[MODEL_CONTEXT_KEY]);
+        table->contextFirst =
+                (unsigned int *) (base + at[MODEL_CONTEXT_FIRST]);
+        table->columnCount = header->columnCount;
+        table->threshold = (unsigned int *) (base + at[MODEL_THRESHOLD]);
+        table->symbol = (unsigned char *) (base + at[MODEL_SYMBOL]);
+        table->alias = (unsigned char *) (base + at[MODEL_ALIAS]);
+    }
+
+    madvise(base, info.st_size, MADV_WILLNEED);
+    *mapping = base;
+    *mappingSize = info.st_size;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// ExternalSort
+//
+//      The state of an out-of-core suffix sort (see buildModelFile): the
+//      text, the model file being written and where its suffix section
+//      starts, the path scratch files are made at, and the memory to sort
+//      in.
+//
+//      The suffixes are sorted with the DC3 (skew) algorithm, arranged as
+//      scans and external sorts so that the text and every file in between
+//      is only ever read from start to end.  The suffixes at positions not
+//      divisible by 3 are named by their first three symbols and, if the
+//      names repeat, sorted recursively as a text of names two thirds as
+//      long; those at positions divisible by 3 are then sorted by their
+//      first symbol and the rank of the suffix after it, and the two
+//      sorted streams merged.  Each level costs the same few scans and
+//      sorts whatever the text holds, so the work is bounded by the length
+//      of the text, not by how repetitive it is.  A level small enough is
+//      sorted in memory with SA-IS.
+//----------------------------------------------------------------------------
+
+struct ExternalSort {
+    const unsigned char    *text;
+    uint64_t                n;
+    int                     width;
+    int                     fd;             // The model file.
+    uint64_t                suffixOffset;   // Its suffix section.
+    const char             *scratch;        // Where scratch files go.
+    uint64_t                memoryBytes;
+};
+
+static const uint64_t EXTERNAL_CHUNK = 1 << 16;    // Suffixes per write.
+static const size_t EXTERNAL_BUFFER_BYTES = 1 << 20;
+static const size_t EXTERNAL_MIN_READ = 4096;      // Records per run read.
+
+//----------------------------------------------------------------------------
+// readAt, writeAt
+//
+//      Read or write exactly length bytes at offset in fd, retrying short
+//      transfers.  Return false, with a message, on failure.
+//----------------------------------------------------------------------------
+
+static bool readAt(int fd, void *buffer, uint64_t length, uint64_t offset)
+{
+    char *p = (char *) buffer;
+    while (length > 0) {
+        ssize_t got = pread(fd, p, length, offset);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            fprintf(stderr, "markov: error reading sort scratch: %s.\n",
+                    (got < 0) ? strerror(errno) : "unexpected end of file");
+            return false;
+        }
+        p += got;
+        length -= got;
+        offset += got;
+    }
+    return true;
+}
+
+static bool writeAt(int fd, const void *buffer, uint64_t length,
+        uint64_t offset)
+{
+    const char *p = (const char *) buffer;
+    while (length > 0) {
+        ssize_t wrote = pwrite(fd, p, length, offset);
+        if (wrote < 0 && errno == EINTR) {
+            continue;
+        }
+        if (wrote < 0) {
+            fprintf(stderr, "markov: error writing sort output: %s.\n",
+                    strerror(errno));
+            return false;
+        }
+        p += wrote;
+        length -= wrote;
+        offset += wrote;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// createScratch
+//
+//      Create a scratch file next to the model and unlink it at once, so
+//      that it goes away when closed.  Returns its descriptor, or -1, with
+//      a message, on failure.
+//----------------------------------------------------------------------------
+
+static int createScratch(const ExternalSort *sort)
+{
+    int fd = open(sort->scratch, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "markov: unable to create %s: %s.\n", sort->scratch,
+                strerror(errno));
+        return -1;
+    }
+    unlink(sort->scratch);
+    return fd;
+}
+
+//----------------------------------------------------------------------------
+// RecordWriter, RecordReader
+//
+//      Buffered sequential writing of records to a file from some offset,
+//      and reading of count records back from the first'th, each through a
+//      buffer of bufferRecords.  getRecord returns false at the end, or
+//      after a read error, which also sets failed.
+//----------------------------------------------------------------------------
+
+template <typename Record>
+struct RecordWriter {
+    int                 fd;
+    uint64_t            offset;         // Where the next flush goes.
+    vector<Record>      buffer;
+    size_t              filled;
+};
+
+template <typename Record>
+struct RecordReader {
+    int                 fd;
+    uint64_t            offset;         // Where the next read comes from.
+    uint64_t            left;           // Records not yet read.
+    vector<Record>      buffer;
+    size_t              next;
+    size_t              filled;
+    bool                failed;
+};
+
+template <typename Record>
+static void openRecordWriter(RecordWriter<Record> *writer, int fd,
+        uint64_t offset, size_t bufferRecords)
+{
+    writer->fd = fd;
+    writer->offset = offset;
+    writer->buffer.resize(max(bufferRecords, (size_t) 1));
+    writer->filled = 0;
+}
+
+template <typename Record>
+static bool flushRecords(RecordWriter<Record> *writer)
+{
+    uint64_t bytes = writer->filled * sizeof(Record);
+    if (!writeAt(writer->fd, &writer->buffer[0], bytes, writer->offset)) {
+        return false;
+    }
+    writer->offset += bytes;
+    writer->filled = 0;
+    return true;
+}
+
+template <typename Record>
+static inline bool putRecord(RecordWriter<Record> *writer,
+        const Record &record)
+{
+    writer->buffer[writer->filled++] = record;
+    return writer->filled < writer->buffer.size() || flushRecords(writer);
+}
+
+template <typename Record>
+static void openRecordReader(RecordReader<Record> *reader, int fd,
+        uint64_t first, uint64_t count, size_t bufferRecords)
+{
+    reader->fd = fd;
+    reader->offset = first * sizeof(Record);
+    reader->left = count;
+    reader->buffer.resize(max(bufferRecords, (size_t) 1));
+    reader->next = 0;
+    reader->filled = 0;
+    reader->failed = false;
+}
+
+template <typename Record>
+static inline bool getRecord(RecordReader<Record> *reader, Record *record)
+{
+    if (reader->next == reader->filled) {
+        if (reader->left == 0) {
+            return false;
+        }
+        uint64_t length = min(reader->left,
+                (uint64_t) reader->buffer.size());
+        if (!readAt(reader->fd, &reader->buffer[0], length * sizeof(Record),
+                reader->offset)) {
+            reader->failed = true;
+            reader->left = 0;
+            return false;
+        }
+        reader->offset += length * sizeof(Record);
+        reader->left -= length;
+        reader->next = 0;
+        reader->filled = length;
+    }
+    *record = reader->buffer[reader->next++];
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// RecordSorter
+//
+//      An external merge sort of records in about memoryBytes.  Records
+//      added with addRecord are sorted in memory a run at a time, and each
+//      full run is written to a scratch file; finishSorter merges the runs,
+//      first in passes if there are too many to read at once, and
+//      nextRecord hands them back in order.  If they all fit in one run
+//      they never leave memory.  Functions that return bool return false,
+//      with a message, on failure; nextRecord returns false at the end,
+//      too, and sets failed on a failure.
+//----------------------------------------------------------------------------
+
+template <typename Record, typename Less>
+struct RecordSorter {
+    const ExternalSort             *sort;
+    Less                            less;
+    uint64_t                        memoryBytes;
+    size_t                          runLimit;   // Records per run.
+    vector<Record>                  run;
+    size_t                          next;       // In run, if not spilled.
+    int                             fd;         // The runs, or -1.
+    vector<uint64_t>                runStart;   // And the end of the last.
+    vector<RecordReader<Record> >   readers;    // One per run merged.
+    vector<Record>                  heads;      // Each reader's next.
+    vector<size_t>                  heap;       // Readers, least head on top.
+    bool                            failed;
+};
+
+// Orders readers so that the heap functions, which keep the greatest on
+// top, keep the one with the least next record there.
+
+template <typename Record, typename Less>
+struct RecordHeapLess {
+    const RecordSorter<Record, Less>   *sorter;
+
+    bool operator()(size_t a, size_t b) const
+    {
+        return sorter->less(sorter->heads[b], sorter->heads[a]);
+    }
+};
+
+template <typename Record, typename Less>
+static void startSorter(RecordSorter<Record, Less> *sorter,
+        const ExternalSort *sort, uint64_t memoryBytes)
+{
+    sorter->sort = sort;
+    sorter->memoryBytes = memoryBytes;
+    sorter->runLimit = max(memoryBytes / sizeof(Record),
+            (uint64_t) EXTERNAL_MIN_READ);
+    sorter->run.clear();
+    sorter->next = 0;
+    sorter->fd = -1;
+    sorter->runStart.assign(1, 0);
+    sorter->failed = false;
+}
+
+template <typename Record, typename Less>
+static bool spillRun(RecordSorter<Record, Less> *sorter)
+{
+    std::sort(sorter->run.begin(), sorter->run.end(), sorter->less);
+    if (sorter->fd < 0) {
+        sorter->fd = createScratch(sorter->sort);
+        if (sorter->fd < 0) {
+            return false;
+        }
+    }
+    uint64_t start = sorter->runStart.back();
+    if (!writeAt(sorter->fd, &sorter->run[0],
+            sorter->run.size() * sizeof(Record), start * sizeof(Record))) {
+        return false;
+    }
+    sorter->runStart.push_back(start + sorter->run.size());
+    sorter->run.clear();
+    return true;
+}
+
+template <typename Record, typename Less>
+static inline bool addRecord(RecordSorter<Record, Less> *sorter,
+        const Record &record)
+{
+    if (sorter->run.empty()) {
+        sorter->run.reserve(sorter->runLimit);
+    }
+    sorter->run.push_back(record);
+    return sorter->run.size() < sorter->runLimit || spillRun(sorter);
+}
+
+// Start merging runs [first, last), each read through its share of the
+// sorter's memory.
+
+template <typename Record, typename Less>
+static bool startMerge(RecordSorter<Record, Less> *sorter, size_t first,
+        size_t last)
+{
+    size_t count = last - first;
+    size_t bufferRecords = sorter->memoryBytes / sizeof(Record) / count;
+    sorter->readers.assign(count, RecordReader<Record>());
+    sorter->heads.resize(count);
+    sorter->heap.clear();
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t start = sorter->runStart[first + i];
+        openRecordReader(&sorter->readers[i], sorter->fd, start,
+                sorter->runStart[first + i + 1] - start, bufferRecords);
+        if (getRecord(&sorter->readers[i], &sorter->heads[i])) {
+            sorter->heap.push_back(i);
+        } else if (sorter->readers[i].failed) {
+            return false;
+        }
+    }
+    RecordHeapLess<Record, Less> less = { sorter };
+    std::make_heap(sorter->heap.begin(), sorter->heap.end(), less);
+    return true;
+}
+
+template <typename Record, typename Less>
+static inline bool nextRecord(RecordSorter<Record, Less> *sorter,
+        Record *record)
+{
+    if (sorter->fd < 0) {
+        if (sorter->next == sorter->run.size()) {
+            return false;
+        }
+        *record = sorter->run[sorter->next++];
+        return true;
+    }
+    if (sorter->heap.empty()) {
+        return false;
+    }
+    RecordHeapLess<Record, Less> less = { sorter };
+    std::pop_heap(sorter->heap.begin(), sorter->heap.end(), less);
+    size_t i = sorter->heap.back();
+    *record = sorter->heads[i];
+    if (getRecord(&sorter->readers[i], &sorter->heads[i])) {
+        std::push_heap(sorter->heap.begin(), sorter->heap.end(), less);
+    } else {
+        sorter->heap.pop_back();
+        if (sorter->readers[i].failed) {
+            sorter->failed = true;
+            sorter->heap.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Record, typename Less>
+static bool finishSorter(RecordSorter<Record, Less> *sorter)
+{
+    if (sorter->fd < 0) {
+        std::sort(sorter->run.begin(), sorter->run.end(), sorter->less);
+        sorter->next = 0;
+        return true;
+    }
+    if (!sorter->run.empty() && !spillRun(sorter)) {
+        return false;
+    }
+    vector<Record>().swap(sorter->run);
+
+    // Merge groups of runs into longer ones until there are few enough to
+    // read at once with a reasonable buffer each.
+
+    size_t fanIn = max(sorter->memoryBytes / sizeof(Record)
+            / EXTERNAL_MIN_READ, (uint64_t) 2);
+    while (sorter->runStart.size() - 1 > fanIn) {
+        int fd = createScratch(sorter->sort);
+        if (fd < 0) {
+            return false;
+        }
+        RecordWriter<Record> writer;
+        openRecordWriter(&writer, fd, 0,
+                EXTERNAL_BUFFER_BYTES / sizeof(Record));
+        vector<uint64_t> merged(1, 0);
+        size_t runs = sorter->runStart.size() - 1;
+        for (size_t first = 0; first < runs; first += fanIn) {
+            size_t last = min(first + fanIn, runs);
+            if (!startMerge(sorter, first, last)) {
+                close(fd);
+                return false;
+            }
+            Record record;
+            while (nextRecord(sorter, &record)) {
+                if (!putRecord(&writer, record)) {
+                    close(fd);
+                    return false;
+                }
+            }
+            if (sorter->failed) {
+                close(fd);
+                return false;
+            }
+            merged.push_back(sorter->runStart[last]);
+        }
+        if (!flushRecords(&writer)) {
+            close(fd);
+            return false;
+        }
+        close(sorter->fd);
+        sorter->fd = fd;
+        sorter->runStart.swap(merged);
+    }
+    return startMerge(sorter, 0, sorter->runStart.size() - 1);
+}
+
+template <typename Record, typename Less>
+static void closeSorter(RecordSorter<Record, Less> *sorter)
+{
+    if (sorter->fd >= 0) {
+        close(sorter->fd);
+        sorter->fd = -1;
+    }
+    vector<Record>().swap(sorter->run);
+    sorter->readers.clear();
+    sorter->heads.clear();
+    sorter->heap.clear();
+}
+
+//----------------------------------------------------------------------------
+// RecordPlacer
+//
+//      Puts records in the order of a key, from 0 up to count, that each
+//      one holds a different value of, such as a position or a rank: no
+//      sort is needed, only placing each record in its slot.  addRecord
+//      spreads the records over windows of keys whose slots fit in about
+//      memoryBytes, in a scratch file, and nextRecord fills each window's
+//      slots in turn and hands back the records in them.  If one window
+//      covers every key the records never leave memory.  Functions that
+//      return bool return false, with a message, on failure; nextRecord
+//      returns false at the end, too, and sets failed on a failure.
+//----------------------------------------------------------------------------
+
+template <typename Record, typename Key>
+struct RecordPlacer {
+    const ExternalSort             *sort;
+    Key                             key;
+    uint64_t                        count;
+    uint64_t                        window;     // Keys per window.
+    int                             fd;         // The windows, or -1.
+    vector<RecordWriter<Record> >   writers;    // One per window.
+    vector<uint64_t>                filled;     // Records in each.
+    vector<Record>                  slots;      // Of the current window.
+    vector<bool>                    present;
+    uint64_t                        current;
+    uint64_t                        next;       // Slot to look at next.
+    bool                            failed;
+};
+
+template <typename Record, typename Key>
+static bool startPlacer(RecordPlacer<Record, Key> *placer,
+        const ExternalSort *sort, uint64_t memoryBytes, uint64_t count)
+{
+    placer->sort = sort;
+    placer->count = count;
+    placer->window = max(memoryBytes / sizeof(Record),
+            (uint64_t) EXTERNAL_MIN_READ);
+    placer->fd = -1;
+    placer->current = 0;
+    placer->next = 0;
+    placer->failed = false;
+    if (count <= placer->window) {
+        placer->slots.resize(count);
+        placer->present.assign(count, false);
+        return true;
+    }
+
+    placer->fd = createScratch(sort);
+    if (placer->fd < 0) {
+        return false;
+    }
+    uint64_t windows = (count + placer->window - 1) / placer->window;
+    size_t bufferRecords = max(memoryBytes / sizeof(Record) / windows,
+            (uint64_t) EXTERNAL_MIN_READ);
+    placer->writers.resize(windows);
+    placer->filled.assign(windows, 0);
+    for (uint64_t w = 0; w < windows; ++w) {
+        openRecordWriter(&placer->writers[w], placer->fd,
+                w * placer->window * sizeof(Record), bufferRecords);
+    }
+    return true;
+}
+
+template <typename Record, typename Key>
+static inline bool addRecord(RecordPlacer<Record, Key> *placer,
+        const Record &record)
+{
+    uint64_t key = placer->key(record);
+    if (placer->fd < 0) {
+        placer->slots[key] = record;
+        placer->present[key] = true;
+        return true;
+    }
+    uint64_t w = key / placer->window;
+    ++placer->filled[w];
+    return putRecord(&placer->writers[w], record);
+}
+
+// Read the records of window w into their slots.
+
+template <typename Record, typename Key>
+static bool fillWindow(RecordPlacer<Record, Key> *placer, uint64_t w)
+{
+    uint64_t first = w * placer->window;
+    uint64_t length = min(placer->window, placer->count - first);
+    placer->slots.resize(length);
+    placer->present.assign(length, false);
+    RecordReader<Record> reader;
+    openRecordReader(&reader, placer->fd, first, placer->filled[w],
+            EXTERNAL_BUFFER_BYTES / sizeof(Record));
+    Record record;
+    while (getRecord(&reader, &record)) {
+        uint64_t slot = placer->key(record) - first;
+        placer->slots[slot] = record;
+        placer->present[slot] = true;
+    }
+    placer->current = w;
+    placer->next = 0;
+    return !reader.failed;
+}
+
+template <typename Record, typename Key>
+static bool finishPlacer(RecordPlacer<Record, Key> *placer)
+{
+    if (placer->fd < 0) {
+        return true;
+    }
+    for (size_t w = 0; w < placer->writers.size(); ++w) {
+        if (!flushRecords(&placer->writers[w])) {
+            return false;
+        }
+    }
+    vector<RecordWriter<Record> >().swap(placer->writers);
+    return fillWindow(placer, 0);
+}
+
+template <typename Record, typename Key>
+static inline bool nextRecord(RecordPlacer<Record, Key> *placer,
+        Record *record)
+{
+    for (;;) {
+        while (placer->next < placer->slots.size()) {
+            uint64_t slot = placer->next++;
+            if (placer->present[slot]) {
+                *record = placer->slots[slot];
+                return true;
+            }
+        }
+        if (placer->fd < 0 || placer->current + 1 == placer->filled.size()) {
+            return false;
+        }
+        if (!fillWindow(placer, placer->current + 1)) {
+            placer->failed = true;
+            placer->slots.clear();
+            return false;
+        }
+    }
+}
+
+template <typename Record, typename Key>
+static void closePlacer(RecordPlacer<Record, Key> *placer)
+{
+    if (placer->fd >= 0) {
+        close(placer->fd);
+        placer->fd = -1;
+    }
+    placer->writers.clear();
+    vector<Record>().swap(placer->slots);
+    vector<bool>().swap(placer->present);
+}
+
+//----------------------------------------------------------------------------
+// SymbolReader
+//
+//      Reads the text of one level of the DC3 sort in order, a few symbols
+//      ahead: at the top the bytes of the input, through its mapping, each
+//      plus one; below it the names of the level above, from a file.
+//      Positions at or past the end read as 0, below every symbol.
+//      symbolAt must be asked for positions that never go back by more
+//      than SYMBOL_BEHIND.
+//----------------------------------------------------------------------------
+
+static const uint64_t SYMBOL_BEHIND = 8;
+
+template <typename Index>
+struct SymbolReader {
+    const unsigned char    *bytes;      // The input, or NULL.
+    int                     fd;         // Otherwise, the names.
+    uint64_t                n;
+    vector<Index>           window;
+    uint64_t                base;       // Position of window[0].
+    uint64_t                length;     // Symbols in window.
+    bool                    failed;
+};
+
+template <typename Index>
+static void openSymbolReader(SymbolReader<Index> *reader,
+        const unsigned char *bytes, int fd, uint64_t n)
+{
+    reader->bytes = bytes;
+    reader->fd = fd;
+    reader->n = n;
+    if (bytes == NULL) {
+        reader->window.resize(EXTERNAL_BUFFER_BYTES / sizeof(Index));
+    }
+    reader->base = 0;
+    reader->length = 0;
+    reader->failed = false;
+}
+
+template <typename Index>
+static inline Index symbolAt(SymbolReader<Index> *reader, uint64_t i)
+{
+    if (i >= reader->n) {
+        return 0;
+    }
+    if (reader->bytes != NULL) {
+        return (Index) reader->bytes[i] + 1;
+    }
+    if (i >= reader->base + reader->length) {
+        reader->base = (i > SYMBOL_BEHIND) ? i - SYMBOL_BEHIND : 0;
+        reader->length = min((uint64_t) reader->window.size(),
+                reader->n - reader->base);
+        if (!readAt(reader->fd, &reader->window[0],
+                reader->length * sizeof(Index),
+                reader->base * sizeof(Index))) {
+            reader->failed = true;
+            reader->length = 0;
+            return 0;
+        }
+    }
+    return reader->window[i - reader->base];
+}
+
+//----------------------------------------------------------------------------
+// DcTriple, DcEntry, DcSuffix
+//
+//      The records the DC3 sort sorts or places: a sample suffix's first
+//      three symbols and where its name goes in the text of names; a value
+//      for a place in a file; and a suffix with what the merge compares it
+//      by.  Ranks count from 1, leaving 0 for past the end of the text.
+//      For a suffix at a position divisible by 3, next holds the ranks of
+//      the sample suffixes one and two on; for a sample suffix, ownRank is
+//      its own rank and next[0] (one position on from a position 1 mod 3)
+//      or next[1] (two on from 2 mod 3) is the rank the merge needs.
+//----------------------------------------------------------------------------
+
+template <typename Index>
+struct DcTriple {
+    Index           symbol[3];
+    Index           at;
+};
+
+template <typename Index>
+struct DcEntry {
+    Index           at;
+    Index           value;
+};
+
+template <typename Index>
+struct DcSuffix {
+    Index           ownRank;
+    Index           symbol[2];
+    Index           next[2];
+    Index           position;
+};
+
+template <typename Index>
+struct DcTripleLess {
+    bool operator()(const DcTriple<Index> &a, const DcTriple<Index> &b) const
+    {
+        if (a.symbol[0] != b.symbol[0]) {
+            return a.symbol[0] < b.symbol[0];
+        }
+        if (a.symbol[1] != b.symbol[1]) {
+            return a.symbol[1] < b.symbol[1];
+        }
+        return a.symbol[2] < b.symbol[2];
+    }
+};
+
+template <typename Index>
+struct DcEntryKey {
+    uint64_t operator()(const DcEntry<Index> &entry) const
+    {
+        return entry.at;
+    }
+};
+
+template <typename Index>
+struct DcRankKey {
+    uint64_t operator()(const DcSuffix<Index> &suffix) const
+    {
+        return suffix.ownRank - 1;
+    }
+};
+
+template <typename Index>
+struct DcFirstLess {
+    bool operator()(const DcSuffix<Index> &a, const DcSuffix<Index> &b) const
+    {
+        if (a.symbol[0] != b.symbol[0]) {
+            return a.symbol[0] < b.symbol[0];
+        }
+        return a.next[0] < b.next[0];
+    }
+};
+
+// Whether sample suffix a sorts before suffix b, at a position divisible by
+// 3: by one symbol and the rank of the sample suffix after it, or two
+// symbols and the rank after those, whichever leads to sample suffixes for
+// both.
+
+template <typename Index>
+static inline bool dcSampleFirst(const DcSuffix<Index> &a,
+        const DcSuffix<Index> &b)
+{
+    if (a.symbol[0] != b.symbol[0]) {
+        return a.symbol[0] < b.symbol[0];
+    }
+    if (a.position % 3 == 1) {
+        return a.next[0] <= b.next[0];
+    }
+    if (a.symbol[1] != b.symbol[1]) {
+        return a.symbol[1] < b.symbol[1];
+    }
+    return a.next[1] <= b.next[1];
+}
+
+//----------------------------------------------------------------------------
+// dcSortInMemory
+//
+//      Sort the suffixes of a level of the DC3 sort small enough to hold
+//      in memory with SA-IS, and write them to out.
+//----------------------------------------------------------------------------
+
+template <typename Index>
+static bool dcSortInMemory(const unsigned char *bytes, int names, uint64_t n,
+        uint64_t alphabet, RecordWriter<Index> *out)
+{
+    vector<Index> sa(n);
+    if (bytes != NULL) {
+        saisBuild<unsigned char, Index>(bytes, n, 255, &sa[0]);
+    } else {
+        vector<Index> text(n);
+        if (n > 0 && !readAt(names, &text[0], n * sizeof(Index), 0)) {
+            return false;
+        }
+        saisBuild<Index, Index>(&text[0], n, alphabet, &sa[0]);
+    }
+    for (uint64_t i = 0; i < n; ++i) {
+        if (!putRecord(out, sa[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// dcSort
+//
+//      Write the suffixes of a text of n symbols in order to out, as DC3
+//      sorts them (see ExternalSort): the input itself when bytes is not
+//      NULL, or else the alphabet names from 1 up held in the file names.
+//      Following the usual formulation, the sample is the positions 1 and
+//      2 mod 3, with one more past the end when n is 1 mod 3, and its text
+//      of names has the names of the first kind followed by those of the
+//      second.  Returns false, with a message, on failure.
+//----------------------------------------------------------------------------
+
+template <typename Index>
+static bool dcSort(const ExternalSort *sort, const unsigned char *bytes,
+        int names, uint64_t n, uint64_t alphabet, RecordWriter<Index> *out)
+{
+    uint64_t perSymbol = ((bytes != NULL) ? 4 : 6) * sizeof(Index);
+    if (n < 3 || n <= sort->memoryBytes / perSymbol) {
+        return dcSortInMemory(bytes, names, n, alphabet, out);
+    }
+    uint64_t n0 = (n + 2) / 3;
+    uint64_t n1 = (n + 1) / 3;
+    uint64_t n2 = n / 3;
+    uint64_t n02 = n0 + n2;
+    uint64_t half = sort->memoryBytes / 2;
+    size_t buffer = EXTERNAL_BUFFER_BYTES / sizeof(Index);
+    bool ok = true;
+
+    // Sort the sample suffixes by their first three symbols and name them,
+    // then put the names in text order.
+
+    RecordSorter<DcTriple<Index>, DcTripleLess<Index> > triples;
+    startSorter(&triples, sort, half);
+    SymbolReader<Index> text;
+    openSymbolReader(&text, bytes, names, n);
+    for (uint64_t i = 1; i < n + (n0 - n1) && ok; ++i) {
+        if (i % 3 == 0) {
+            continue;
+        }
+        DcTriple<Index> triple;
+        triple.symbol[0] = symbolAt(&text, i);
+        triple.symbol[1] = symbolAt(&text, i + 1);
+        triple.symbol[2] = symbolAt(&text, i + 2);
+        triple.at = (i % 3 == 1) ? i / 3 : i / 3 + n0;
+        ok = addRecord(&triples, triple);
+    }
+    ok = ok && !text.failed && finishSorter(&triples);
+
+    RecordPlacer<DcEntry<Index>, DcEntryKey<Index> > named;
+    ok = startPlacer(&named, sort, half, n02) && ok;
+    uint64_t nameCount = 0;
+    DcTriple<Index> triple, last;
+    while (ok && nextRecord(&triples, &triple)) {
+        if (nameCount == 0 || memcmp(triple.symbol, last.symbol,
+                sizeof(triple.symbol)) != 0) {
+            ++nameCount;
+            last = triple;
+        }
+        DcEntry<Index> entry = { triple.at, (Index) nameCount };
+        ok = addRecord(&named, entry);
+    }
+    ok = ok && !triples.failed;
+    closeSorter(&triples);
+    ok = ok && finishPlacer(&named);
+
+    int nameFile = ok ? createScratch(sort) : -1;
+    ok = nameFile >= 0;
+    if (ok) {
+        RecordWriter<Index> writer;
+        openRecordWriter(&writer, nameFile, 0, buffer);
+        DcEntry<Index> entry;
+        while (ok && nextRecord(&named, &entry)) {
+            ok = putRecord(&writer, entry.value);
+        }
+        ok = ok && !named.failed && flushRecords(&writer);
+    }
+    closePlacer(&named);
+
+    // Rank the sample suffixes: by their names, if those are all
+    // different, or else by sorting the text of names, and putting the
+    // rank of each name's suffix back in its place.
+
+    int rankFile = nameFile;
+    if (ok && nameCount < n02) {
+        int order = createScratch(sort);
+        ok = order >= 0;
+        if (ok) {
+            RecordWriter<Index> writer;
+            openRecordWriter(&writer, order, 0, buffer);
+            ok = dcSort(sort, NULL, nameFile, n02, nameCount, &writer)
+                    && flushRecords(&writer);
+        }
+        close(nameFile);
+
+        RecordPlacer<DcEntry<Index>, DcEntryKey<Index> > ranked;
+        ok = startPlacer(&ranked, sort, sort->memoryBytes, n02) && ok;
+        if (ok) {
+            RecordReader<Index> reader;
+            openRecordReader(&reader, order, 0, n02, buffer);
+            Index suffix;
+            for (uint64_t r = 1; ok && getRecord(&reader, &suffix); ++r) {
+                DcEntry<Index> entry = { suffix, (Index) r };
+                ok = addRecord(&ranked, entry);
+            }
+            ok = ok && !reader.failed && finishPlacer(&ranked);
+        }
+        if (order >= 0) {
+            close(order);
+        }
+
+        rankFile = ok ? createScratch(sort) : -1;
+        ok = rankFile >= 0;
+        if (ok) {
+            RecordWriter<Index> writer;
+            openRecordWriter(&writer, rankFile, 0, buffer);
+            DcEntry<Index> entry;
+            while (ok && nextRecord(&ranked, &entry)) {
+                ok = putRecord(&writer, entry.value);
+            }
+            ok = ok && !ranked.failed && flushRecords(&writer);
+        }
+        closePlacer(&ranked);
+    }
+
+    // Make a record of every suffix with the symbols and ranks the merge
+    // needs, reading the ranks of the two kinds of sample suffix in step,
+    // and put the sample suffixes in order of rank and sort the others.
+
+    RecordSorter<DcSuffix<Index>, DcFirstLess<Index> > zero;
+    RecordPlacer<DcSuffix<Index>, DcRankKey<Index> > sample;
+    startSorter(&zero, sort, half);
+    ok = startPlacer(&sample, sort, half, n02) && ok;
+    if (ok) {
+        RecordReader<Index> ranks1, ranks2;
+        openRecordReader(&ranks1, rankFile, 0, n0, buffer);
+        openRecordReader(&ranks2, rankFile, n0, n2, buffer);
+        openSymbolReader(&text, bytes, names, n);
+        Index rank1 = 0, nextRank1 = 0, rank2 = 0;
+        ok = getRecord(&ranks1, &rank1);
+        for (uint64_t q = 0; q < n0 && ok; ++q) {
+            uint64_t p = 3 * q;
+            nextRank1 = 0;
+            if (q + 1 < n0) {
+                ok = getRecord(&ranks1, &nextRank1);
+            }
+            rank2 = 0;
+            if (q < n2) {
+                ok = ok && getRecord(&ranks2, &rank2);
+            }
+            Index symbols[4];
+            for (int j = 0; j < 4; ++j) {
+                symbols[j] = symbolAt(&text, p + j);
+            }
+
+            DcSuffix<Index> suffix;
+            suffix.ownRank = 0;
+            suffix.symbol[0] = symbols[0];
+            suffix.symbol[1] = symbols[1];
+            suffix.next[0] = (p + 1 < n) ? rank1 : 0;
+            suffix.next[1] = (p + 2 < n) ? rank2 : 0;
+            suffix.position = p;
+            ok = ok && addRecord(&zero, suffix);
+            if (p + 1 < n) {
+                suffix.ownRank = rank1;
+                suffix.symbol[0] = symbols[1];
+                suffix.symbol[1] = symbols[2];
+                suffix.next[0] = (p + 2 < n) ? rank2 : 0;
+                suffix.next[1] = 0;
+                suffix.position = p + 1;
+                ok = ok && addRecord(&sample, suffix);
+            }
+            if (p + 2 < n) {
+                suffix.ownRank = rank2;
+                suffix.symbol[0] = symbols[2];
+                suffix.symbol[1] = symbols[3];
+                suffix.next[0] = 0;
+                suffix.next[1] = (p + 4 < n) ? nextRank1 : 0;
+                suffix.position = p + 2;
+                ok = ok && addRecord(&sample, suffix);
+            }
+            rank1 = nextRank1;
+        }
+        ok = ok && !ranks1.failed && !ranks2.failed && !text.failed;
+    }
+    if (rankFile >= 0) {
+        close(rankFile);
+    }
+    ok = ok && finishSorter(&zero) && finishPlacer(&sample);
+
+    // Merge the two ordered streams.
+
+    DcSuffix<Index> a, b;
+    bool hasA = ok && nextRecord(&sample, &a);
+    bool hasB = ok && nextRecord(&zero, &b);
+    while (ok && (hasA || hasB)) {
+        if (hasA && (!hasB || dcSampleFirst(a, b))) {
+            ok = putRecord(out, a.position);
+            hasA = nextRecord(&sample, &a);
+        } else {
+            ok = putRecord(out, b.position);
+            hasB = nextRecord(&zero, &b);
+        }
+    }
+    ok = ok && !sample.failed && !zero.failed;
+    closeSorter(&zero);
+    closePlacer(&sample);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// sortExternal
+//
+//      Sort every suffix into the suffix section of the model file.  With
+//      4-byte offsets the sort writes them straight there; wider ones are
+//      sorted as 64-bit values into a scratch file and then packed down.
+//----------------------------------------------------------------------------
+
+static bool sortExternal(const ExternalSort *sort)
+{
+    if (sort->width == 4) {
+        RecordWriter<uint32_t> writer;
+        openRecordWriter(&writer, sort->fd, sort->suffixOffset,
+                EXTERNAL_CHUNK);
+        return dcSort(sort, sort->text, -1, sort->n, 256, &writer)
+                && flushRecords(&writer);
+    }
+
+    int fd = createScratch(sort);
+    if (fd < 0) {
+        return false;
+    }
+    RecordWriter<uint64_t> writer;
+    openRecordWriter(&writer, fd, 0, EXTERNAL_CHUNK);
+    bool ok = dcSort(sort, sort->text, -1, sort->n, 256, &writer)
+            && flushRecords(&writer);
+    RecordReader<uint64_t> reader;
+    openRecordReader(&reader, fd, 0, sort->n, EXTERNAL_CHUNK);
+    vector<unsigned char> buffer(EXTERNAL_CHUNK * sort->width);
+    SuffixIndex chunk = { EXTERNAL_CHUNK, sort->width, &buffer[0], NULL };
+    for (uint64_t done = 0; ok && done < sort->n; done += EXTERNAL_CHUNK) {
+        uint64_t length = min(sort->n - done, EXTERNAL_CHUNK);
+        uint64_t offset = 0;
+        for (uint64_t i = 0; ok && i < length; ++i) {
+            ok = getRecord(&reader, &offset);
+            setSuffixAt(&chunk, i, offset);
+        }
+        ok = ok && writeAt(sort->fd, chunk.data, length * sort->width,
+                sort->suffixOffset + done * sort->width);
+    }
+    close(fd);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// buildModelFile
+//
+//      Write a model of corpus with no LCP index or transition table to
+//      path, as saveModel would, but sorting its suffixes out of core in
+//      about memoryBytes of memory (see ExternalSort).  The text is only
+//      read, in order, through its mapping, so it need not fit in memory
+//      either; the sort keeps what it works on in scratch files next to
+//      the model.  Returns false, with a message, on failure.
+//----------------------------------------------------------------------------
+
+static bool buildModelFile(const char *path, const Corpus *corpus,
+        const uint64_t *counts, uint64_t memoryBytes)
+{
+    uint64_t n = corpus->size;
+    ModelHeader header;
+    initModelHeader(&header, n, (n < 0xffffffffull) ? 4 : 5);
+    layoutModel(&header);
+
+    size_t length = strlen(path);
+    char *temp = new char[length + 8];
+    sprintf(temp, "%s.tmp", path);
+    char *scratch = new char[length + 8];
+    sprintf(scratch, "%s.runs", path);
+    ExternalSort sort;
+    sort.text = (const unsigned char *) corpus->data;
+    sort.n = n;
+    sort.width = header.suffixWidth;
+    sort.fd = open(temp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    sort.suffixOffset = header.sectionOffset[MODEL_SUFFIXES];
+    sort.scratch = scratch;
+    sort.memoryBytes = memoryBytes;
+    if (sort.fd < 0) {
+        fprintf(stderr, "markov: unable to create %s: %s.\n", temp,
+                strerror(errno));
+        delete [] temp;
+        delete [] scratch;
+        return false;
+    }
+
+    vector<uint64_t> buckets(PREFIX_BUCKETS + 1);
+    SuffixIndex index = { n, sort.width, NULL, &buckets[0] };
+    countPrefixBuckets(corpus->data, n, counts, &index);
+    bool ok = ftruncate(sort.fd, header.fileSize) == 0
+            && writeAt(sort.fd, &header, sizeof(header), 0)
+            && writeAt(sort.fd, corpus->data, n + 1,
+                    header.sectionOffset[MODEL_CORPUS])
+            && writeAt(sort.fd, &buckets[0],
+                    header.sectionSize[MODEL_BUCKETS],
+                    header.sectionOffset[MODEL_BUCKETS])
+            && sortExternal(&sort);
+    if (close(sort.fd) != 0) {
+        ok = false;
+    }
+    if (ok && rename(temp, path) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "markov: unable to write %s: %s.\n", path,
+                strerror(errno));
+        unlink(temp);
+    }
+    delete [] temp;
+    delete [] scratch;
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// OrderData
+//
+//      What a model keeps for one order: its transition table and its
+//      search tree, either of which may be missing.  A table loaded from a
+//      model file points into the file mapping, so its arrays are not its
+//      own to free.
+//----------------------------------------------------------------------------
+
+struct OrderData {
+    int                 order;
+    TransitionTable    *table;
+    bool                ownsTable;
+    SearchTree         *tree;
+};
+
+//----------------------------------------------------------------------------
+// MarkovModelData
+//
+//      Everything behind a MarkovModel.  For a model loaded from a file,
+//      mapping holds the whole file, and the corpus, the suffix index and
+//      any LCP index or table that came with it point into it.
+//----------------------------------------------------------------------------
+
+struct MarkovModelData {
+    Corpus              corpus;
+    bool                hasCorpus;
+    SuffixIndex         index;
+    bool                hasIndex;
+    bool                ownsIndex;
+    LcpIndex            lcp;
+    bool                hasLcp;
+    bool                ownsLcp;
+    vector<OrderData>   orders;
+    WordIndex           words;
+    bool                hasWords;
+    FmIndex             fm;
+    bool                hasFm;
+    uint64_t           *prefixCounts;   // Counted while decompressing.
+    char               *mapping;
+    size_t              mappingSize;
+};
+
+static const OrderData *findOrder(const MarkovModelData *data, int order)
+{
+    for (size_t i = 0; i < data->orders.size(); ++i) {
+        if (data->orders[i].order == order) {
+            return &data->orders[i];
+        }
+    }
+    return NULL;
+}
+
+static OrderData *addOrder(MarkovModelData *data, int order)
+{
+    for (size_t i = 0; i < data->orders.size(); ++i) {
+        if (data->orders[i].order == order) {
+            return &data->orders[i];
+        }
+    }
+    OrderData entry = { order, NULL, false, NULL };
+    data->orders.push_back(entry);
+    return &data->orders.back();
+}
+
+//----------------------------------------------------------------------------
+// releaseIndexes, releaseModel
+//
+//      Free the suffix index and everything built from it, or the whole
+//      model, including the word and FM indexes, leaving it empty.
+//----------------------------------------------------------------------------
+
+static void releaseIndexes(MarkovModelData *data)
+{
+    for (size_t i = 0; i < data->orders.size(); ++i) {
+        TransitionTable *table = data->orders[i].table;
+        if (table != NULL && data->orders[i].ownsTable) {
+            delete [] table->slotHash;
+            delete [] table->slotContext;
+            delete [] table->contextKey;
+            delete [] table->contextFirst;
+            delete [] table->threshold;
+            delete [] table->symbol;
+            delete [] table->alias;
+        }
+        delete table;
+        SearchTree *tree = data->orders[i].tree;
+        if (tree != NULL) {
+            free(tree->keys);
+            delete [] tree->rank;
+            delete tree;
+        }
+    }
+    data->orders.clear();
+
+    if (data->hasLcp && data->ownsLcp) {
+        delete [] data->lcp.lcp;
+        delete [] data->lcp.tree;
+    }
+    data->hasLcp = false;
+    data->ownsLcp = false;
+
+    if (data->hasIndex && data->ownsIndex) {
+        delete [] data->index.data;
+        delete [] data->index.buckets;
+    }
+    data->hasIndex = false;
+    data->ownsIndex = false;
+}
+
+static void releaseModel(MarkovModelData *data)
+{
+    releaseIndexes(data);
+    if (data->hasWords) {
+        delete [] data->words.tokens;
+        delete [] data->words.suffixes;
+        delete [] data->words.spelling;
+        delete [] data->words.length;
+        delete [] data->words.buckets;
+    }
+    data->hasWords = false;
+    if (data->hasFm) {
+        free(data->fm.levels);
+    }
+    data->hasFm = false;
+    delete [] data->prefixCounts;
+    data->prefixCounts = NULL;
+    if (data->hasCorpus && data->corpus.mapped != 0) {
+        munmap(data->corpus.data, data->corpus.mapped);
+    }
+    data->hasCorpus = false;
+    if (data->mapping != NULL) {
+        munmap(data->mapping, data->mappingSize);
+        data->mapping = NULL;
+        data->mappingSize = 0;
+    }
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::MarkovModel, MarkovModel::~MarkovModel
+//
+//      Create an empty model, and free everything a model holds.
+//----------------------------------------------------------------------------
+
+MarkovModel::MarkovModel()
+{
+    data = new MarkovModelData;
+    data->hasCorpus = false;
+    data->hasIndex = false;
+    data->ownsIndex = false;
+    data->hasLcp = false;
+    data->ownsLcp = false;
+    data->hasWords = false;
+    data->hasFm = false;
+    data->prefixCounts = NULL;
+    data->mapping = NULL;
+    data->mappingSize = 0;
+}
+
+MarkovModel::~MarkovModel()
+{
+    releaseModel(data);
+    delete data;
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::readFile, MarkovModel::readStream, MarkovModel::setText
+//
+//      Replace the model with up to maxBytes of sample text (all of it, if
+//      maxBytes is 0) mapped from a file, read from a stream, or copied from
+//      memory.  gzip and zstd files and streams are decompressed, counting
+//      the prefix buckets for buildIndex on the way.  The text still has to
+//      be indexed with buildIndex.  Return false, with a message, on
+//      failure.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::readFile(const char *path, uint64_t maxBytes)
+{
+    releaseModel(data);
+    data->hasCorpus = mapCorpusFile(path, maxBytes, &data->corpus,
+            &data->prefixCounts);
+    return data->hasCorpus;
+}
+
+bool MarkovModel::readStream(int fd, uint64_t maxBytes)
+{
+    releaseModel(data);
+    data->hasCorpus = readCorpusStream(fd, maxBytes, &data->corpus,
+            &data->prefixCounts);
+    return data->hasCorpus;
+}
+
+bool MarkovModel::setText(const char *text, uint64_t size)
+{
+    releaseModel(data);
+    Corpus *corpus = &data->corpus;
+    corpus->mapped = pageRound(size + 1);
+    corpus->data = (char *) mmap(0, corpus->mapped, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (corpus->data == MAP_FAILED) {
+        fprintf(stderr, "markov: unable to allocate input buffer: %s.\n",
+                strerror(errno));
+        return false;
+    }
+    memcpy(corpus->data, text, size);
+    corpus->size = size;
+    data->hasCorpus = true;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::buildIndex
+//
+//      Sort the suffixes of the sample text with the given algorithm,
+//      discarding any structures built for the previous index.  Returns
+//      false, with a message, on failure.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::buildIndex(SuffixAlgorithm algorithm, int threads)
+{
+    if (!data->hasCorpus) {
+        fprintf(stderr, "markov: no sample text to index.\n");
+        return false;
+    }
+    releaseIndexes(data);
+    if (!buildSuffixArray(data->corpus.data, data->corpus.size,
+            data->prefixCounts, &data->index, algorithm, threads)) {
+        return false;
+    }
+    data->hasIndex = true;
+    data->ownsIndex = true;
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::append, MarkovModel::appendFile
+//
+//      Add size bytes of text, or up to maxBytes of the named file (all of
+//      it, if maxBytes is 0), to the end of the sample text and merge their
+//      suffixes into the index, discarding every other structure built
+//      for the old text.  Return false, with a message, on failure.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::append(const char *text, uint64_t size)
+{
+    if (!data->hasIndex || data->corpus.size == 0) {
+        fprintf(stderr, "markov: no index to append to.\n");
+        return false;
+    }
+    if (size == 0) {
+        return true;
+    }
+    Corpus corpus;
+    SuffixIndex index;
+    if (!appendToIndex(&data->corpus, &data->index, text, size, &corpus,
+            &index)) {
+        return false;
+    }
+    releaseModel(data);
+    data->corpus = corpus;
+    data->hasCorpus = true;
+    data->index = index;
+    data->hasIndex = true;
+    data->ownsIndex = true;
+    return true;
+}
+
+bool MarkovModel::appendFile(const char *path, uint64_t maxBytes)
+{
+    Corpus extra;
+    if (!mapCorpusFile(path, maxBytes, &extra, NULL)) {
+        return false;
+    }
+    bool ok = append(extra.data, extra.size);
+    munmap(extra.data, extra.mapped);
+    return ok;
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::buildIndexFile
+//
+//      Sort the suffixes of the sample text out of core, in about
+//      memoryBytes of memory, into a model file at path, and replace the
+//      model with the one mapped from it, as load would.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::buildIndexFile(const char *path, uint64_t memoryBytes)
+{
+    if (!data->hasCorpus) {
+        fprintf(stderr, "markov: no sample text to index.\n");
+        return false;
+    }
+    if (data->corpus.size == 0) {
+        fprintf(stderr, "markov: no sample text to index.\n");
+        return false;
+    }
+    return buildModelFile(path, &data->corpus, data->prefixCounts,
+            memoryBytes) && load(path);
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::build
+//
+//      Copy size bytes of sample text and index them.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::build(const char *text, uint64_t size,
+        SuffixAlgorithm algorithm, int threads)
+{
+    return setText(text, size) && buildIndex(algorithm, threads);
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::load
+//
+//      Replace the model with one mapped from a file written by save.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::load(const char *path)
+{
+    releaseModel(data);
+
+    TransitionTable table;
+    bool hasTable = false;
+    if (!loadModel(path, &data->corpus, &data->index, &data->lcp,
+            &data->hasLcp, &table, &hasTable, &data->mapping,
+            &data->mappingSize)) {
+        return false;
+    }
+    data->hasCorpus = true;
+    data->hasIndex = true;
+    if (hasTable) {
+        OrderData *entry = addOrder(data, table.order);
+        entry->table = new TransitionTable(table);
+        entry->ownsTable = false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::save
+//
+//      Write the model to path, with its LCP index if it has one and the
+//      transition table for tableOrder, unless that is 0.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::save(const char *path, int tableOrder) const
+{
+    if (!data->hasIndex) {
+        fprintf(stderr, "markov: no index to save.\n");
+        return false;
+    }
+    const TransitionTable *table = NULL;
+    if (tableOrder != 0) {
+        const OrderData *entry = findOrder(data, tableOrder);
+        if (entry == NULL || entry->table == NULL) {
+            fprintf(stderr, "markov: no order %d transition table to save.\n",
+                    tableOrder);
+            return false;
+        }
+        table = entry->table;
+    }
+    return saveModel(path, &data->corpus, &data->index,
+            data->hasLcp ? &data->lcp : NULL, table);
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::buildLcp, MarkovModel::buildTable,
+// MarkovModel::buildSearchTree
+//
+//      Add the LCP index, or the transition table or search tree for one
+//      order, unless the model already has it.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::buildLcp()
+{
+    if (!data->hasIndex) {
+        fprintf(stderr, "markov: no index to build an LCP array from.\n");
+        return false;
+    }
+    if (!data->hasLcp) {
+        buildLcpIndex(&data->lcp, data->corpus.data, &data->index);
+        data->hasLcp = true;
+        data->ownsLcp = true;
+    }
+    return true;
+}
+
+bool MarkovModel::buildTable(int order)
+{
+    if (!data->hasIndex) {
+        fprintf(stderr, "markov: no index to build a transition table "
+                "from.\n");
+        return false;
+    }
+    OrderData *entry = addOrder(data, order);
+    if (entry->table == NULL) {
+        TransitionTable *table = new TransitionTable;
+        if (!buildTransitionTable(table, data->corpus.data, &data->index,
+                order)) {
+            delete table;
+            return false;
+        }
+        entry->table = table;
+        entry->ownsTable = true;
+    }
+    return true;
+}
+
+bool MarkovModel::buildSearchTree(int order)
+{
+    if (!data->hasIndex) {
+        fprintf(stderr, "markov: no index to build a search tree from.\n");
+        return false;
+    }
+    OrderData *entry = addOrder(data, order);
+    if (entry->tree == NULL) {
+        SearchTree *tree = new SearchTree;
+        if (!::buildSearchTree(tree, data->corpus.data, &data->index,
+                order)) {
+            delete tree;
+            return false;
+        }
+        entry->tree = tree;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::buildWords
+//
+//      Add the word index, which serves every order of the word engine.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::buildWords()
+{
+    if (!data->hasCorpus) {
+        fprintf(stderr, "markov: no sample text to index.\n");
+        return false;
+    }
+    if (!data->hasWords) {
+        if (!buildWordIndex(&data->words, data->corpus.data,
+                data->corpus.size)) {
+            return false;
+        }
+        data->hasWords = true;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::buildFmIndex
+//
+//      Add the FM-index, which serves every order of the FM engine.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::buildFmIndex()
+{
+    if (!data->hasCorpus) {
+        fprintf(stderr, "markov: no sample text to index.\n");
+        return false;
+    }
+    if (!data->hasFm) {
+        if (!::buildFmIndex(&data->fm, data->corpus.data,
+                data->corpus.size)) {
+            return false;
+        }
+        data->hasFm = true;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::prepare
+//
+//      Build whatever a MarkovGenerator needs to generate with the given
+//      order, engine and search method: the transition table for the table
+//      engine; the LCP index, and the search tree for SEARCH_EYTZINGER, for
+//      the suffix engine; the word index for the word engine; the FM-index
+//      for the FM engine.  Backoff looks shorter contexts up in the suffix
+//      array, so the table and suffix engines need the LCP index for it
+//      whatever the order.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::prepare(int order, GenerationEngine engine,
+        SearchMethod search, bool backoff)
+{
+    if (engine == ENGINE_WORD) {
+        return buildWords();
+    }
+    if (engine == ENGINE_FM) {
+        return buildFmIndex();
+    }
+    if ((backoff || (engine == ENGINE_SUFFIX && order <= (int) LCP_MAX))
+            && !buildLcp()) {
+        return false;
+    }
+    if (engine == ENGINE_TABLE) {
+        return buildTable(order);
+    }
+    if (search == SEARCH_EYTZINGER && !buildSearchTree(order)) {
+        return false;
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel queries
+//
+//      The size of the sample text and the text itself; the bytes per
+//      suffix array entry; whether the LCP index or the table for an order
+//      is present; the contexts and transitions in that table; the
+//      samples in the search tree for an order, or 0 if there is none; the
+//      number of words and distinct words, if they have been indexed; and
+//      the bytes taken by the FM-index, or 0 if there is none.
+//----------------------------------------------------------------------------
+
+uint64_t MarkovModel::size() const
+{
+    return data->hasCorpus ? data->corpus.size : 0;
+}
+
+const char *MarkovModel::text() const
+{
+    return data->hasCorpus ? data->corpus.data : NULL;
+}
+
+int MarkovModel::suffixWidth() const
+{
+    return data->hasIndex ? data->index.width : 0;
+}
+
+bool MarkovModel::hasLcp() const
+{
+    return data->hasLcp;
+}
+
+bool MarkovModel::hasTable(int order) const
+{
+    const OrderData *entry = findOrder(data, order);
+    return entry != NULL && entry->table != NULL;
+}
+
+bool MarkovModel::tableSize(int order, unsigned int *contexts,
+        unsigned int *transitions) const
+{
+    const OrderData *entry = findOrder(data, order);
+    if (entry == NULL || entry->table == NULL) {
+        return false;
+    }
+    *contexts = entry->table->contextCount;
+    *transitions = entry->table->columnCount;
+    return true;
+}
+
+uint64_t MarkovModel::searchTreeSamples(int order) const
+{
+    const OrderData *entry = findOrder(data, order);
+    return (entry != NULL && entry->tree != NULL) ? entry->tree->count : 0;
+}
+
+bool MarkovModel::wordCount(uint64_t *words, unsigned int *vocabulary) const
+{
+    if (!data->hasWords) {
+        return false;
+    }
+    *words = data->words.count;
+    *vocabulary = data->words.vocabulary;
+    return true;
+}
+
+uint64_t MarkovModel::fmIndexBytes() const
+{
+    if (!data->hasFm) {
+        return 0;
+    }
+    return FM_LEVELS * data->fm.blocks * FM_BLOCK_WORDS * sizeof(uint64_t)
+            + sizeof(FmIndex);
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::bucketUsage
+//
+//      Count the prefix buckets that hold any suffixes, and find the size
+//      of the largest.
+//----------------------------------------------------------------------------
+
+void MarkovModel::bucketUsage(unsigned int *used, uint64_t *largest) const
+{
+    *used = 0;
+    *largest = 0;
+    if (!data->hasIndex) {
+        return;
+    }
+    const uint64_t *buckets = data->index.buckets;
+    for (unsigned int b = 0; b < PREFIX_BUCKETS; ++b) {
+        uint64_t size = buckets[b + 1] - buckets[b];
+        if (size != 0) {
+            ++*used;
+        }
+        if (size > *largest) {
+            *largest = size;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::verify
+//
+//      Check the suffix array order.  Returns the index of the first
+//      out-of-order suffix, or 0 if the array is sorted.
+//----------------------------------------------------------------------------
+
+uint64_t MarkovModel::verify() const
+{
+    if (!data->hasIndex) {
+        return 0;
+    }
+    return verifySuffixArray(data->corpus.data, &data->index);
+}
+
+//----------------------------------------------------------------------------
+// MarkovModel::benchmarkSearch
+//
+//      Time count lookups of order-length prefixes with each search method.
+//      The search tree for the order must have been built.
+//----------------------------------------------------------------------------
+
+bool MarkovModel::benchmarkSearch(int order, int count,
+        unsigned int seed) const
+{
+    const OrderData *entry = findOrder(data, order);
+    if (!data->hasIndex || entry == NULL || entry->tree == NULL) {
+        fprintf(stderr, "markov: no order %d search tree to benchmark.\n",
+                order);
+        return false;
+    }
+    return ::benchmarkSearch(data->corpus.data, &data->index, entry->tree,
+            order, count, seed);
+}
+
+//----------------------------------------------------------------------------
+// MarkovGenerator::MarkovGenerator, MarkovGenerator::init
+//
+//      A generator is unusable until init attaches it to a model that has
+//      been prepared for the order, engine and search method.  init returns
+//      false, with a message, if the model is missing something.
+//----------------------------------------------------------------------------
+
+MarkovGenerator::MarkovGenerator()
+    : input(NULL), inputSize(0), suffixes(NULL), table(NULL),
+      search(SEARCH_BUCKET), tree(NULL), lcp(NULL), words(NULL), fm(NULL),
+      kernels(NULL), engine(ENGINE_TABLE), k(0), backoff(false),
+      random(RANDOM_XOSHIRO)
+{
+}
+
+bool MarkovGenerator::init(const MarkovModel *model, int order,
+        GenerationEngine engine, SearchMethod search, bool backoff,
+        RandomEngine random)
+{
+    const MarkovModelData *data = model->data;
+    if (engine == ENGINE_WORD) {
+        if (!data->hasWords) {
+            fprintf(stderr, "markov: model has no word index.\n");
+            return false;
+        }
+        this->input = data->corpus.data;
+        this->inputSize = data->corpus.size;
+        this->suffixes = NULL;
+        this->table = NULL;
+        this->search = search;
+        this->tree = NULL;
+        this->lcp = NULL;
+        this->words = &data->words;
+        this->fm = NULL;
+        this->engine = engine;
+        this->k = order;
+        this->backoff = backoff;
+        this->random = random;
+        return true;
+    }
+    if ((uint64_t) order > data->corpus.size) {
+        fprintf(stderr, "markov: order %d is longer than the sample text.\n",
+                order);
+        return false;
+    }
+    if (engine == ENGINE_FM) {
+        if (!data->hasFm) {
+            fprintf(stderr, "markov: model has no FM index.\n");
+            return false;
+        }
+        this->input = data->corpus.data;
+        this->inputSize = data->corpus.size;
+        this->suffixes = NULL;
+        this->table = NULL;
+        this->search = search;
+        this->tree = NULL;
+        this->lcp = NULL;
+        this->words = NULL;
+        this->fm = &data->fm;
+        this->engine = engine;
+        this->k = order;
+        this->backoff = backoff;
+        this->random = random;
+        return true;
+    }
+    if (!data->hasIndex) {
+        fprintf(stderr, "markov: model has not been built.\n");
+        return false;
+    }
+    const OrderData *entry = findOrder(data, order);
+    if (engine == ENGINE_TABLE && (entry == NULL || entry->table == NULL)) {
+        fprintf(stderr, "markov: model has no order %d transition table.\n",
+                order);
+        return false;
+    }
+    if (engine == ENGINE_SUFFIX && search == SEARCH_EYTZINGER
+            && (entry == NULL || entry->tree == NULL)) {
+        fprintf(stderr, "markov: model has no order %d search tree.\n",
+                order);
+        return false;
+    }
+    if (backoff && !data->hasLcp) {
+        fprintf(stderr, "markov: model has no LCP array for backoff.\n");
+        return false;
+    }
+
+    this->input = data->corpus.data;
+    this->inputSize = data->corpus.size;
+    this->suffixes = &data->index;
+    this->table = (entry != NULL) ? entry->table : NULL;
+    this->search = search;
+    this->tree = (entry != NULL) ? entry->tree : NULL;
+    this->lcp = data->hasLcp ? &data->lcp : NULL;
+    this->words = NULL;
+    this->fm = NULL;
+
+    // The suffix engine searches with the kernels, and so does the table
+    // engine when it backs off to a context the table does not hold.
+
+    this->kernels = &SCALAR_KERNELS;
+    if (engine == ENGINE_SUFFIX || backoff) {
+        SearchMethod method = (search == SEARCH_EYTZINGER && tree == NULL)
+                ? SEARCH_BUCKET : search;
+        this->kernels = fastestKernels(input, suffixes, tree, method, order);
+    }
+    this->engine = engine;
+    this->k = order;
+    this->backoff = backoff;
+    this->random = random;
+    return true;
+}
+
+int MarkovGenerator::order() const
+{
+    return k;
+}
+
+//----------------------------------------------------------------------------
+// markovSampleSeed
+//
+//      Derive the RNG seed for one sample from the master seed, so that a
+//      sample's output depends only on the master seed and its number, not
+//      on which thread generated it or when.  The mixing is the finalizer
+//      from MurmurHash3, which keeps neighbouring samples from starting on
+//      correlated rand_r streams.
+//----------------------------------------------------------------------------
+
+unsigned int markovSampleSeed(unsigned int seed, int sample)
+{
+    unsigned int h = seed ^ ((unsigned int) sample * 0x9e3779b9u);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+//----------------------------------------------------------------------------
+// spillOutput
+//
+//      Pass all but the last keep bytes of a full output buffer to sink,
+//      and move those to the front to carry on from.  *base counts the
+//      bytes passed on so far.
+//----------------------------------------------------------------------------
+
+static inline void spillOutput(const SampleSink *sink, char *output,
+        size_t *index, size_t *base, size_t keep)
+{
+    size_t spilled = *index - keep;
+    sink->write(sink->context, output, spilled);
+    memmove(output, output + spilled, keep);
+    *base += spilled;
+    *index = keep;
+}
+
+//----------------------------------------------------------------------------
+// nextWord
+//
+//      Draw the token following the j tokens of context from the word
+//      index, adding to the lookup counters in *counts.  With no context,
+//      any token of the input may follow.  Returns -1 if the context has
+//      no successor.
+//----------------------------------------------------------------------------
+
+static inline int64_t nextWord(const WordIndex *words,
+        const uint32_t *context, int j, Random *rng, GenerationStats *counts)
+{
+    int64_t count = words->count;
+    if (j == 0) {
+        return words->tokens[randomBelow(rng, count)];
+    }
+
+    uint64_t u, v;
+    findWordRange(words, context, j, &u, &v, &counts->compares);
+    counts->lookups++;
+    counts->rangeTotal += v - u;
+
+    // As with characters, the suffix that is exactly the last j tokens has
+    // no successor, sorts first, and is skipped.
+
+    if (u < v && count - (int64_t) words->suffixes[u] == j) {
+        ++u;
+    }
+    if (u == v) {
+        return -1;
+    }
+    uint64_t choice = u + randomBelow(rng, v - u);
+    return words->tokens[words->suffixes[choice] + j];
+}
+
+//----------------------------------------------------------------------------
+// generateWords
+//
+//      The word engine's version of MarkovGenerator::generate: the same
+//      walk, but over token numbers, with the context kept as the last K
+//      tokens and each chosen token's text appended to the output.  It
+//      stops before a token that would not fit.  With a sink, the buffer is
+//      emptied into it whenever the next token would not fit, since the
+//      context is kept as tokens rather than text.
+//----------------------------------------------------------------------------
+
+static size_t generateWords(const WordIndex *words, const char *input, int k,
+        bool backoff, char *output, size_t capacity, size_t target,
+        Random *rng, GenerationStats *stats, const SampleSink *sink)
+{
+    if (words == NULL || k < 1 || words->count < (uint64_t) k) {
+        return 0;
+    }
+    GenerationStats counts;
+    memset(&counts, 0, sizeof(counts));
+    size_t limit = target * 2;
+    if (sink == NULL && capacity < limit) {
+        limit = capacity;
+    }
+    int64_t count = words->count;
+
+    // Seed the output with a random sequence of K tokens from the input,
+    // from its first half as the character engines do, but never running
+    // past its end.
+
+    uint64_t seedStart = randomBelow(rng, min(count / 2, count - k + 1));
+    vector<uint32_t> context(words->tokens + seedStart,
+            words->tokens + seedStart + k);
+    size_t index = 0;
+    for (int i = 0; i < k; ++i) {
+        uint32_t token = context[i];
+        if (index + words->length[token] > capacity) {
+            return 0;
+        }
+        memcpy(output + index, input + words->spelling[token],
+                words->length[token]);
+        index += words->length[token];
+    }
+
+    // used is the number of tokens of context the last token was drawn
+    // from; see MarkovGenerator::generate.
+
+    bool done = false;
+    int used = k;
+    size_t base = 0;
+    while (!done && base + index < limit) {
+        int j = (backoff && used < k) ? used + 1 : k;
+        int64_t next = nextWord(words, &context[k - j], j, rng, &counts);
+        while (next < 0 && backoff) {
+            counts.backoffs++;
+            --j;
+            next = nextWord(words, &context[k - j], j, rng, &counts);
+        }
+        if (next < 0) {
+            break;
+        }
+        used = j;
+
+        uint32_t token = (uint32_t) next;
+        uint32_t length = words->length[token];
+        if (base + index + length > limit) {
+            break;
+        }
+        if (index + length > capacity) {
+            if (sink == NULL || length > capacity) {
+                break;
+            }
+            spillOutput(sink, output, &index, &base, 0);
+        }
+        const char *text = input + words->spelling[token];
+        memcpy(output + index, text, length);
+        index += length;
+        if (memchr(text, '\n', length) != NULL && base + index >= target) {
+            done = true;
+        }
+        context.erase(context.begin());
+        context.push_back(token);
+    }
+    if (sink != NULL) {
+        spillOutput(sink, output, &index, &base, 0);
+    }
+
+    if (stats != NULL) {
+        stats->samples++;
+        stats->characters += base + index;
+        stats->lookups += counts.lookups;
+        stats->compares += counts.compares;
+        stats->rangeTotal += counts.rangeTotal;
+        stats->backoffs += counts.backoffs;
+    }
+    return base + index;
+}
+
+//----------------------------------------------------------------------------
+// suffixRangeEnd
+//
+//      Given the first suffix u starting with the j bytes at prefix, return
+//      the index just past the last: from the LCP array if there is one
+//      that covers order j, otherwise by comparing each candidate with the
+//      given kernels, adding the compares to *compares.  Every match lies
+//      before the end of the bucket for the first two characters.
+//----------------------------------------------------------------------------
+
+static inline int64_t suffixRangeEnd(const char *input,
+        const SuffixIndex *suffixes, const LcpIndex *lcp,
+        const PrefixKernels *kernels, const char *prefix, int j, int64_t u,
+        uint64_t *compares)
+{
+    if (lcp != NULL && j <= (int) LCP_MAX) {
+        return lcpRangeEnd(lcp, u, j);
+    }
+    uint64_t bucketStart, bucketEnd;
+    prefixRange(suffixes, prefix, j, &bucketStart, &bucketEnd);
+    uint64_t n = suffixes->count;
+    int64_t v;
+    for (v = u; v < (int64_t) bucketEnd; ++v) {
+        uint64_t offset = suffixAt(suffixes, v);
+        if (comparePrefix(kernels, input + offset, n - offset, prefix,
+                j) != 0) {
+            break;
+        }
+        ++*compares;
+    }
+    return v;
+}
+
+//----------------------------------------------------------------------------
+// MarkovGenerator::nextCharacter
+//
+//      Draw the character following the j bytes at prefix, adding to the
+//      lookup counters in *counts.  A context of the full order uses the
+//      engine's own structure; a shorter one, which only backoff asks for,
+//      is looked up in the suffix array, or the FM-index by the FM engine,
+//      and with no context at all any character of the input may follow.
+//      Returns -1 if the context has no successor.
+//----------------------------------------------------------------------------
+
+int MarkovGenerator::nextCharacter(const char *prefix, int j, Random *rng,
+        GenerationStats *counts) const
+{
+    int64_t size = inputSize;
+    if (j == 0) {
+        return (unsigned char) input[randomBelow(rng, size)];
+    }
+
+    // The FM-index finds the context's rows a backward search step per
+    // byte after the first, and gives up its successors in the order the
+    // suffix array holds them, so the same draw picks the same character.
+
+    if (engine == ENGINE_FM) {
+        const unsigned char *p = (const unsigned char *) prefix;
+        uint64_t lo = fm->first[p[0]];
+        uint64_t hi = fm->first[p[0] + 1];
+        for (int i = 1; i < j && lo < hi; ++i) {
+            fmExtend(fm, p[i], &lo, &hi);
+            counts->compares++;
+        }
+        counts->lookups++;
+        counts->rangeTotal += hi - lo;
+        uint64_t ends = (lo <= fm->primary && fm->primary < hi) ? 1 : 0;
+        if (hi - lo == ends) {
+            return -1;
+        }
+        return fmSuccessor(fm, lo, hi,
+                ends + randomBelow(rng, hi - lo - ends));
+    }
+
+    // With the transition table, the next character is a single lookup
+    // and draw.
+
+    if (engine == ENGINE_TABLE && j == k) {
+        int context = lookupContext(table, input, prefix, &counts->compares);
+        counts->lookups++;
+        if (context < 0) {
+            return -1;
+        }
+        counts->rangeTotal += table->contextFirst[context + 1]
+                - table->contextFirst[context];
+        return sampleTransition(table, context, rng);
+    }
+
+    // Otherwise, search the suffix array for the first suffix with the
+    // prefix, and find where the suffixes with that prefix end.  The
+    // search tree only holds keys for the full order, so shorter contexts
+    // search the buckets instead.
+
+    SearchMethod method = search;
+    if (method == SEARCH_EYTZINGER && (tree == NULL || j != k)) {
+        method = SEARCH_BUCKET;
+    }
+    int64_t u = findFirstSuffix(input, suffixes, tree, method, kernels,
+            prefix, j, &counts->compares);
+    int64_t v = suffixRangeEnd(input, suffixes, lcp, kernels, prefix, j, u,
+            &counts->compares);
+    counts->lookups++;
+    counts->rangeTotal += v - u;
+
+    // If one of the matches is the suffix that starts exactly j characters
+    // from the end of the input, it has no next character.  Being the
+    // shortest, it sorts first, so skip it.
+
+    if (u < v && size - (int64_t) suffixAt(suffixes, u) == j) {
+        ++u;
+    }
+    if (u == v) {
+        return -1;
+    }
+
+    // Of all the suffixes with this prefix, pick one at random, and take
+    // the character after the prefix.
+
+    int64_t choice = u + (int64_t) randomBelow(rng, v - u);
+    return (unsigned char) input[suffixAt(suffixes, choice) + j];
+}
+
+//----------------------------------------------------------------------------
+// MarkovGenerator::generate
+//
+//      Generate one sample of about target characters into output, which
+//      holds capacity bytes, drawing random numbers from the generator's
+//      engine seeded with seed, and adding to *stats if it is not NULL.
+//      Returns the number of characters generated, which is 0 if there is
+//      not room for even the first K.
+//
+//      Without a sink, the sample is whatever fits in output.  With one,
+//      output is only a working buffer: whenever it fills, all but the
+//      last K characters are passed to the sink, and the rest at the end,
+//      so a sample of any length takes capacity bytes, which must be more
+//      than K.
+//----------------------------------------------------------------------------
+
+size_t MarkovGenerator::generate(char *output, size_t capacity, size_t target,
+        unsigned int seed, GenerationStats *stats,
+        const SampleSink *sink) const
+{
+    Random rng;
+    randomSeed(&rng, random, seed);
+    if (engine == ENGINE_WORD) {
+        return generateWords(words, input, k, backoff, output, capacity,
+                target, &rng, stats, sink);
+    }
+    if (input == NULL || capacity < (size_t) k || inputSize < (uint64_t) k
+            || (sink != NULL && capacity == (size_t) k)) {
+        return 0;
+    }
+    GenerationStats counts;
+    memset(&counts, 0, sizeof(counts));
+    size_t limit = target * 2;
+    if (sink == NULL && capacity < limit) {
+        limit = capacity;
+    }
+    int64_t size = inputSize;
+
+    // Seed the output with a random sequence of K characters from the
+    // input, from its first half, but never running past its end.
+
+    uint64_t seedStart = randomBelow(&rng, min(size / 2, size - k + 1));
+    size_t index = 0;
+
+    for (index = 0; index < (size_t) k; ++index) {
+        output[index] = input[index + seedStart];
+    }
+
+    // Now output approximately target characters.  We say approximately
+    // because we will only stop output if we have just written a newline,
+    // to try to guarantee well-formed output.  This means that in general,
+    // we will output more than target characters.
+    //
+    // Without backoff, a context whose only occurrence ends the input has
+    // no successor, and the sample ends there, however short.  With it,
+    // the character is drawn from the longest shorter context that has a
+    // successor instead, PPM style.  used is the length of the context the
+    // last character was drawn from: the output's last used + 1 characters
+    // then occur in the input, so trying that much context next climbs
+    // back to order K a character at a time, and every character but the
+    // rare dead end still costs one lookup.
+
+    bool done = false;
+    int used = k;
+    size_t base = 0;
+    while (!done && base + index < limit) {
+        int j = (backoff && used < k) ? used + 1 : k;
+        int c = nextCharacter(output + index - j, j, &rng, &counts);
+        while (c < 0 && backoff) {
+            counts.backoffs++;
+            --j;
+            c = nextCharacter(output + index - j, j, &rng, &counts);
+        }
+        if (c < 0) {
+            break;
+        }
+        used = j;
+
+        // If this character is a newline and we have output at least
+        // target characters, then we're done.  Otherwise, we loop.
+
+        if (c == '\n' && base + index >= target) {
+            done = true;
+        }
+        if (index == capacity) {
+            spillOutput(sink, output, &index, &base, k);
+        }
+        output[index++] = (char) c;
+    }
+    if (sink != NULL) {
+        spillOutput(sink, output, &index, &base, 0);
+    }
+
+    if (stats != NULL) {
+        stats->samples++;
+        stats->characters += base + index;
+        stats->lookups += counts.lookups;
+        stats->compares += counts.compares;
+        stats->rangeTotal += counts.rangeTotal;
+        stats->backoffs += counts.backoffs;
+    }
+    return base + index;
+}
+
+//----------------------------------------------------------------------------
+// BatchStream
+//
+//      One sample being generated by MarkovGenerator::generateBatch.  Each
+//      stage ends by prefetching what the next one will read, and the
+//      batch advances every stream one stage per round, so one stream's
+//      cache misses are served while the others work.  The stages follow
+//      the chain of dependent loads behind each character: for the suffix
+//      engine, the prefix bucket, a binary search probe of the suffix array
+//      and then the text it points at, the LCP entries ending the range,
+//      and finally the chosen suffix and its next character;
+//      for the table engine, a hash slot, then the context key it names,
+//      then the alias column drawn.
+//----------------------------------------------------------------------------
+
+enum BatchStage {
+    BATCH_BOUNDS,               // Narrow the search.
+    BATCH_PROBE,                // Read suffix m of the search.
+    BATCH_COMPARE,              // Compare its text with the prefix.
+    BATCH_RANGE,                // Find the end of the matches.
+    BATCH_PICK,                 // Read the chosen suffix.
+    BATCH_EMIT,                 // Append the character after it.
+    BATCH_SLOT,                 // Read a hash slot.
+    BATCH_MATCH,                // Compare the slot's context key.
+    BATCH_DRAW,                 // Append the drawn column's character.
+    BATCH_DONE
+};
+
+struct BatchStream {
+    BatchStage      stage;
+    char           *output;
+    size_t          capacity;
+    size_t          index;
+    size_t          base;           // Bytes already passed to sink.
+    const SampleSink *sink;
+    bool            finished;       // Wrote a newline past the target.
+    Random          rng;
+    int64_t         l, u, m;        // Search state; m is the chosen suffix.
+    uint64_t        offset;         // Input offset of suffix m.
+    unsigned int    hash;
+    unsigned int    slot;
+    int             context;
+    unsigned int    column;         // Alias column drawn, and its fraction.
+    unsigned int    fraction;
+};
+
+//----------------------------------------------------------------------------
+// MarkovGenerator::startBatchCharacter
+//
+//      Begin the lookup for a stream's next character, or finish the
+//      stream if it has reached its length.
+//----------------------------------------------------------------------------
+
+void MarkovGenerator::startBatchCharacter(BatchStream *s, size_t limit,
+        GenerationStats *counts) const
+{
+    if (s->finished || s->base + s->index >= limit) {
+        s->stage = BATCH_DONE;
+        return;
+    }
+    const char *prefix = s->output + s->index - k;
+    if (engine == ENGINE_TABLE) {
+        s->hash = hashContext(prefix, k);
+        s->slot = s->hash & table->slotMask;
+        counts->lookups++;
+        __builtin_prefetch(table->slotContext + s->slot);
+        __builtin_prefetch(table->slotHash + s->slot);
+        s->stage = BATCH_SLOT;
+        return;
+    }
+
+    const unsigned char *p = (const unsigned char *) prefix;
+    __builtin_prefetch(suffixes->buckets + p[0] * 257
+            + ((k >= 2) ? p[1] + 1 : 0));
+    s->stage = BATCH_BOUNDS;
+}
+
+//----------------------------------------------------------------------------
+// MarkovGenerator::continueBatchSearch
+//
+//      Take the next step of a stream's binary search for its prefix, or
+//      once it is narrowed to one suffix, fetch what is needed to find the
+//      end of the range.
+//----------------------------------------------------------------------------
+
+void MarkovGenerator::continueBatchSearch(BatchStream *s) const
+{
+    if (s->l + 1 != s->u) {
+        s->m = (s->l + s->u) / 2;
+        __builtin_prefetch(suffixEntry(suffixes, s->m));
+        s->stage = BATCH_PROBE;
+        return;
+    }
+    if (s->u < (int64_t) suffixes->count) {
+        __builtin_prefetch(suffixEntry(suffixes, s->u));
+        if (lcp != NULL) {
+            __builtin_prefetch(lcp->lcp + s->u + 1);
+        }
+    }
+    s->stage = BATCH_RANGE;
+}
+
+//----------------------------------------------------------------------------
+// MarkovGenerator::finishBatchSearch
+//
+//      With the first matching suffix found, find the end of the range as
+//      generate does, and draw one of them, or end the stream at a dead
+//      end.
+//----------------------------------------------------------------------------
+
+void MarkovGenerator::finishBatchSearch(BatchStream *s,
+        GenerationStats *counts) const
+{
+    const char *prefix = s->output + s->index - k;
+    int64_t u = s->u;
+    int64_t v = suffixRangeEnd(input, suffixes, lcp, kernels, prefix, k, u,
+            &counts->compares);
+    counts->lookups++;
+    counts->rangeTotal += v - u;
+    if (u < v && (int64_t) inputSize - (int64_t) suffixAt(suffixes, u) == k) {
+        ++u;
+    }
+    if (u == v) {
+        s->stage = BATCH_DONE;
+        return;
+    }
+    s->m = u + (int64_t) randomBelow(&s->rng, v - u);
+    __builtin_prefetch(suffixEntry(suffixes, s->m));
+    s->stage = BATCH_PICK;
+}
+
+//----------------------------------------------------------------------------
+// MarkovGenerator::advanceBatch
+//
+//      Run one stage of a stream.
+//----------------------------------------------------------------------------
+
+void MarkovGenerator::advanceBatch(BatchStream *s, size_t target,
+        size_t limit, GenerationStats *counts) const
+{
+    switch (s->stage) {
+        case BATCH_BOUNDS: {
+            SearchMethod method = search;
+            if (method == SEARCH_EYTZINGER && tree == NULL) {
+                method = SEARCH_BUCKET;
+            }
+            searchBounds(suffixes, tree, method, s->output + s->index - k, k,
+                    &s->l, &s->u);
+            continueBatchSearch(s);
+            break;
+        }
+
+        case BATCH_PROBE: {
+            s->offset = suffixAt(suffixes, s->m);
+            __builtin_prefetch(input + s->offset);
+            s->stage = BATCH_COMPARE;
+            break;
+        }
+
+        case BATCH_COMPARE: {
+            counts->compares++;
+            if (comparePrefix(kernels, input + s->offset,
+                    inputSize - s->offset, s->output + s->index - k,
+                    k) < 0) {
+                s->l = s->m;
+            } else {
+                s->u = s->m;
+            }
+            continueBatchSearch(s);
+            break;
+        }
+
+        case BATCH_RANGE: {
+            finishBatchSearch(s, counts);
+            break;
+        }
+
+        case BATCH_PICK: {
+            s->offset = suffixAt(suffixes, s->m) + k;
+            __builtin_prefetch(input + s->offset);
+            s->stage = BATCH_EMIT;
+            break;
+        }
+
+        case BATCH_EMIT: {
+            char c = input[s->offset];
+            if (c == '\n' && s->base + s->index >= target) {
+                s->finished = true;
+            }
+            if (s->index == s->capacity) {
+                spillOutput(s->sink, s->output, &s->index, &s->base, k);
+            }
+            s->output[s->index++] = c;
+            startBatchCharacter(s, limit, counts);
+            break;
+        }
+
+        case BATCH_SLOT: {
+            counts->compares++;
+            unsigned int entry = table->slotContext[s->slot];
+            if (entry == 0) {
+                s->stage = BATCH_DONE;
+            } else if (table->slotHash[s->slot] == s->hash) {
+                s->context = entry - 1;
+                __builtin_prefetch(input + table->contextKey[s->context]);
+                __builtin_prefetch(table->contextFirst + s->context);
+                s->stage = BATCH_MATCH;
+            } else {
+                s->slot = (s->slot + 1) & table->slotMask;
+                __builtin_prefetch(table->slotContext + s->slot);
+                __builtin_prefetch(table->slotHash + s->slot);
+            }
+            break;
+        }
+
+        case BATCH_MATCH: {
+            if (memcmp(input + table->contextKey[s->context],
+                    s->output + s->index - k, k) != 0) {
+                s->slot = (s->slot + 1) & table->slotMask;
+                __builtin_prefetch(table->slotContext + s->slot);
+                __builtin_prefetch(table->slotHash + s->slot);
+                s->stage = BATCH_SLOT;
+                break;
+            }
+            unsigned int first = table->contextFirst[s->context];
+            unsigned int columns = table->contextFirst[s->context + 1]
+                    - first;
+            counts->rangeTotal += columns;
+            if (columns == 0) {
+                s->stage = BATCH_DONE;
+                break;
+            }
+            drawColumn(&s->rng, columns, &s->column, &s->fraction);
+            s->column += first;
+            __builtin_prefetch(table->threshold + s->column);
+            __builtin_prefetch(table->symbol + s->column);
+            __builtin_prefetch(table->alias + s->column);
+            s->stage = BATCH_DRAW;
+            break;
+        }
+
+        case BATCH_DRAW: {
+            int c = aliasSymbol(table, s->column, s->fraction);
+            if (c == '\n' && s->base + s->index >= target) {
+                s->finished = true;
+            }
+            if (s->index == s->capacity) {
+                spillOutput(s->sink, s->output, &s->index, &s->base, k);
+            }
+            s->output[s->index++] = (char) c;
+            startBatchCharacter(s, limit, counts);
+            break;
+        }
+
+        case BATCH_DONE: {
+            break;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// MarkovGenerator::generateBatch
+//
+//      Generate count samples at once, sample i into outputs[i] from
+//      seeds[i], passing it to sinks[i] if sinks is not NULL, with its
+//      length left in lengths[i].  Each sample comes out exactly as
+//      generate would make it; the difference is that the
+//      samples advance in lockstep, one load at a time, so that their
+//      cache misses overlap.  Only the table and suffix engines without
+//      backoff are interleaved; the others generate the samples in turn.
+//----------------------------------------------------------------------------
+
+void MarkovGenerator::generateBatch(char *const *outputs, size_t capacity,
+        size_t target, const unsigned int *seeds, size_t *lengths, int count,
+        GenerationStats *stats, const SampleSink *sinks) const
+{
+    if (engine == ENGINE_WORD || engine == ENGINE_FM || backoff) {
+        for (int i = 0; i < count; ++i) {
+            lengths[i] = generate(outputs[i], capacity, target, seeds[i],
+                    stats, (sinks != NULL) ? &sinks[i] : NULL);
+        }
+        return;
+    }
+    if (input == NULL || capacity < (size_t) k || inputSize < (uint64_t) k
+            || (sinks != NULL && capacity == (size_t) k)) {
+        for (int i = 0; i < count; ++i) {
+            lengths[i] = 0;
+        }
+        return;
+    }
+    GenerationStats counts;
+    memset(&counts, 0, sizeof(counts));
+    size_t limit = target * 2;
+    if (sinks == NULL && capacity < limit) {
+        limit = capacity;
+    }
+    int64_t size = inputSize;
+
+    // Seed each output as generate does, and start its first lookup.
+
+    vector<BatchStream> streams(count);
+    for (int i = 0; i < count; ++i) {
+        BatchStream *s = &streams[i];
+        s->output = outputs[i];
+        s->capacity = capacity;
+        s->base = 0;
+        s->sink = (sinks != NULL) ? &sinks[i] : NULL;
+        s->finished = false;
+        randomSeed(&s->rng, random, seeds[i]);
+        uint64_t seedStart = randomBelow(&s->rng,
+                min(size / 2, size - k + 1));
+        memcpy(s->output, input + seedStart, k);
+        s->index = k;
+        startBatchCharacter(s, limit, &counts);
+    }
+
+    int active = count;
+    while (active > 0) {
+        active = 0;
+        for (int i = 0; i < count; ++i) {
+            if (streams[i].stage != BATCH_DONE) {
+                advanceBatch(&streams[i], target, limit, &counts);
+                ++active;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        BatchStream *s = &streams[i];
+        if (s->sink != NULL) {
+            spillOutput(s->sink, s->output, &s->index, &s->base, 0);
+        }
+        lengths[i] = s->base + s->index;
+        counts.samples++;
+        counts.characters += lengths[i];
+    }
+    if (stats != NULL) {
+        stats->samples += counts.samples;
+        stats->characters += counts.characters;
+        stats->lookups += counts.lookups;
+        stats->compares += counts.compares;
+        stats->rangeTotal += counts.rangeTotal;
+    }
+}
@@ -0,0 +1,257 @@
+// markov.h --
+//
+// Interface to the character level markov text generation library.  A
+// MarkovModel holds sample text, its suffix array and whatever per-order
+// structures generation needs; a MarkovGenerator draws samples of a given
+// order from a model into caller-supplied buffers.
+//
+// A model is built or loaded, and prepared for the orders and engines it
+// will serve, by one thread.  From then on it is only read, so any number
+// of threads may generate from it at once, with one MarkovGenerator each
+// or sharing one: generate() keeps all of its state on the stack.
+//
+// There is no global state.  Errors are reported with a message on stderr
+// and a false (or 0) return.
+//
+// Copyright (c) 2004-2009 Electric Cloud, Inc.
+// All rights reserved.
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Electric Cloud nor the names of its employees may
+//       be used to endorse or promote products derived from this software
+//       without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef MARKOV_H
+#define MARKOV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Suffix array construction algorithms.
+
+enum SuffixAlgorithm {
+    SA_ALGO_QSORT,
+    SA_ALGO_SAIS,
+    SA_ALGO_PARALLEL
+};
+
+// How the suffix engine finds the first suffix matching a prefix.
+
+enum SearchMethod {
+    SEARCH_BINARY,
+    SEARCH_BUCKET,
+    SEARCH_EYTZINGER
+};
+
+// Generation engines.  ENGINE_WORD generates a word at a time, with the
+// order counted in words.  ENGINE_FM draws what ENGINE_SUFFIX would, from
+// an FM-index under a third the size of the suffix array.
+
+enum GenerationEngine {
+    ENGINE_TABLE,
+    ENGINE_SUFFIX,
+    ENGINE_WORD,
+    ENGINE_FM
+};
+
+// Random number engines.  RANDOM_RAND_R is the C library's rand_r, which
+// reproduces the samples of earlier versions; the others are much faster
+// and draw bounded numbers without bias.
+
+enum RandomEngine {
+    RANDOM_XOSHIRO,
+    RANDOM_PCG,
+    RANDOM_RAND_R
+};
+
+//----------------------------------------------------------------------------
+// GenerationStats
+//
+//      Counters added to by MarkovGenerator::generate.  A lookup is one
+//      search for the next character (or word): compares counts the prefix
+//      compares of the suffix engine, the hash slots probed by the table
+//      engine, the token sequence comparisons of the word engine or the
+//      backward search steps of the FM engine, and rangeTotal the matching
+//      suffixes or distinct successors found.  backoffs counts the lookups
+//      that found no successor and fell back to a shorter context.
+//      sampleMicros is left for the caller to fill in, if it times
+//      samples.
+//----------------------------------------------------------------------------
+
+struct GenerationStats {
+    uint64_t        samples;
+    uint64_t        characters;
+    uint64_t        lookups;
+    uint64_t        compares;
+    uint64_t        rangeTotal;
+    uint64_t        backoffs;
+    uint64_t        sampleMicros;   // Wall time spent inside samples.
+};
+
+//----------------------------------------------------------------------------
+// SampleSink
+//
+//      Where MarkovGenerator::generate can pass a sample's text as it is
+//      made, a piece at a time, instead of keeping all of it: write is
+//      called with context and each piece in order.
+//----------------------------------------------------------------------------
+
+struct SampleSink {
+    void          (*write)(void *context, const char *data, size_t length);
+    void           *context;
+};
+
+struct MarkovModelData;
+struct SuffixIndex;
+struct SearchTree;
+struct LcpIndex;
+struct TransitionTable;
+struct WordIndex;
+struct FmIndex;
+struct PrefixKernels;
+struct BatchStream;
+struct Random;
+
+//----------------------------------------------------------------------------
+// MarkovModel
+//
+//      Sample text and the indexes built over it.  The text comes from
+//      readFile, readStream (either of which decompresses gzip or zstd
+//      text, on a thread of its own) or setText and is indexed by
+//      buildIndex (build does both for text in memory), or the whole model
+//      comes from a file written by save or by buildIndexFile, which sorts
+//      out of core for text too big to index in memory.  append and
+//      appendFile add text to an indexed model, sorting only the suffixes
+//      that it moves.
+//      buildLcp, buildTable, buildSearchTree, buildWords and buildFmIndex
+//      add the structures the engines need; prepare adds whichever ones a
+//      given order, engine and search method use, and with backoff the LCP
+//      index the shorter contexts are looked up with.  The word and FM
+//      engines need only the text, not the character index.  None of these
+//      may run while another thread is generating from the model.
+//----------------------------------------------------------------------------
+
+class MarkovModel {
+public:
+    MarkovModel();
+    ~MarkovModel();
+
+    bool readFile(const char *path, uint64_t maxBytes);
+    bool readStream(int fd, uint64_t maxBytes);
+    bool setText(const char *text, uint64_t size);
+    bool buildIndex(SuffixAlgorithm algorithm, int threads);
+    bool buildIndexFile(const char *path, uint64_t memoryBytes);
+    bool append(const char *text, uint64_t size);
+    bool appendFile(const char *path, uint64_t maxBytes);
+    bool build(const char *text, uint64_t size, SuffixAlgorithm algorithm,
+            int threads);
+
+    bool load(const char *path);
+    bool save(const char *path, int tableOrder) const;
+
+    bool buildLcp();
+    bool buildTable(int order);
+    bool buildSearchTree(int order);
+    bool buildWords();
+    bool buildFmIndex();
+    bool prepare(int order, GenerationEngine engine, SearchMethod search,
+            bool backoff);
+
+    uint64_t size() const;
+    const char *text() const;
+    int suffixWidth() const;
+    bool hasLcp() const;
+    bool hasTable(int order) const;
+    bool tableSize(int order, unsigned int *contexts,
+            unsigned int *transitions) const;
+    uint64_t searchTreeSamples(int order) const;
+    bool wordCount(uint64_t *words, unsigned int *vocabulary) const;
+    uint64_t fmIndexBytes() const;
+    void bucketUsage(unsigned int *used, uint64_t *largest) const;
+    uint64_t verify() const;
+    bool benchmarkSearch(int order, int count, unsigned int seed) const;
+
+private:
+    MarkovModel(const MarkovModel &);
+    MarkovModel &operator=(const MarkovModel &);
+
+    MarkovModelData *data;
+
+    friend class MarkovGenerator;
+};
+
+//----------------------------------------------------------------------------
+// MarkovGenerator
+//
+//      Generates samples of one order from a model with one engine, drawing
+//      from a random number engine seeded afresh for each sample.  init
+//      fails if the model has not been prepared for them.  With backoff, a
+//      context with no successor falls back to shorter ones, down to a
+//      single character, instead of ending the sample.  generateBatch
+//      makes several samples at once, interleaving their memory accesses;
+//      each comes out as generate would make it.  Given a sink, either one
+//      streams each sample through its output buffer, so a sample can be
+//      longer than the buffer.  Both are const and reentrant.
+//----------------------------------------------------------------------------
+
+class MarkovGenerator {
+public:
+    MarkovGenerator();
+
+    bool init(const MarkovModel *model, int order, GenerationEngine engine,
+            SearchMethod search, bool backoff, RandomEngine random);
+    size_t generate(char *output, size_t capacity, size_t target,
+            unsigned int seed, GenerationStats *stats,
+            const SampleSink *sink) const;
+    void generateBatch(char *const *outputs, size_t capacity, size_t target,
+            const unsigned int *seeds, size_t *lengths, int count,
+            GenerationStats *stats, const SampleSink *sinks) const;
+    int order() const;
+
+private:
+    int nextCharacter(const char *prefix, int order, Random *rng,
+            GenerationStats *counts) const;
+    void startBatchCharacter(BatchStream *stream, size_t limit,
+            GenerationStats *counts) const;
+    void continueBatchSearch(BatchStream *stream) const;
+    void finishBatchSearch(BatchStream *stream, GenerationStats *counts) const;
+    void advanceBatch(BatchStream *stream, size_t target, size_t limit,
+            GenerationStats *counts) const;
+
+    const char             *input;
+    uint64_t                inputSize;
+    const SuffixIndex      *suffixes;
+    const TransitionTable  *table;      // Only used with ENGINE_TABLE.
+    SearchMethod            search;     // Only used with ENGINE_SUFFIX.
+    const SearchTree       *tree;       // Only used with SEARCH_EYTZINGER.
+    const LcpIndex         *lcp;        // NULL to find ranges by comparing.
+    const WordIndex        *words;      // Only used with ENGINE_WORD.
+    const FmIndex          *fm;         // Only used with ENGINE_FM.
+    const PrefixKernels    *kernels;    // Fastest prefix compares, timed.
+    GenerationEngine        engine;
+    int                     k;
+    bool                    backoff;
+    RandomEngine            random;
+};
+
+unsigned int markovSampleSeed(unsigned int seed, int sample);
+
+#endif
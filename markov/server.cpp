@@ -0,0 +1,627 @@
+// server.cpp --
+//
+// This file implements markov's --serve daemon and its --client stub, as
+// described in server.h.  The main thread accepts connections and hands
+// them to a fixed pool of worker threads through a bounded queue; when the
+// queue is full, new connections are turned away at once rather than left
+// to pile up.  Every request is timed from accept to last byte written,
+// split into the time it waited in the queue and the time a worker spent
+// on it.
+//
+// Copyright (c) 2004-2009 Electric Cloud, Inc.
+// All rights reserved.
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Electric Cloud nor the names of its employees may
+//       be used to endorse or promote products derived from this software
+//       without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "server.h"
+#include "writer.h"
+
+using namespace std;
+
+// Limits on a single request, so that one client cannot tie up a worker or
+// its memory indefinitely.
+
+static const int SERVER_MAX_CHARS = 1 << 24;
+static const int SERVER_MAX_SAMPLES = 1024;
+static const int SERVER_REQUEST_BYTES = 256;
+static const int SERVER_TIMEOUT_SECONDS = 10;
+
+// Latencies are kept in power-of-two histograms of microseconds.
+
+static const int LATENCY_BUCKETS = 40;
+
+//----------------------------------------------------------------------------
+// LatencyHistogram
+//
+//      Counts of latencies in [2^(b-1), 2^b) microseconds for bucket b, with
+//      bucket 0 holding latencies under a microsecond.  Percentiles are
+//      reported as the upper bound of the bucket they fall in, which is
+//      within a factor of two and costs nothing to record.
+//----------------------------------------------------------------------------
+
+struct LatencyHistogram {
+    uint64_t        counts[LATENCY_BUCKETS];
+    uint64_t        total;
+    uint64_t        maxMicros;
+};
+
+static void recordLatency(LatencyHistogram *histogram, uint64_t micros)
+{
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && (1ull << bucket) <= micros) {
+        ++bucket;
+    }
+    histogram->counts[bucket]++;
+    histogram->total++;
+    if (micros > histogram->maxMicros) {
+        histogram->maxMicros = micros;
+    }
+}
+
+static uint64_t latencyPercentile(const LatencyHistogram *histogram,
+        double fraction)
+{
+    uint64_t wanted = (uint64_t) (histogram->total * fraction);
+    uint64_t seen = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+        seen += histogram->counts[b];
+        if (seen > wanted) {
+            uint64_t bound = 1ull << b;
+            return (bound < histogram->maxMicros) ? bound
+                    : histogram->maxMicros;
+        }
+    }
+    return histogram->maxMicros;
+}
+
+//----------------------------------------------------------------------------
+// PendingConnection, Server
+//
+//      A connection waiting for a worker, and the state the workers share:
+//      the circular queue of pending connections, and the counters and
+//      latency histograms, all guarded by one mutex.
+//----------------------------------------------------------------------------
+
+struct PendingConnection {
+    int             fd;
+    struct timeval  accepted;
+};
+
+struct Server {
+    const MarkovGenerator      *generators; // One per order served.
+    int                         orders;
+    const ServerConfig         *config;
+
+    pthread_mutex_t             lock;
+    pthread_cond_t              ready;
+    vector<PendingConnection>   queue;
+    int                         head;       // Next connection to serve.
+    int                         queued;
+    bool                        stopping;
+
+    uint64_t                    requests;
+    uint64_t                    rejected;   // Turned away, queue full.
+    uint64_t                    errors;     // Bad requests.
+    uint64_t                    characters;
+    LatencyHistogram            wait;       // Accept to worker pickup.
+    LatencyHistogram            service;    // Pickup to last byte sent.
+};
+
+// Set from the signal handler to stop accepting connections.
+
+static volatile sig_atomic_t sStopServer = 0;
+
+static void stopServer(int)
+{
+    sStopServer = 1;
+}
+
+static uint64_t microsBetween(const struct timeval *begin,
+        const struct timeval *end)
+{
+    return (end->tv_sec - begin->tv_sec) * 1000000ll
+            + (end->tv_usec - begin->tv_usec);
+}
+
+//----------------------------------------------------------------------------
+// writeAll, readLine, readAll
+//
+//      Write all of buffer to fd, retrying short writes; read one line of
+//      at most size - 1 bytes from fd, without its newline, into line; and
+//      read exactly length bytes.  All return false if the peer goes away
+//      or times out.
+//----------------------------------------------------------------------------
+
+static bool writeAll(int fd, const char *buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t wrote = write(fd, buffer, length);
+        if (wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer += wrote;
+        length -= wrote;
+    }
+    return true;
+}
+
+static bool readLine(int fd, char *line, size_t size)
+{
+    size_t length = 0;
+    while (length + 1 < size) {
+        ssize_t got = read(fd, line + length, 1);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        if (line[length] == '\n') {
+            line[length] = 0;
+            return true;
+        }
+        ++length;
+    }
+    return false;
+}
+
+static bool readAll(int fd, char *buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t got = read(fd, buffer, length);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            return false;
+        }
+        buffer += got;
+        length -= got;
+    }
+    return true;
+}
+
+static void sendError(int fd, const char *message)
+{
+    char line[SERVER_REQUEST_BYTES];
+    snprintf(line, sizeof(line), "error %s\n", message);
+    writeAll(fd, line, strlen(line));
+}
+
+//----------------------------------------------------------------------------
+// sendStats
+//
+//      Answer a "stats" request with the counters and the wait and service
+//      latency percentiles, one "name value" pair per line.  The percentile
+//      names end in "_le_us" since each is the upper bound of its histogram
+//      bucket, not an exact latency.
+//----------------------------------------------------------------------------
+
+static void sendStats(Server *server, int fd)
+{
+    char text[1024];
+    pthread_mutex_lock(&server->lock);
+    snprintf(text, sizeof(text),
+            "requests %llu\nrejected %llu\nerrors %llu\ncharacters %llu\n"
+            "queued %d\n"
+            "wait_p50_le_us %llu\nwait_p99_le_us %llu\nwait_max_us %llu\n"
+            "service_p50_le_us %llu\nservice_p90_le_us %llu\n"
+            "service_p99_le_us %llu\nservice_max_us %llu\n",
+            (unsigned long long) server->requests,
+            (unsigned long long) server->rejected,
+            (unsigned long long) server->errors,
+            (unsigned long long) server->characters,
+            server->queued,
+            (unsigned long long) latencyPercentile(&server->wait, 0.5),
+            (unsigned long long) latencyPercentile(&server->wait, 0.99),
+            (unsigned long long) server->wait.maxMicros,
+            (unsigned long long) latencyPercentile(&server->service, 0.5),
+            (unsigned long long) latencyPercentile(&server->service, 0.9),
+            (unsigned long long) latencyPercentile(&server->service, 0.99),
+            (unsigned long long) server->service.maxMicros);
+    pthread_mutex_unlock(&server->lock);
+    writeAll(fd, text, strlen(text));
+}
+
+//----------------------------------------------------------------------------
+// serveConnection
+//
+//      Read one request from fd and answer it.  Returns the number of
+//      characters generated, or -1 if the request was bad.
+//----------------------------------------------------------------------------
+
+static int64_t serveConnection(Server *server, int fd, vector<char> *output)
+{
+    char request[SERVER_REQUEST_BYTES];
+    if (!readLine(fd, request, sizeof(request))) {
+        return -1;
+    }
+    if (strcmp(request, "stats") == 0) {
+        sendStats(server, fd);
+        return 0;
+    }
+
+    int order, size, count;
+    unsigned int seed;
+    if (sscanf(request, "generate %d %d %u %d", &order, &size, &seed,
+            &count) != 4) {
+        sendError(fd, "bad request");
+        return -1;
+    }
+    const MarkovGenerator *generator = NULL;
+    for (int i = 0; i < server->orders; ++i) {
+        if (order == 0 || server->generators[i].order() == order) {
+            generator = &server->generators[i];
+            order = generator->order();
+            break;
+        }
+    }
+    if (size == 0) {
+        size = server->config->outputChars;
+    }
+    if (generator == NULL) {
+        sendError(fd, "order not served");
+        return -1;
+    }
+    if (size < 0 || size > SERVER_MAX_CHARS || count < 0
+            || count > SERVER_MAX_SAMPLES) {
+        sendError(fd, "request too large");
+        return -1;
+    }
+
+    size_t capacity = (size_t) size * 2;
+    if (capacity < (size_t) order) {
+        capacity = order;
+    }
+    if (output->size() < capacity) {
+        output->resize(capacity);
+    }
+
+    char line[64];
+    sprintf(line, "ok %d\n", count);
+    if (!writeAll(fd, line, strlen(line))) {
+        return 0;
+    }
+    int64_t total = 0;
+    for (int i = 0; i < count; ++i) {
+        size_t length = generator->generate(&(*output)[0], capacity, size,
+                markovSampleSeed(seed, i), NULL, NULL);
+        sprintf(line, "%llu\n", (unsigned long long) length);
+        if (!writeAll(fd, line, strlen(line))
+                || !writeAll(fd, &(*output)[0], length)) {
+            break;
+        }
+        total += length;
+    }
+    return total;
+}
+
+//----------------------------------------------------------------------------
+// serverWorker
+//
+//      Thread body: take connections off the queue until the server stops
+//      and the queue is empty, answering each and recording its latency.
+//----------------------------------------------------------------------------
+
+static void *serverWorker(void *arg)
+{
+    Server *server = (Server *) arg;
+    vector<char> output;
+
+    for (;;) {
+        pthread_mutex_lock(&server->lock);
+        while (server->queued == 0 && !server->stopping) {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        if (server->queued == 0) {
+            pthread_mutex_unlock(&server->lock);
+            break;
+        }
+        PendingConnection pending = server->queue[server->head];
+        server->head = (server->head + 1) % server->queue.size();
+        server->queued--;
+        pthread_mutex_unlock(&server->lock);
+
+        struct timeval begin, end;
+        gettimeofday(&begin, 0);
+        int64_t characters = serveConnection(server, pending.fd, &output);
+        close(pending.fd);
+        gettimeofday(&end, 0);
+
+        uint64_t waited = microsBetween(&pending.accepted, &begin);
+        uint64_t served = microsBetween(&begin, &end);
+        fprintf(stderr, "markov: request %s, %lld characters, waited %llu "
+                "us, served in %llu us.\n", (characters < 0) ? "failed"
+                : "done", (long long) ((characters < 0) ? 0 : characters),
+                (unsigned long long) waited, (unsigned long long) served);
+        pthread_mutex_lock(&server->lock);
+        server->requests++;
+        if (characters < 0) {
+            server->errors++;
+        } else {
+            server->characters += characters;
+        }
+        recordLatency(&server->wait, waited);
+        recordLatency(&server->service, served);
+        pthread_mutex_unlock(&server->lock);
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// runServer
+//
+//      Listen on config->path and answer requests for the orders of the
+//      given generators, the first being the default, until SIGINT or
+//      SIGTERM; then finish the queued requests, remove the socket, report
+//      the counters and latencies on stderr, and return the exit status.
+//----------------------------------------------------------------------------
+
+int runServer(const MarkovGenerator *generators, int orders,
+        const ServerConfig *config)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(config->path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "markov: socket path %s is too long.\n",
+                config->path);
+        return 1;
+    }
+    strcpy(address.sun_path, config->path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "markov: unable to create socket: %s.\n",
+                strerror(errno));
+        return 1;
+    }
+    unlink(config->path);
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0
+            || listen(listener, config->queueSize) != 0) {
+        fprintf(stderr, "markov: unable to listen on %s: %s.\n",
+                config->path, strerror(errno));
+        close(listener);
+        return 1;
+    }
+
+    Server server;
+    server.generators = generators;
+    server.orders = orders;
+    server.config = config;
+    pthread_mutex_init(&server.lock, 0);
+    pthread_cond_init(&server.ready, 0);
+    server.queue.resize(config->queueSize);
+    server.head = 0;
+    server.queued = 0;
+    server.stopping = false;
+    server.requests = 0;
+    server.rejected = 0;
+    server.errors = 0;
+    server.characters = 0;
+    memset(&server.wait, 0, sizeof(server.wait));
+    memset(&server.service, 0, sizeof(server.service));
+
+    // Only this thread takes the stop signals, so that they interrupt
+    // accept; a client hanging up mid-reply must not kill the server.
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, 0);
+    sigaction(SIGTERM, &action, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    sigset_t stops, previous;
+    sigemptyset(&stops);
+    sigaddset(&stops, SIGINT);
+    sigaddset(&stops, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stops, &previous);
+    vector<pthread_t> workers(config->threads);
+    int started = 0;
+    for (; started < config->threads; ++started) {
+        if (pthread_create(&workers[started], 0, serverWorker, &server)
+                != 0) {
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, 0);
+    if (started == 0) {
+        fprintf(stderr, "markov: unable to start server threads.\n");
+        close(listener);
+        unlink(config->path);
+        return 1;
+    }
+
+    fprintf(stderr, "markov: serving %d order%s on %s with %d threads.\n",
+            orders, (orders == 1) ? "" : "s", config->path, started);
+
+    struct timeval timeout = { SERVER_TIMEOUT_SECONDS, 0 };
+    while (!sStopServer) {
+        int fd = accept(listener, 0, 0);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                fprintf(stderr, "markov: accept failed: %s.\n",
+                        strerror(errno));
+                break;
+            }
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        PendingConnection pending;
+        pending.fd = fd;
+        gettimeofday(&pending.accepted, 0);
+
+        pthread_mutex_lock(&server.lock);
+        bool full = (server.queued == (int) server.queue.size());
+        if (full) {
+            server.rejected++;
+        } else {
+            int tail = (server.head + server.queued) % server.queue.size();
+            server.queue[tail] = pending;
+            server.queued++;
+            pthread_cond_signal(&server.ready);
+        }
+        pthread_mutex_unlock(&server.lock);
+
+        if (full) {
+            sendError(fd, "busy");
+            close(fd);
+        }
+    }
+
+    fprintf(stderr, "markov: stopping server.\n");
+    close(listener);
+    unlink(config->path);
+
+    pthread_mutex_lock(&server.lock);
+    server.stopping = true;
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.lock);
+    for (int i = 0; i < started; ++i) {
+        pthread_join(workers[i], 0);
+    }
+
+    fprintf(stderr, "markov: served %llu requests (%llu bad), turned away "
+            "%llu.\n", (unsigned long long) server.requests,
+            (unsigned long long) server.errors,
+            (unsigned long long) server.rejected);
+    fprintf(stderr, "markov: wait p50 <= %llu us, p99 <= %llu us; service "
+            "p50 <= %llu us, p90 <= %llu us, p99 <= %llu us, max %llu us.\n",
+            (unsigned long long) latencyPercentile(&server.wait, 0.5),
+            (unsigned long long) latencyPercentile(&server.wait, 0.99),
+            (unsigned long long) latencyPercentile(&server.service, 0.5),
+            (unsigned long long) latencyPercentile(&server.service, 0.9),
+            (unsigned long long) latencyPercentile(&server.service, 0.99),
+            (unsigned long long) server.service.maxMicros);
+
+    pthread_mutex_destroy(&server.lock);
+    pthread_cond_destroy(&server.ready);
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// runClient
+//
+//      Ask the server on path for count samples and write them to the
+//      files a local run would, named by sampleFileName.  An order or
+//      outputChars of 0 leaves the choice to the server.  Returns the exit
+//      status.
+//----------------------------------------------------------------------------
+
+int runClient(const char *path, int order, bool perOrder, int outputChars,
+        unsigned int seed, int count)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "markov: socket path %s is too long.\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address,
+            sizeof(address)) != 0) {
+        fprintf(stderr, "markov: unable to connect to %s: %s.\n", path,
+                strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+
+    struct timeval begin, end;
+    gettimeofday(&begin, 0);
+    char line[SERVER_REQUEST_BYTES];
+    snprintf(line, sizeof(line), "generate %d %d %u %d\n", order,
+            outputChars, seed, count);
+    int answered;
+    if (!writeAll(fd, line, strlen(line))
+            || !readLine(fd, line, sizeof(line))) {
+        fprintf(stderr, "markov: no reply from %s.\n", path);
+        close(fd);
+        return 1;
+    }
+    if (sscanf(line, "ok %d", &answered) != 1 || answered != count) {
+        fprintf(stderr, "markov: server replied \"%s\".\n", line);
+        close(fd);
+        return 1;
+    }
+
+    vector<char> output;
+    for (int i = 0; i < count; ++i) {
+        unsigned long long length;
+        if (!readLine(fd, line, sizeof(line))
+                || sscanf(line, "%llu", &length) != 1
+                || length > 2ull * SERVER_MAX_CHARS + 1) {
+            fprintf(stderr, "markov: bad reply from %s.\n", path);
+            close(fd);
+            return 1;
+        }
+        output.resize(length + 1);
+        if (!readAll(fd, &output[0], length)) {
+            fprintf(stderr, "markov: reply from %s cut short.\n", path);
+            close(fd);
+            return 1;
+        }
+
+        char filename[32];
+        sampleFileName(filename, order, perOrder, i);
+        FILE *f = fopen(filename, "w");
+        if (f == NULL) {
+            fprintf(stderr, "markov: unable to create %s.\n", filename);
+            close(fd);
+            return 1;
+        }
+        fwrite(&output[0], 1, length, f);
+        fclose(f);
+    }
+    close(fd);
+    gettimeofday(&end, 0);
+
+    fprintf(stderr, "markov: %d samples from %s in %.3f ms.\n", count, path,
+            microsBetween(&begin, &end) / 1000.0);
+    return 0;
+}
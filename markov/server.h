@@ -0,0 +1,70 @@
+// server.h --
+//
+// The markov generation server and its client.  The server owns a built
+// model and answers requests for samples over a Unix domain socket, so
+// that the suffix array is sorted once rather than on every run.
+//
+// The protocol is one request per connection.  The client sends a line
+//
+//      generate ORDER SIZE SEED COUNT
+//
+// where an ORDER or SIZE of 0 asks for the server's default (its first
+// order, when it serves several), and the server replies "ok COUNT", then
+// for each sample a line holding its length followed by that many bytes of
+// text.  Sample i is seeded from SEED and i exactly as markov seeds
+// output.i, so a client run reproduces a local one.
+// The request "stats" returns the server's counters and latency
+// percentiles as lines of text.  Any failure is answered with a single
+// line "error MESSAGE".
+//
+// Copyright (c) 2004-2009 Electric Cloud, Inc.
+// All rights reserved.
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Electric Cloud nor the names of its employees may
+//       be used to endorse or promote products derived from this software
+//       without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef MARKOV_SERVER_H
+#define MARKOV_SERVER_H
+
+#include "markov.h"
+
+//----------------------------------------------------------------------------
+// ServerConfig
+//
+//      How to run the server: where to listen, how many worker threads and
+//      queued connections to allow, and what to generate by default.
+//----------------------------------------------------------------------------
+
+struct ServerConfig {
+    const char     *path;           // Socket to create.
+    int             threads;        // Worker threads.
+    int             queueSize;      // Connections waiting for a worker.
+    int             outputChars;    // Default sample size.
+};
+
+int runServer(const MarkovGenerator *generators, int orders,
+        const ServerConfig *config);
+int runClient(const char *path, int order, bool perOrder, int outputChars,
+        unsigned int seed, int count);
+
+#endif
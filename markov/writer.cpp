@@ -0,0 +1,381 @@
+// writer.cpp --
+//
+// This file implements markov's output writer, as described in writer.h.
+// Workers copy each chunk into the writer's queue and go back to
+// generating; the writer thread takes everything queued at once and writes
+// it out, with one writev for a whole run of records on a stream.  The
+// queue is bounded in bytes, not chunks, so memory stays bounded however
+// long the samples are.
+//
+// Copyright (c) 2004-2009 Electric Cloud, Inc.
+// All rights reserved.
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Electric Cloud nor the names of its employees may
+//       be used to endorse or promote products derived from this software
+//       without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "writer.h"
+
+using namespace std;
+
+//----------------------------------------------------------------------------
+// OutputChunk, OutputWriter
+//
+//      A piece of a sample waiting to be written, or with no data, the end
+//      of the sample; and the writer: where it writes, the queue of chunks
+//      and the bytes they hold, guarded by one mutex, and the files of the
+//      samples under way, which only the writer thread touches.
+//----------------------------------------------------------------------------
+
+struct OutputChunk {
+    string          name;
+    char           *data;           // NULL at the end of a sample.
+    size_t          length;
+};
+
+struct OutputWriter {
+    int                     fd;         // Stream, or -1 for files.
+    size_t                  queueBytes;
+
+    pthread_t               thread;
+    pthread_mutex_t         lock;
+    pthread_cond_t          ready;      // Chunks queued, or stopping.
+    pthread_cond_t          space;      // Queued bytes written.
+    vector<OutputChunk>     queue;
+    size_t                  queued;     // Bytes queued or being written.
+    bool                    stopping;
+
+    map<string, int>        files;      // Sample name to fd, -1 if failed.
+    bool                    failed;
+};
+
+// Records per writev, within the usual IOV_MAX of 1024.
+
+static const size_t WRITER_RECORDS = 512;
+
+//----------------------------------------------------------------------------
+// writeAll, writeVector
+//
+//      Write all of buffer, or all of count iovecs, to fd, retrying short
+//      writes.  writeVector advances vector past what it has written.  Both
+//      return false on an error, leaving it in errno.
+//----------------------------------------------------------------------------
+
+static bool writeAll(int fd, const char *buffer, size_t length)
+{
+    while (length > 0) {
+        ssize_t wrote = write(fd, buffer, length);
+        if (wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buffer += wrote;
+        length -= wrote;
+    }
+    return true;
+}
+
+static bool writeVector(int fd, struct iovec *vector, int count)
+{
+    while (count > 0) {
+        ssize_t wrote = writev(fd, vector, count);
+        if (wrote < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        while (count > 0 && (size_t) wrote >= vector->iov_len) {
+            wrote -= vector->iov_len;
+            ++vector;
+            --count;
+        }
+        if (count > 0) {
+            vector->iov_base = (char *) vector->iov_base + wrote;
+            vector->iov_len -= wrote;
+        }
+    }
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// writeRecords
+//
+//      Write chunks to the writer's stream as records, WRITER_RECORDS at a
+//      time.  After an error nothing more is written.
+//----------------------------------------------------------------------------
+
+static void writeRecords(OutputWriter *writer,
+        const vector<OutputChunk> &chunks)
+{
+    char headers[WRITER_RECORDS][64];
+    struct iovec vector[2 * WRITER_RECORDS];
+
+    for (size_t first = 0; first < chunks.size() && !writer->failed;
+            first += WRITER_RECORDS) {
+        int count = 0;
+        for (size_t i = first; i < chunks.size()
+                && i < first + WRITER_RECORDS; ++i) {
+            char *header = headers[i - first];
+            int length = snprintf(header, sizeof(headers[0]), "%s %llu\n",
+                    chunks[i].name.c_str(),
+                    (unsigned long long) chunks[i].length);
+            vector[count].iov_base = header;
+            vector[count].iov_len = length;
+            vector[count + 1].iov_base = chunks[i].data;
+            vector[count + 1].iov_len = chunks[i].length;
+            count += 2;
+        }
+        if (!writeVector(writer->fd, vector, count)) {
+            fprintf(stderr, "markov: error writing output: %s.\n",
+                    strerror(errno));
+            writer->failed = true;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// writeFiles
+//
+//      Write chunks to their samples' files, creating each file at its
+//      sample's first chunk and closing it at its end, so an empty sample
+//      still leaves an empty file.  A sample whose file fails is dropped.
+//----------------------------------------------------------------------------
+
+static void writeFiles(OutputWriter *writer,
+        const vector<OutputChunk> &chunks)
+{
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        const OutputChunk *chunk = &chunks[i];
+        const char *name = chunk->name.c_str();
+        map<string, int>::iterator file = writer->files.find(chunk->name);
+        if (file == writer->files.end()) {
+            int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0) {
+                fprintf(stderr, "markov: unable to create %s.\n", name);
+                writer->failed = true;
+            }
+            file = writer->files.insert(make_pair(chunk->name, fd)).first;
+        }
+        if (file->second >= 0 && chunk->data != NULL
+                && !writeAll(file->second, chunk->data, chunk->length)) {
+            fprintf(stderr, "markov: error writing %s: %s.\n", name,
+                    strerror(errno));
+            writer->failed = true;
+            close(file->second);
+            file->second = -1;
+        }
+        if (chunk->data == NULL) {
+            if (file->second >= 0 && close(file->second) != 0) {
+                fprintf(stderr, "markov: error writing %s: %s.\n", name,
+                        strerror(errno));
+                writer->failed = true;
+            }
+            writer->files.erase(file);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// writerThread
+//
+//      Thread body: take everything queued, write it, free it, and let
+//      waiting workers queue more, until stopped with the queue empty.
+//----------------------------------------------------------------------------
+
+static void *writerThread(void *arg)
+{
+    OutputWriter *writer = (OutputWriter *) arg;
+    vector<OutputChunk> chunks;
+
+    for (;;) {
+        pthread_mutex_lock(&writer->lock);
+        while (writer->queue.empty() && !writer->stopping) {
+            pthread_cond_wait(&writer->ready, &writer->lock);
+        }
+        if (writer->queue.empty()) {
+            pthread_mutex_unlock(&writer->lock);
+            break;
+        }
+        chunks.swap(writer->queue);
+        pthread_mutex_unlock(&writer->lock);
+
+        if (writer->fd >= 0) {
+            writeRecords(writer, chunks);
+        } else {
+            writeFiles(writer, chunks);
+        }
+        size_t bytes = 0;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            bytes += chunks[i].length;
+            delete [] chunks[i].data;
+        }
+        chunks.clear();
+
+        pthread_mutex_lock(&writer->lock);
+        writer->queued -= bytes;
+        pthread_cond_broadcast(&writer->space);
+        pthread_mutex_unlock(&writer->lock);
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// queueChunk
+//
+//      Add chunk to the writer's queue, first waiting for room if the queue
+//      holds anything and chunk would take it past its bound.
+//----------------------------------------------------------------------------
+
+static void queueChunk(OutputWriter *writer, const OutputChunk &chunk)
+{
+    pthread_mutex_lock(&writer->lock);
+    while (writer->queued > 0
+            && writer->queued + chunk.length > writer->queueBytes) {
+        pthread_cond_wait(&writer->space, &writer->lock);
+    }
+    writer->queue.push_back(chunk);
+    writer->queued += chunk.length;
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+//----------------------------------------------------------------------------
+// startWriter
+//
+//      Start a writer that writes records to fd, or each sample to its own
+//      file if fd is -1, holding at most about queueBytes of text.  Returns
+//      NULL if its thread cannot be started.
+//----------------------------------------------------------------------------
+
+OutputWriter *startWriter(int fd, size_t queueBytes)
+{
+    OutputWriter *writer = new OutputWriter;
+    writer->fd = fd;
+    writer->queueBytes = queueBytes;
+    pthread_mutex_init(&writer->lock, 0);
+    pthread_cond_init(&writer->ready, 0);
+    pthread_cond_init(&writer->space, 0);
+    writer->queued = 0;
+    writer->stopping = false;
+    writer->failed = false;
+    if (pthread_create(&writer->thread, 0, writerThread, writer) != 0) {
+        fprintf(stderr, "markov: unable to start writer thread.\n");
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->ready);
+        pthread_cond_destroy(&writer->space);
+        delete writer;
+        return NULL;
+    }
+    return writer;
+}
+
+//----------------------------------------------------------------------------
+// writeChunk, endSample
+//
+//      Queue the next length bytes of the sample named name, which are
+//      copied, so data may be reused at once; and mark the end of the
+//      sample.  Safe to call from any number of threads, though the chunks
+//      of one sample must all come from one.
+//----------------------------------------------------------------------------
+
+void writeChunk(OutputWriter *writer, const char *name, const char *data,
+        size_t length)
+{
+    if (length == 0) {
+        return;
+    }
+    OutputChunk chunk;
+    chunk.name = name;
+    chunk.data = new char[length];
+    memcpy(chunk.data, data, length);
+    chunk.length = length;
+    queueChunk(writer, chunk);
+}
+
+void endSample(OutputWriter *writer, const char *name)
+{
+    OutputChunk chunk;
+    chunk.name = name;
+    chunk.data = NULL;
+    chunk.length = 0;
+    queueChunk(writer, chunk);
+}
+
+//----------------------------------------------------------------------------
+// stopWriter
+//
+//      Write out everything queued, stop the writer thread and free the
+//      writer.  Returns false if anything failed to be written.
+//----------------------------------------------------------------------------
+
+bool stopWriter(OutputWriter *writer)
+{
+    pthread_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, 0);
+
+    map<string, int>::iterator file;
+    for (file = writer->files.begin(); file != writer->files.end(); ++file) {
+        if (file->second >= 0) {
+            close(file->second);
+        }
+    }
+    bool failed = writer->failed;
+    pthread_mutex_destroy(&writer->lock);
+    pthread_cond_destroy(&writer->ready);
+    pthread_cond_destroy(&writer->space);
+    delete writer;
+    return !failed;
+}
+
+//----------------------------------------------------------------------------
+// sampleFileName
+//
+//      Fill in the name of the file for a sample: output.N, or output.K.N
+//      when a run generates several orders.  name must hold 32 bytes.
+//----------------------------------------------------------------------------
+
+void sampleFileName(char *name, int order, bool perOrder, int sample)
+{
+    if (perOrder) {
+        sprintf(name, "output.%d.%d", order, sample);
+    } else {
+        sprintf(name, "output.%d", sample);
+    }
+}
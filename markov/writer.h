@@ -0,0 +1,57 @@
+// writer.h --
+//
+// markov's output writer.  Generation threads hand it each sample's text a
+// chunk at a time, as the generator spills its buffer, and one thread of
+// its own writes the chunks out in the order they came, so generation only
+// waits on the disk when the writer falls a whole queue behind.
+//
+// Samples go either to their own files, output.N or output.K.N, or all to
+// one stream as a series of records.  Each record is a line
+//
+//      NAME LENGTH
+//
+// followed by LENGTH bytes of the sample named NAME, its file name.  A
+// sample's records come in order, but the records of samples generated at
+// the same time interleave; a record of length 0 ends a sample.
+//
+// Copyright (c) 2004-2009 Electric Cloud, Inc.
+// All rights reserved.
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//     * Redistributions of source code must retain the above copyright notice,
+//       this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above copyright
+//       notice, this list of conditions and the following disclaimer in the
+//       documentation and/or other materials provided with the distribution.
+//     * Neither the name of Electric Cloud nor the names of its employees may
+//       be used to endorse or promote products derived from this software
+//       without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef MARKOV_WRITER_H
+#define MARKOV_WRITER_H
+
+#include <stddef.h>
+
+struct OutputWriter;
+
+OutputWriter *startWriter(int fd, size_t queueBytes);
+void writeChunk(OutputWriter *writer, const char *name, const char *data,
+        size_t length);
+void endSample(OutputWriter *writer, const char *name);
+bool stopWriter(OutputWriter *writer);
+void sampleFileName(char *name, int order, bool perOrder, int sample);
+
+#endif